@@ -7,6 +7,7 @@
 
 #define debugEnabled   true
 #define decouplerComp   true   //Only for version Goteo 1.0
+#define benchEnabled    false  //"bench json" console command
 
 #if F_CPU == 8000000 
     #define FirmWare  "1.1-0.9.4"
@@ -48,7 +49,30 @@ static char* antennaExt[networks]  = {
   INT_ANT      , INT_ANT             };
 #endif      
 
+#define JSON_CHUNK           64     //Bytes of a JSON record handed to the WiFly UART at once (its TX buffer)
+#define BENCH_RECORDS        20     //Records rendered by "bench json" through each path
+
 #define TWI_FREQ 400000L //Frecuencia bus I2C
+#define TWI_QUEUE            4      //I2C transactions waiting for the bus (SCKTwi.h)
+#define TWI_TIMEOUT_MS       20     //Default time for one transaction, then the bus is recovered
+#define TWI_SDA              2      //PD1, driven by hand to recover a stuck bus
+#define TWI_SCL              3      //PD0
+
+/* 
+
+HEALTH TELEMETRY - Optional fields of the live reading, bit mask in the config block, SCKConfig::telemetry() ("set telemetry")
+
+*/
+
+#define TELEMETRY_FIFO       0x01   //Stored readings waiting when the live one was posted
+#define TELEMETRY_CONNECT    0x02   //Time to join the network (ms)
+#define TELEMETRY_RETRIES    0x04   //Failed command mode entries and open() attempts in this cycle
+#define TELEMETRY_CYCLE      0x08   //Duration of the previous posting cycle (ms)
+#define TELEMETRY_RESET      0x10   //Reset cause (SCKBase::resetCause())
+#define TELEMETRY_RAM        0x20   //Free RAM (bytes)
+#define TELEMETRY_NETS_AGE   0x40   //Age of the cached Wifi scan behind the nets reading (s)
+#define TELEMETRY_ALL        0x7F
+#define RESET_MARKER         0x5C4B //Left in .noinit RAM at boot, still there after a reset that kept the power
 
 #define WIFLY_LATEST_VERSION 475
 #define DEFAULT_WIFLY_FIRMWARE "ftp update wifly3-475.img"
@@ -78,6 +102,17 @@ ARDUINO ports definitions - GPIOS and ADCs
 #define S4 A0         //MICRO
 #define S5 A1         //LDR
 
+// Oversampling and decimation (SCKBase::oversample): 4^n readings summed and shifted right n times
+// give 10 + n bits. Resolution, and with it the number of samples, of every channel:
+#define ADC_FULL(bits)    (1023UL << ((bits) - 10))   //Full scale reading
+#define ADC_BITS_MICS     14    //256 samples, MICS load voltages are a few mV at clean air
+#define ADC_BITS_HEATER   12    //16 samples, heater current sense
+#define ADC_BITS_VCC      12
+#define ADC_BITS_NOISE    12
+#define ADC_BITS_LIGHT    11    //4 samples, LDR (Goteo board)
+#define ADC_BITS_BATTERY  12
+#define ADC_BITS_PANEL    11
+
 
 /* 
 
@@ -90,8 +125,107 @@ SENSOR READINGS - Defaults
 #define MAX_TIME_UPDATE      3600   //Max time between updates (one hour)
 #define DEFAULT_MIN_UPDATES  1      //Minimum number of updates before posting
 #define POST_MAX             20     //Max number of postings at a time
+#define liveFirst            true   //After an outage the live reading is posted first, the backlog follows in slices
+#define BACKFILL_SLICE       POST_MAX  //Stored readings posted per cycle while there is a backlog (liveFirst)
+#define RESPONSE_TIMEOUT     3000   //Wait for the Date header of the answer to a post (ms)
+#define TIME_DRIFT_MAX       2      //The RTC is only set from the server when it is off by more (s)
+#define BACKOFF_MIN          60000UL    //Wait after a failed upload, doubled for every failure in a row (ms)
+#define BACKOFF_MAX          3600000UL  //Longest wait between two upload attempts (ms)
+#define BACKOFF_LIKELY_MAX   600000UL   //Longest wait in an hour of the day the uploads usually work (ms)
+#define BACKOFF_LIKELY       128        //Score (0-255) from which an hour usually works
+#define BACKOFF_SAVE_INTERVAL 3600000UL //The backoff state is written to the EEPROM at most this often (ms)
 #define DEFAULT_MODE_SENSOR  NORMAL     //Type sensors capture (OFFLINE, NOWIFI, NORMAL, ECONOMIC)
 
+/*
+
+TASK SCHEDULE - Period, warm-up and budget of every task (ms). A period of 0 follows TimeUpdate.
+
+*/
+
+#define DHT22_MIN_INTERVAL   2000   //The DHT22 needs 2 seconds between readings
+#define DHT22_START_TIME     2      //Start signal, the line is held low at least 1 ms
+#define DHT22_READ_TIME      10     //The answer and its 40 bits take about 5 ms
+#define DHT22_RETRY_TIME     3000   //Wait after a failed read
+#define DHT22_RETRIES        5
+#define DHT22_BIT_THRESHOLD  48     //us, a high pulse of 26-28 us is a 0 and one of 70 us a 1
+#define DHT22_PCINT          PCINT6 //IO3 is PB6, its edges are timed by the pin change interrupt
+#define SHT21_T_TIME         85     //14 bit temperature conversion (ms)
+#define SHT21_RH_TIME        29     //12 bit humidity conversion (ms)
+#define SHT21_POLL_TIME      5      //The SHT21 NACKs its address until the conversion is done
+#define SHT21_POLLS          10
+#define CLIMATE_WAIT         5      //Publish waits for a temperature and humidity read in flight (ms)
+
+#define CLIMATE_PERIOD       0      //Temperature and humidity
+#define GAS_PERIOD           0      //MICS heaters and readings
+#define LIGHT_PERIOD         0
+#define POWER_PERIOD         0      //Battery and solar panel
+#define NOISE_PERIOD         0
+#define NETS_PERIOD          0      //Wifi scan (OFFLINE mode only)
+#define SCAN_INTERVAL        3600000UL  //The number of Wifi networks is cached, it is scanned again after this (ms)
+#define PUBLISH_PERIOD       0      //Store or post the readings
+#define MOTION_PERIOD        500    //Accelerometer FIFO drain (Kickstarter board only), within the 0.64 s it keeps
+
+#if F_CPU == 8000000
+  #define CLIMATE_BUDGET     50     //One step of the SHT21 read, the conversions run meanwhile
+#else
+  #define CLIMATE_BUDGET     50     //One step of the DHT22 read, retries are scheduled
+#endif
+#define HEATER_BUDGET        200
+#define GAS_BUDGET           1500
+#define LIGHT_BUDGET         20     //Continuous mode, only the last result is read
+#define POWER_BUDGET         100
+#define NOISE_BUDGET         300
+#define NETS_BUDGET          8000
+#define PUBLISH_BUDGET       60000
+#define MOTION_BUDGET        50
+
+/* 
+
+POWER MANAGEMENT - MCU sleep between tasks
+
+*/
+
+#define powerSaving          true   //Sleep the MCU while no task is due
+#define MIN_SLEEP_TIME       50     //Shorter waits are not worth sleeping (ms)
+#define MIN_RTC_SLEEP        5000   //Sleeps from this length on are checked against the RTC (ms)
+
+/*
+
+ACCELEROMETER - ADXL345 (Kickstarter board only). It samples on its own into its 32 entry FIFO,
+the motion task drains it. Its INT pins are not wired to the MCU, INT_SOURCE is read instead.
+
+*/
+
+#define ADXL_RATE            0x09   //BW_RATE code, 50 Hz: the FIFO keeps the last 0.64 s, MOTION_PERIOD must stay below it
+#define ADXL_MG_LSB          3.9    //mg per LSB in full resolution
+#define KNOCK_THRESHOLD      1000   //mg, ac-coupled activity that flags a knock (62.5 mg steps)
+#define TILT_LIMIT           20     //Degrees away from the orientation at boot that flag a tilt
+
+#define TAMPER_KNOCK         0x01   //Knocked since the last reading
+#define TAMPER_TILT          0x02   //Tilted from the orientation at boot
+
+/*
+
+LIGHT - BH1730FVC (Kickstarter board), continuous mode with the range picked from the last reading
+
+*/
+
+#define LIGHT_RANGES         5      //x1 10.8 ms, x1 102.6 ms, x2, x64 and x128 102.6 ms
+#define LIGHT_DEFAULT_RANGE  1
+#define LIGHT_HIGH           0xE000 //Counts, less sensitive range above this
+#define LIGHT_LOW            0x7000 //Counts expected in the next range, more sensitive range below this
+#define LIGHT_PENDING        0xFFFFFFFF
+
+/*
+
+TRACE - Event log of the network and sensor hot paths (SCKTrace.h)
+
+*/
+
+#define traceEnabled         true
+#define TRACE_EVENTS         16     //RAM ring, 8 bytes per event
+#define TRACE_EEPROM_EVENTS  96     //External EEPROM ring, from TRACE_EEPROM_ADDR to the end of the 24LC256
+
 /* 
 
 i2c ADDRESSES 
@@ -126,18 +260,23 @@ Internal EEPROM Memory Addresses
 
 */ 
 
-#define MAX_MEMORY                                  571 //Memory size
+#define MAX_MEMORY                                  ((TRACE_EEPROM_ADDR - DEFAULT_ADDR_MEASURES)/FIFO_RECORD_SIZE) //Readings that fit in the external EEPROM (524 Kickstarter, 551 Goteo)
+#define FIFO_COMPACT_LEVEL                          (MAX_MEMORY*3/4)  //Stored readings above which a full FIFO merges neighbours until a quarter of the records is gone, lightest first
 
 // SCK Configuration Parameters 
 #define EE_ADDR_TIME_VERSION                        0   //32BYTES 
+#define EE_ADDR_APIKEY                              56  //32BYTES Apikey of the device
+#define EE_ADDR_MAC                                 100  //32BYTES MAC of the device
+
+// Loose fields of the older firmware, only read to import them into the configuration block (SCKConfig.h)
 #define EE_ADDR_TIME_UPDATE                         32  //4BYTES Time between update and update of the sensors in seconds
 #define EE_ADDR_SENSOR_MODE                         36  //4BYTES Type sensors capture
 #define EE_ADDR_NUMBER_UPDATES                      40  //4BYTES Number of updates before posting
 #define EE_ADDR_NUMBER_READ_MEASURE                 44  //4BYTES Number of updates before posting
 #define EE_ADDR_NUMBER_WRITE_MEASURE                48  //4BYTES Number of updates before posting
 #define EE_ADDR_NUMBER_NETS                         52  //4BYTES Number of networks in the memory 
-#define EE_ADDR_APIKEY                              56  //32BYTES Apikey of the device
-#define EE_ADDR_MAC                                 100  //32BYTES MAC of the device
+#define EE_ADDR_TELEMETRY                           88  //4BYTES Health telemetry fields posted with the readings
+#define EE_ADDR_FIFO_LAYOUT                         92  //4BYTES FIFO_RECORD_SIZE of the stored readings (0: legacy layout)
 
 // SCK WIFI SETTINGS Parameters
 #define DEFAULT_ADDR_SSID                                150  //160 BYTES
@@ -145,6 +284,15 @@ Internal EEPROM Memory Addresses
 #define DEFAULT_ADDR_AUTH                                470  //160 BYTES 
 #define DEFAULT_ADDR_ANTENNA                             630  //160 BYTES
 
+// SCK CONFIGURATION BLOCK (SCKConfig.h), two slots
+#define CONFIG_ADDR                                      790
+#define CONFIG_SLOT_SIZE                                 32   //sizeof(SCKConfigBlock) is 18
+#define CONFIG_VERSION                                   1
+
+// SCK UPLOAD BACKOFF (SCKBackoff.h), hour of the day scores
+#define BACKOFF_ADDR                                     854  //27 BYTES
+#define BACKOFF_VERSION                                  1
+
 
 /* 
 
@@ -155,6 +303,9 @@ External EEPROM Memory Addresses
 // SCK DATA SPACE (Sensor readings can be stored here to do batch updates)
 #define DEFAULT_ADDR_MEASURES                            0
 
+// SCK TRACE LOG (after MAX_MEMORY readings, page aligned)
+#define TRACE_EEPROM_ADDR                                32000  //768 BYTES
+
 
 /* 
 
@@ -166,6 +317,13 @@ MICS PARAMETERS - Gas Sensor Addresses and Defaults
 #define MICS_2710 0x01
 
 #define RES 256   // Digital pot. resolution
+#if F_CPU == 8000000 
+  #define MCP_DEVICES    3    // MCP1, MCP2 and MCP3 (charger)
+#else
+  #define MCP_DEVICES    2
+#endif
+#define MCP_WIPERS       4    // Wipers kept in the RAM shadow of every pot
+#define MCP_UNKNOWN      -1   // Shadow entry not read yet (or last write failed)
 #define P1  100   //Digital potentiometer resistance 100Kohm
 
 #define  Rc0  10.       //Ohm.  Average current resistance for sensor MICS_5525/MICS_5524
@@ -184,6 +342,24 @@ MICS PARAMETERS - Gas Sensor Addresses and Defaults
   #define  VMIC1 2500.
 #endif
 
+#define MICS_5525_CURRENT   32      //mA. Heater current for the MICS5525
+#define MICS_2710_CURRENT   26      //mA. Heater current for the MICS2710
+
+#define HEATER_PERIOD       1000    //PI loop period while the heaters warm up (ms)
+#define HEATER_PERIOD_READY 10000   //PI loop period at thermal equilibrium (ms)
+#define HEATER_WARMUP       60000   //Minimum time from switch on to the first reading (ms)
+#define HEATER_KP           0.3     //Proportional gain (fraction of the heater resistance)
+#define HEATER_KI           0.5     //Integral gain, per loop
+#define HEATER_TOLERANCE    0.5     //mA. Current error to consider the heater stable
+#define HEATER_STABLE       5       //Stable loops in a row before a heater is ready
+#define ECONOMIC_GAS_PERIOD 3600000 //Gas readings period in ECONOMIC mode, heaters are off between them (ms)
+
+#define RL_MIN              2000    //Ohm. Minimum load resistor
+#define RANGE_LOW           0.5     //Rs/RL band where the load resistor is kept
+#define RANGE_HIGH          2.0
+#define RANGE_MIN           0.05    //Rs/RL limits where the divider saturates and the reading is taken again
+#define RANGE_MAX           20.
+
 #define reference 2560.
 #define second 1000
 #define minute 60000
@@ -210,75 +386,102 @@ BATTERY PARAMETERS - Battery sensing calibration parameters
 #define NORMAL    2  //Nomal mode o real time
 #define ECONOMIC  3  //Economic mode, sensor gas active one time for hour
 
-#define  SENSORS 9  //Numbers of sensors in the board
+/*
+
+SENSOR REGISTRY - One row per reading, everything else is generated from this list:
+
+  X(id, JSON key, console label, console units, console scale, FIFO bytes, merge)
+
+  - id      : index in value[], SENSORS is the number of rows
+  - scale   : the console prints value/scale (with decimals when scale > 1)
+  - bytes   : 1 to 4, stored MSB first and sign extended on read
+  - merge   : how two stored readings are combined when the FIFO is compacted,
+              MERGE_MEAN (weighted by the readings behind each), MERGE_MIN or MERGE_MAX
+  
+  Adding a reading is one row plus the update that fills value[id], e.g. a new
+  reading of the Kickstarter board:
+
+  X(SENSOR_ACCEL, "accel", "Acceleration: ", " mg", 1, 2, MERGE_MAX)
+
+  Readings stored by a previous layout are dropped at boot (SCKConfig::fifoLayout()).
+
+*/
+
+#if F_CPU == 8000000 
+  #define SENSOR_LIST(X) \
+    X(SENSOR_TEMP,  "temp",  "Temperature: ",      " C RAW", 1,    4, MERGE_MEAN) \
+    X(SENSOR_HUM,   "hum",   "Humidity: ",         " % RAW", 1,    4, MERGE_MEAN) \
+    X(SENSOR_LIGHT, "light", "Light: ",            " lx",    10,   4, MERGE_MEAN) \
+    X(SENSOR_BAT,   "bat",   "Battery: ",          " %",     10,   4, MERGE_MEAN) \
+    X(SENSOR_PANEL, "panel", "Solar Panel: ",      " mV",    1,    4, MERGE_MEAN) \
+    X(SENSOR_CO,    "co",    "Carbon Monxide: ",   " kOhm",  1000, 4, MERGE_MEAN) \
+    X(SENSOR_NO2,   "no2",   "Nitrogen Dioxide: ", " kOhm",  1000, 4, MERGE_MEAN) \
+    X(SENSOR_NOISE, "noise", "Noise: ",            " mV",    1,    4, MERGE_MEAN) \
+    X(SENSOR_NETS,  "nets",  "Wifi Spots: ",       "",       1,    4, MERGE_MEAN) \
+    X(SENSOR_VIB,   "vib",   "Vibration: ",        " mg",    1,    2, MERGE_MAX) \
+    X(SENSOR_TAMPER,"tamper","Tamper: ",           "",       1,    1, MERGE_MAX)
+#else
+  #define SENSOR_LIST(X) \
+    X(SENSOR_TEMP,  "temp",  "Temperature: ",      " C",     10,   4, MERGE_MEAN) \
+    X(SENSOR_HUM,   "hum",   "Humidity: ",         " %",     10,   4, MERGE_MEAN) \
+    X(SENSOR_LIGHT, "light", "Light: ",            " %",     10,   4, MERGE_MEAN) \
+    X(SENSOR_BAT,   "bat",   "Battery: ",          " %",     10,   4, MERGE_MEAN) \
+    X(SENSOR_PANEL, "panel", "Solar Panel: ",      " mV",    1,    4, MERGE_MEAN) \
+    X(SENSOR_CO,    "co",    "Carbon Monxide: ",   " kOhm",  1000, 4, MERGE_MEAN) \
+    X(SENSOR_NO2,   "no2",   "Nitrogen Dioxide: ", " kOhm",  1000, 4, MERGE_MEAN) \
+    X(SENSOR_NOISE, "noise", "Noise: ",            " mV",    1,    4, MERGE_MEAN) \
+    X(SENSOR_NETS,  "nets",  "Wifi Spots: ",       "",       1,    4, MERGE_MEAN)
+#endif
+
+#define SENSOR_X_ID(id, key, label, units, scale, bytes, merge)     id,
+#define SENSOR_X_KEY(id, key, label, units, scale, bytes, merge)    key,
+#define SENSOR_X_LABEL(id, key, label, units, scale, bytes, merge)  label,
+#define SENSOR_X_UNITS(id, key, label, units, scale, bytes, merge)  units,
+#define SENSOR_X_SCALE(id, key, label, units, scale, bytes, merge)  scale,
+#define SENSOR_X_BYTES(id, key, label, units, scale, bytes, merge)  bytes,
+#define SENSOR_X_SIZE(id, key, label, units, scale, bytes, merge)   bytes +
+#define SENSOR_X_MERGE(id, key, label, units, scale, bytes, merge)  merge,
+#define SENSOR_X_VALID(id, key, label, units, scale, bytes, merge)  && (bytes >= 1) && (bytes <= 4) && (scale >= 1) && (merge <= MERGE_MAX)
+
+#define MERGE_MEAN  0
+#define MERGE_MIN   1
+#define MERGE_MAX   2
+
+enum { SENSOR_LIST(SENSOR_X_ID) SENSORS };  //SENSORS: numbers of sensors in the board
+
+static const char* const   SENSOR_KEY[SENSORS]   = { SENSOR_LIST(SENSOR_X_KEY) };
+static const char* const   SENSOR_LABEL[SENSORS] = { SENSOR_LIST(SENSOR_X_LABEL) };
+static const char* const   SENSOR_UNITS[SENSORS] = { SENSOR_LIST(SENSOR_X_UNITS) };
+static const unsigned int  SENSOR_SCALE[SENSORS] = { SENSOR_LIST(SENSOR_X_SCALE) };
+static const unsigned char SENSOR_BYTES[SENSORS] = { SENSOR_LIST(SENSOR_X_BYTES) };
+static const unsigned char SENSOR_MERGE[SENSORS] = { SENSOR_LIST(SENSOR_X_MERGE) };
+
+// External EEPROM FIFO record: every reading, the timestamp, then the number of readings merged into it
+#define TIMESTAMP_BYTES      20
+#define FIFO_WEIGHT_BYTES    2
+#define FIFO_RECORD_SIZE     (SENSOR_LIST(SENSOR_X_SIZE) TIMESTAMP_BYTES + FIFO_WEIGHT_BYTES)
+#define FIFO_LEGACY_SIZE     (9*4 + TIMESTAMP_BYTES)  //Layout before the registry, nine 4 byte readings
 
 #define buffer_length        32
 static char buffer[buffer_length];
 
 // Basic Server Posts to the SmartCitizen Platform - EndPoint: http://data.smartcitizen.me/add 
-static char* WEB[8]={
-                  "data.smartcitizen.me",
-                  "PUT /add HTTP/1.1\n", 
-                  "Host: data.smartcitizen.me \n", 
-                  "User-Agent: SmartCitizen \n", 
-                  "X-SmartCitizenMacADDR: ", 
-                  "X-SmartCitizenApiKey: ", 
-                  "X-SmartCitizenVersion: ",  
-                  "X-SmartCitizenData: "};
+// Request header template (flash): the MAC and the apikey go after the first and the second part
+#define WEB_HOST      "data.smartcitizen.me"
+#define WEB_HEADER    "PUT /add HTTP/1.1\n" \
+                      "Host: data.smartcitizen.me \n" \
+                      "User-Agent: SmartCitizen \n" \
+                      "X-SmartCitizenMacADDR: "
+#define WEB_APIKEY    "\r\nX-SmartCitizenApiKey: "
+#define WEB_VERSION   "\r\nX-SmartCitizenVersion: " FirmWare "\r\n" \
+                      "X-SmartCitizenData: "
   
-// Time server request -  EndPoint: http://data.smartcitizen.me/datetime                 
+// Time server request -  EndPoint: http://data.smartcitizen.me/datetime
+// Only used while the RTC has no valid time, otherwise the answer to the post sets it
 static char* WEBTIME[3]={                  
                   /*Servidor de tiempo*/
                   "GET /datetime HTTP/1.1\n",
                   "Host: data.smartcitizen.me \n",
                   "User-Agent: SmartCitizen \n\n"  
                   };
-
-// Data JSON structure                  
-static char* SERVER[11]={
-                  "{\"temp\":\"",
-                  "\",\"hum\":\"", 
-                  "\",\"light\":\"",
-                  "\",\"bat\":\"",
-                  "\",\"panel\":\"",
-                  "\",\"co\":\"", 
-                  "\",\"no2\":\"", 
-                  "\",\"noise\":\"", 
-                  "\",\"nets\":\"", 
-                  "\",\"timestamp\":\"", 
-                  "\"}"
-                  };
-                  
-static char* SENSOR[10]={
-                  "Temperature: ",
-                  "Humidity: ",
-                  "Light: ",
-                  "Battery: ",
-                  "Solar Panel: ",
-                  "Carbon Monxide: ",
-                  "Nitrogen Dioxide: ",
-                  "Noise: ",
-                  "Wifi Spots: ",
-                  "UTC: " 
-                };
-
-static char* UNITS[9]={
-                  #if F_CPU == 8000000 
-                    " C RAW",
-                    " % RAW",
-                  #else
-                    " C",
-                    " %",
-                  #endif
-                  #if F_CPU == 8000000 
-                    " lx",
-                  #else
-                    " %",
-                  #endif
-                    " %",
-                    " mV",
-                    " kOhm",
-                    " kOhm",
-                    " mV",
-                    "",
-                  };  
+  
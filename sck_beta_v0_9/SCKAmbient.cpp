@@ -19,7 +19,12 @@
 #include "SCKAmbient.h"
 #include "SCKBase.h"
 #include "SCKServer.h"
-#include <Wire.h>
+#include "SCKScheduler.h"
+#include "SCKStage.h"
+#include "SCKTrace.h"
+#include "SCKTwi.h"
+#include "SCKConfig.h"
+#include "SCKBackoff.h"
 #include <EEPROM.h>
 
 /* 
@@ -41,6 +46,7 @@ SENSOR Contants and Defaults
 SCKBase base_;
 SCKServer server_;
 SCKAmbient ambient_;
+SCKScheduler scheduler_;
   
   
   long value[SENSORS];
@@ -62,13 +68,33 @@ float RoNO2 = 2200;
 float RsCO = 0;
 float RsNO2 = 0;
 
+// MICS heater control, indexed by device (MICS_5525, MICS_2710)
+byte     heaterState[2]    = {HEATER_OFF, HEATER_OFF};
+uint32_t heaterStart[2]    = {0, 0};    // millis() when the heater was switched on
+float    heaterError[2]    = {0, 0};    // Last current error (mA)
+byte     heaterStable[2]   = {0, 0};    // Loops in a row within HEATER_TOLERANCE
+
+// MICS load resistor auto-ranging, indexed by device
+int      loadStep[2]       = {0, 0};    // Load resistor pot setting, as last written
+float    lastRs[2]         = {0, 0};    // Previous Rs (Ohm), to predict the next range
+uint16_t rangeChanges[2]   = {0, 0};    // Load resistor rewrites
+uint16_t rangeRereads[2]   = {0, 0};    // Saturated readings taken again after re-ranging
+
 
 #if F_CPU == 8000000 
   uint32_t lastHumidity;
   uint32_t lastTemperature;
-  int accel_x=0;
+  int accel_x=0;                 // Mean of the last motion reading (LSB)
   int accel_y=0;
   int accel_z=0;
+  int accelRef[3];               // Orientation at boot, for the tilt check
+  boolean accelRefValid = false;
+  // Samples drained since the last publish, around the first one so the squares stay small
+  int accelShift[3];
+  long accelSum[3];
+  float accelSquares[3];
+  unsigned long accelCount = 0;
+  boolean accelKnock = false;
 #else
   int lastHumidity;
   int lastTemperature;
@@ -80,6 +106,7 @@ void SCKAmbient::begin() {
     decoupler.setup();
   #endif
   base_.config();
+  SCKTrace::begin();
   #if F_CPU == 8000000 
     base_.writeCharge(350);
   #endif
@@ -93,11 +120,14 @@ void SCKAmbient::begin() {
   
     pinMode(IO3, OUTPUT);
     digitalWrite(IO3, HIGH);     // MICS POWER LINE 
-    writeADXL(0x2D, 0x08);
-    //  WriteADXL(0x31, 0x00); //2g
-    //  WriteADXL(0x31, 0x01); //4g
-    writeADXL(0x31, 0x02); //8g
-    //  WriteADXL(0x31, 0x03); //16g
+    writeADXL(0x2C, ADXL_RATE);                           //BW_RATE
+    writeADXL(0x31, 0x0A);                                //DATA_FORMAT: full resolution, 8g
+    writeADXL(0x24, KNOCK_THRESHOLD/62.5);                //THRESH_ACT
+    writeADXL(0x27, 0xF0);                                //ACT_INACT_CTL: ac-coupled activity on x, y and z
+    writeADXL(0x2E, 0x10);                                //INT_ENABLE: activity, latched in INT_SOURCE
+    writeADXL(0x38, 0x80 | 31);                           //FIFO_CTL: stream mode, watermark at 31 entries
+    writeADXL(0x2D, 0x08);                                //POWER_CTL: measure
+    setLightRange(LIGHT_DEFAULT_RANGE);
   #else
     writeVH(MICS_5525, 2400);    // MICS5525_START
     digitalWrite(IO0, HIGH);     // MICS5525
@@ -110,6 +140,8 @@ void SCKAmbient::begin() {
     writeRL(MICS_5525, 100000);  // START LOADING MICS5525
     writeRL(MICS_2710, 100000);  // START LOADING MICS2710
 
+    GasSensor(true);
+
 }
 
 /* 
@@ -125,19 +157,30 @@ uint32_t  TimeUpdate   = 0;  // Sensor Readings time interval in sec.
 uint32_t  NumUpdates   = 0;  // Min. number of sensor readings before publishing
 uint32_t  nets           = 0;
 boolean sleep         = true; 
-uint32_t timetransmit = 0; 
 uint32_t timeMICS = 0;
 boolean RTCupdatedSinceBoot = false;
+boolean instantPost   = false;  // Post the readings now, don't wait for NumUpdates
+boolean climateBusy   = false;  // A temperature and humidity read is in flight, publish waits for it
+
+byte heaterTask  = NO_TASK;
+byte climateTask = NO_TASK;
+byte gasTask     = NO_TASK;
+byte lightTask   = NO_TASK;
+byte powerTask   = NO_TASK;
+byte noiseTask   = NO_TASK;
+byte netsTask    = NO_TASK;
+byte publishTask = NO_TASK;
+byte motionTask  = NO_TASK;
 
 void SCKAmbient::ini()
   {
     debugON = false;
     /*init WiFly*/
     digitalWrite(AWAKE, HIGH); 
-    sensor_mode = sensor_mode = base_.readData(EE_ADDR_SENSOR_MODE, INTERNAL);  //Normal mode
-    TimeUpdate = base_.readData(EE_ADDR_TIME_UPDATE, INTERNAL);    //Time between transmissions in sec.
-    NumUpdates = base_.readData(EE_ADDR_NUMBER_UPDATES, INTERNAL); //Number of readings before batch update
-    nets = base_.readData(EE_ADDR_NUMBER_NETS, INTERNAL);
+    sensor_mode = SCKConfig::sensorMode();    //Normal mode
+    TimeUpdate = SCKConfig::timeUpdate();     //Time between transmissions in sec.
+    NumUpdates = SCKConfig::numberUpdates();  //Number of readings before batch update
+    nets = SCKConfig::nets();
     if (TimeUpdate*NumUpdates < 60) sleep = false;
     else sleep = true;
     if (base_.connect()) {
@@ -176,9 +219,47 @@ void SCKAmbient::ini()
         }
       #endif
     }
-    timetransmit = millis();
     wait_moment = false;
-    timeMICS = millis();
+    schedule();
+  }
+
+#define periodOf(period) ((period) ? (uint32_t)(period) : (uint32_t)TimeUpdate*second)
+
+void SCKAmbient::schedule()
+  {
+    // The boot reading is taken by execute(true), so every task waits one period (warm-up) before its first run
+    uint32_t climate = periodOf(CLIMATE_PERIOD);
+    #if F_CPU != 8000000
+      if (climate < DHT22_MIN_INTERVAL) climate = DHT22_MIN_INTERVAL;
+    #endif
+    if (publishTask == NO_TASK)
+      {
+        // Sensors are added first so a publish due at the same time sends fresh readings
+        scheduler_.begin();
+        heaterTask  = scheduler_.add(taskHeater, HEATER_PERIOD, HEATER_PERIOD, HEATER_BUDGET);
+        climateTask = scheduler_.add(taskClimate, climate, climate, CLIMATE_BUDGET);
+        gasTask     = scheduler_.add(taskGas, periodOf(GAS_PERIOD), periodOf(GAS_PERIOD), GAS_BUDGET);
+        lightTask   = scheduler_.add(taskLight, periodOf(LIGHT_PERIOD), periodOf(LIGHT_PERIOD), LIGHT_BUDGET);
+        powerTask   = scheduler_.add(taskPower, periodOf(POWER_PERIOD), periodOf(POWER_PERIOD), POWER_BUDGET);
+        noiseTask   = scheduler_.add(taskNoise, periodOf(NOISE_PERIOD), periodOf(NOISE_PERIOD), NOISE_BUDGET);
+        netsTask    = scheduler_.add(taskNets, periodOf(NETS_PERIOD), periodOf(NETS_PERIOD), NETS_BUDGET);
+        #if F_CPU == 8000000
+          motionTask = scheduler_.add(taskMotion, periodOf(MOTION_PERIOD), periodOf(MOTION_PERIOD), MOTION_BUDGET);
+        #endif
+        publishTask = scheduler_.add(taskPublish, periodOf(PUBLISH_PERIOD), periodOf(PUBLISH_PERIOD), PUBLISH_BUDGET);
+      }
+    else
+      {
+        scheduler_.setPeriod(climateTask, climate);
+        scheduler_.setPeriod(gasTask, periodOf(GAS_PERIOD));
+        scheduler_.setPeriod(lightTask, periodOf(LIGHT_PERIOD));
+        scheduler_.setPeriod(powerTask, periodOf(POWER_PERIOD));
+        scheduler_.setPeriod(noiseTask, periodOf(NOISE_PERIOD));
+        scheduler_.setPeriod(netsTask, periodOf(NETS_PERIOD));
+        scheduler_.setPeriod(motionTask, periodOf(MOTION_PERIOD));
+        scheduler_.setPeriod(publishTask, periodOf(PUBLISH_PERIOD));
+      }
+    scheduler_.enable(netsTask, sensor_mode == OFFLINE);
   }
   
   float k= (RES*(float)R1/100)/1000; //Voltatge Constant for the Voltage reg.
@@ -227,6 +308,8 @@ void SCKAmbient::ini()
   void SCKAmbient::writeRL(byte device, long resistor) {
     int data=0x00;
     data = (int)(resistor/kr1);
+    if (data>RES) data = RES;
+    loadStep[device] = data;
     #if F_CPU == 8000000 
       base_.writeMCP(MCP1, device + 6, data);
     #else
@@ -243,10 +326,10 @@ void SCKAmbient::ini()
     #endif 
   }
 
-  void SCKAmbient::writeRGAIN(byte device, long resistor) {
+  boolean SCKAmbient::writeRGAIN(byte device, long resistor) {
     int data=0x00;
     data = (int)(resistor/kr1);
-    base_.writeMCP(MCP2, device, data);
+    return base_.writeMCP(MCP2, device, data);
   }
   
   float SCKAmbient::readRGAIN(byte device)
@@ -254,24 +337,27 @@ void SCKAmbient::ini()
       return (kr1*base_.readMCP(MCP2, device));    // Returns Resistance (Ohms)
   }
 
-  void SCKAmbient::writeGAIN(long value)
+  boolean SCKAmbient::writeGAIN(long value)
   {
+    // Returns true if the gain changed, only then the amplifier needs to settle
+    boolean changed = false;
     if (value == 100)
     {
-      writeRGAIN(0x00, 10000);
-      writeRGAIN(0x01, 10000);
+      changed |= writeRGAIN(0x00, 10000);
+      changed |= writeRGAIN(0x01, 10000);
     }
     else if (value == 1000)
     {
-      writeRGAIN(0x00, 10000);
-      writeRGAIN(0x01, 100000);
+      changed |= writeRGAIN(0x00, 10000);
+      changed |= writeRGAIN(0x01, 100000);
     }
     else if (value == 10000)
           {
-             writeRGAIN(0x00, 100000);
-             writeRGAIN(0x01, 100000);
+             changed |= writeRGAIN(0x00, 100000);
+             changed |= writeRGAIN(0x01, 100000);
           }
-    delay(100);
+    if (changed) delay(100);
+    return changed;
   }
 
   float SCKAmbient::readGAIN()
@@ -281,26 +367,38 @@ void SCKAmbient::ini()
 
   void SCKAmbient::getVcc()
   {
-    float temp = base_.average(S3);
+    float temp = base_.oversample(S3, ADC_BITS_VCC);
     analogReference(INTERNAL);
     delay(100);
-    Vcc = (float)(base_.average(S3)/temp)*reference;
+    Vcc = (float)(base_.oversample(S3, ADC_BITS_VCC)/temp)*reference;
     analogReference(DEFAULT);
     delay(100);
   }
   
   void SCKAmbient::heat(byte device, int current)
   {
+    // One step of the PI loop on the heater current (velocity form, gains scaled by the heater resistance)
     float Rc=Rc0;
     byte Sensor = S2;
     if (device == MICS_2710) { Rc=Rc1; Sensor = S3;}
 
-    float Vc = (float)base_.average(Sensor)*Vcc/1023; //mV 
+    float Vc = (float)base_.oversample(Sensor, ADC_BITS_HEATER)*Vcc/ADC_FULL(ADC_BITS_HEATER); //mV 
     float current_measure = Vc/Rc; //mA 
-    float Rh = (readVH(device)- Vc)/current_measure;
-    float Vh = (Rh + Rc)*current;
-
+    if (current_measure < 0.1) return; //Heater switched off or not connected
+    float Vh = readVH(device);
+    float Rh = (Vh - Vc)/current_measure;
+    float error = current - current_measure;
+    Vh = Vh + (Rh + Rc)*(HEATER_KP*(error - heaterError[device]) + HEATER_KI*error);
+    heaterError[device] = error;
     writeVH(device, Vh);
+
+    if (fabs(error) <= HEATER_TOLERANCE) 
+      {
+        if (heaterStable[device] < HEATER_STABLE) heaterStable[device]++;
+      }
+    else heaterStable[device] = 0;
+    if ((heaterState[device] == HEATER_WARMING) && (heaterStable[device] >= HEATER_STABLE) && ((millis() - heaterStart[device]) >= HEATER_WARMUP)) heaterState[device] = HEATER_READY;
+    else if ((heaterState[device] == HEATER_READY) && (fabs(error) > 4*HEATER_TOLERANCE)) heaterState[device] = HEATER_WARMING;
       #if debugAmbient
         if (device == MICS_2710) Serial.print("MICS2710 current: ");
         else Serial.print("MICS5525 current: ");
@@ -308,17 +406,33 @@ void SCKAmbient::ini()
         Serial.println(" mA");
         if (device == MICS_2710) Serial.print("MICS2710 correction VH: ");
         else  Serial.print("MICS5525 correction VH: ");
-        Serial.print(readVH(device));
+        Serial.print(Vh);
         Serial.println(" mV");
-        Vc = (float)base_.average(Sensor)*Vcc/1023; //mV 
-        current_measure = Vc/Rc; //mA 
-        if (device == MICS_2710) Serial.print("MICS2710 current adjusted: ");
-        else Serial.print("MICS5525 current adjusted: ");
-        Serial.print(current_measure);
-        Serial.println(" mA");
-        Serial.println("Heating...");
+        if (heaterState[device] == HEATER_READY) Serial.println("Ready");
+        else Serial.println("Heating...");
       #endif
-    
+  }
+
+  void SCKAmbient::heaterControl()
+  {
+    if (sensor_mode == ECONOMIC)
+      {
+        if ((heaterState[MICS_5525] == HEATER_OFF) && ((millis() - timeMICS) >= ECONOMIC_GAS_PERIOD)) GasSensor(true);
+      }
+    else if (heaterState[MICS_5525] == HEATER_OFF) GasSensor(true);
+    if (heaterState[MICS_5525] == HEATER_OFF) return;
+
+    heat(MICS_5525, MICS_5525_CURRENT);
+    heat(MICS_2710, MICS_2710_CURRENT);
+
+    boolean ready = heaterReady(MICS_5525) && heaterReady(MICS_2710);
+    scheduler_.setPeriod(heaterTask, ready ? HEATER_PERIOD_READY : HEATER_PERIOD);
+    if (ready && (sensor_mode == ECONOMIC)) scheduler_.trigger(gasTask); // Read now, the heaters go off right after
+  }
+
+  boolean SCKAmbient::heaterReady(byte device)
+  {
+    return (heaterState[device] == HEATER_READY);
   }
 
    float SCKAmbient::readRs(byte device)
@@ -326,8 +440,8 @@ void SCKAmbient::ini()
      byte Sensor = S0;
      float VMICS = VMIC0;
      if (device == MICS_2710) {Sensor = S1; VMICS = VMIC1;}
-     float RL = readRL(device); //Ohm
-     float VL = ((float)base_.average(Sensor)*Vcc)/1023; //mV
+     float RL = kr1*loadStep[device]; //Ohm
+     float VL = ((float)base_.oversample(Sensor, ADC_BITS_MICS)*Vcc)/ADC_FULL(ADC_BITS_MICS); //mV
      if (VL > VMICS) VL = VMICS;
      float Rs = ((VMICS-VL)/VL)*RL; //Ohm
      #if debugAmbient
@@ -344,23 +458,69 @@ void SCKAmbient::ini()
   float SCKAmbient::readMICS(byte device)
   {
       float Rs = readRs(device);
-      float RL = readRL(device); //Ohm
+      float ratio = Rs/(kr1*loadStep[device]);
       
-      // Charging impedance correction
-      if ((Rs <= (RL - 1000))||(Rs >= (RL + 1000)))
+      // Charging impedance correction, only out of the RANGE_LOW..RANGE_HIGH band
+      if ((ratio < RANGE_LOW)||(ratio > RANGE_HIGH))
       {
-        if (Rs < 2000) writeRL(device, 2000);
-        else writeRL(device, Rs);
-        delay(100);
-        Rs = readRs(device);
+        float predicted = Rs;
+        if (lastRs[device] > 0) predicted = 2*Rs - lastRs[device]; // Follow the trend of the last two readings
+        if (rangeRL(device, predicted) && ((ratio < RANGE_MIN)||(ratio > RANGE_MAX)))
+        {
+          // The divider was saturated, this reading is not good enough
+          delay(100);
+          Rs = readRs(device);
+          rangeRereads[device]++;
+        }
       }
-       return Rs;
+      lastRs[device] = Rs;
+      return Rs;
+  }
+
+  boolean SCKAmbient::rangeRL(byte device, float resistor)
+  {
+      // Returns true if the load resistor changed
+      if (resistor < RL_MIN) resistor = RL_MIN;
+      int data = (int)(resistor/kr1);
+      if (data>RES) data = RES;
+      if (data == loadStep[device]) return false;  // Already at the limit of the pot
+      writeRL(device, resistor);
+      rangeChanges[device]++;
+      #if debugAmbient
+        if (device == MICS_5525) Serial.print("MICS5525 RL: ");
+        else Serial.print("MICS2710 RL: ");
+        Serial.print(kr1*loadStep[device]);
+        Serial.println(" Ohm");
+      #endif
+      return true;
+  }
+
+  void SCKAmbient::printRanges()
+  {
+      for (byte device = MICS_5525; device <= MICS_2710; device++)
+        {
+          if (device == MICS_5525) Serial.print(F("MICS5525 RL: "));
+          else Serial.print(F("MICS2710 RL: "));
+          Serial.print(kr1*loadStep[device]);
+          Serial.print(F(" Ohm, changes: "));
+          Serial.print(rangeChanges[device]);
+          Serial.print(F(", rereads: "));
+          Serial.println(rangeRereads[device]);
+        }
   }
   
   void SCKAmbient::GasSensor(boolean active)
   {
+    for (byte device = MICS_5525; device <= MICS_2710; device++)
+      {
+        heaterState[device]  = active ? HEATER_WARMING : HEATER_OFF;
+        heaterStart[device]  = millis();
+        heaterError[device]  = 0;
+        heaterStable[device] = 0;
+      }
     if (active)
       {
+        timeMICS = millis();
         #if F_CPU == 8000000   
           digitalWrite(IO0, HIGH);     // MICS5525
           digitalWrite(IO1, HIGH);     // MICS2710_HEATHER
@@ -389,133 +549,192 @@ void SCKAmbient::ini()
   
   void SCKAmbient::getMICS(){          
        
-        // Charging tension heaters
-        heat(MICS_5525, 32); //Corriente en mA
-        heat(MICS_2710, 26); //Corriente en mA
-        
+        // Heaters are regulated by heaterControl(), only read at thermal equilibrium
         RsCO = readMICS(MICS_5525);
         RsNO2 = readMICS(MICS_2710);
          
   }
 
  #if F_CPU == 8000000
-   uint16_t SCKAmbient::readSHT21(uint8_t type){
-      uint16_t DATA = 0;
-      Wire.beginTransmission(Temperature);
-      Wire.write(type);
-      Wire.endTransmission();
-      Wire.requestFrom(Temperature,2);
-      unsigned long time = millis();
-      while (!Wire.available()) if ((millis() - time)>500) return 0x00;
-      DATA = Wire.read()<<8; 
-      while (!Wire.available()); 
-      DATA = (DATA|Wire.read()); 
-      DATA &= ~0x0003; 
-      return DATA;
-  }
-  
-   void SCKAmbient::getSHT21()
-   {
-        lastTemperature = readSHT21(0xE3);  // RAW DATA for calibration in platform
-        lastHumidity    = readSHT21(0xE5);  // RAW DATA for calibration in platform
-      #if debugAmbient
-        Serial.print("SHT21:  ");
-        Serial.print("Temperature: ");
-        Serial.print(lastTemperature/10.);
-        Serial.print(" C, Humidity: ");
-        Serial.print(lastHumidity/10.);
-        Serial.println(" %");    
-      #endif
+    #define SHT_IDLE         0
+    #define SHT_TEMPERATURE  1
+    #define SHT_HUMIDITY     2
+    #define SHT_BAD_CRC      6   // readSHT21() status, next to the TWI ones
+    
+    byte shtStep  = SHT_IDLE;
+    byte shtPolls = 0;
+    boolean shtValid = false;
+    
+    uint8_t crcSHT21(const uint8_t *data, byte length)
+    {
+      // CRC-8, polynomial x^8 + x^5 + x^4 + 1 (0x31), initial value 0
+      uint8_t crc = 0;
+      for (byte i=0; i<length; i++)
+      {
+        crc ^= data[i];
+        for (byte bit=0; bit<8; bit++) crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : (crc << 1);
+      }
+      return crc;
+    }
+    
+    void SCKAmbient::startSHT21(uint8_t command)
+    {
+      // No hold master (0xF3, 0xF5): the SHT21 converts on its own and NACKs its address until it is done
+      SCKTwi::write(Temperature, &command, 1);
+      shtPolls = 0;
+    }
+    
+    uint8_t SCKAmbient::readSHT21(uint32_t *value)
+    {
+      uint8_t rdata[3];   // MSB, LSB, CRC
+      uint8_t status = SCKTwi::transfer(Temperature, 0, 0, rdata, 3);
+      if (status != TWI_OK) return status;
+      if (crcSHT21(rdata, 2) != rdata[2]) return SHT_BAD_CRC;
+      *value = ((uint16_t)(rdata[0]<<8)|rdata[1]) & ~0x0003;  // RAW DATA for calibration in platform
+      return TWI_OK;
     }
     
     void SCKAmbient::writeADXL(byte address, byte val) {
-       Wire.beginTransmission(ADXL);    // Start transmission to device 
-       Wire.write(address);             // Write register address
-       Wire.write(val);                 // Write value to write
-       Wire.endTransmission();          // End transmission
+       uint8_t data[2] = {address, val};  // Register address, value
+       SCKTwi::write(ADXL, data, 2);
     }
     
     //reads num bytes starting from address register on device in to buff array
     void SCKAmbient::readADXL(byte address, int num, byte buff[]) {
-      Wire.beginTransmission(ADXL);     //start transmission to device 
-      Wire.write(address);              //writes address to read from
-      Wire.endTransmission();           //end transmission
-      
-      Wire.beginTransmission(ADXL);     //start transmission to device
-      Wire.requestFrom(ADXL, num);      // request 6 bytes from device
-      
-      int i = 0;
-      unsigned long time = millis();
-      while (!Wire.available()) 
+      SCKTwi::read(ADXL, address, buff, num);  //zeros if the device does not answer
+    }
+    
+    void SCKAmbient::updateMotion()
+    {
+      // Samples the ADXL345 took on its own, the newest ones are kept in its FIFO (stream mode).
+      // The task runs more often than the FIFO fills, every sample since the last publish counts.
+      byte buffADXL[6];    //6 bytes buffer for saving data read from the device
+      readADXL(0x30, 1, buffADXL);             //INT_SOURCE, reading it clears the activity flag
+      if (buffADXL[0] & 0x10) accelKnock = true;
+      readADXL(0x39, 1, buffADXL);             //FIFO_STATUS
+      byte entries = buffADXL[0] & 0x3F;
+      for (byte i=0; i<entries; i++)
       {
-        if ((millis() - time)>500) 
+        readADXL(0x32, 6, buffADXL);           //Every 6 byte read pops one entry
+        for (byte axis=0; axis<3; axis++)
         {
-          for(int i=0; i<num; i++) buff[i]=0x00;
-          break;
+          int sample = (int16_t)((((int)buffADXL[2*axis + 1]) << 8) | buffADXL[2*axis]);   //Two's complement, LSB first
+          if (accelCount == 0) accelShift[axis] = sample;
+          long delta = sample - accelShift[axis];
+          accelSum[axis] += delta;
+          accelSquares[axis] += (float)(delta*delta);
         }
+        accelCount++;
       }
-      while(Wire.available())            //device may write less than requested (abnormal)
-      { 
-        buff[i] = Wire.read();           // read a byte
-        i++;
+      
+      if (accelCount == 0)                     // No samples yet, no stale values either
+      {
+        value[SENSOR_VIB] = 0;
+        value[SENSOR_TAMPER] = 0;
+        return;
       }
-      Wire.endTransmission();            //end transmission
-    }
-    
-    void SCKAmbient::averageADXL()
-    {
-      #define lim 512
-      int temp_x=0;
-      int temp_y=0;
-      int temp_z=0;
-      int lecturas=10;
-      byte buffADXL[6] ;    //6 bytes buffer for saving data read from the device
-      accel_x=0;
-      accel_y=0;
-      accel_z=0;
       
-      for(int i=0; i<lecturas; i++)
+      // Vibration: RMS around the mean (gravity) of the three axes
+      float variance = 0;
+      for (byte axis=0; axis<3; axis++) variance += accelSquares[axis]/accelCount - sq((float)accelSum[axis]/accelCount);
+      value[SENSOR_VIB] = sqrt(max(variance, 0))*ADXL_MG_LSB;
+      
+      // Tilt: angle between the mean vector and the orientation at boot
+      accel_x = accelShift[0] + accelSum[0]/(long)accelCount;
+      accel_y = accelShift[1] + accelSum[1]/(long)accelCount;
+      accel_z = accelShift[2] + accelSum[2]/(long)accelCount;
+      if (!accelRefValid)
       {
-        readADXL(0x32, 6, buffADXL); //read the acceleration data from the ADXL345
-        temp_x = (((int)buffADXL[1]) << 8) | buffADXL[0]; 
-        temp_x = map(temp_x,-lim,lim,0,1023);  
-        temp_y = (((int)buffADXL[3])<< 8) | buffADXL[2];
-        temp_y = map(temp_y,-lim,lim,0,1023); 
-        temp_z = (((int)buffADXL[5]) << 8) | buffADXL[4];
-        temp_z = map(temp_z,-lim,lim,0,1023); 
-        accel_x = (int)(temp_x + accel_x);
-        accel_y = (int)(temp_y + accel_y);
-        accel_z = (int)(temp_z + accel_z);
+        accelRef[0] = accel_x;
+        accelRef[1] = accel_y;
+        accelRef[2] = accel_z;
+        accelRefValid = true;
       }
-      accel_x = (int)(accel_x / lecturas);
-      accel_y = (int)(accel_y / lecturas);
-      accel_z = (int)(accel_z / lecturas);
+      float dot = (float)accel_x*accelRef[0] + (float)accel_y*accelRef[1] + (float)accel_z*accelRef[2];
+      float norms = sqrt(sq((float)accel_x) + sq((float)accel_y) + sq((float)accel_z))*sqrt(sq((float)accelRef[0]) + sq((float)accelRef[1]) + sq((float)accelRef[2]));
+      boolean tilt = (norms > 0) && (dot < norms*cos(TILT_LIMIT*PI/180.));
+      
+      value[SENSOR_TAMPER] = (accelKnock ? TAMPER_KNOCK : 0) | (tilt ? TAMPER_TILT : 0);
       
       #if debugAmbient
-        Serial.print("x_axis= ");
-        Serial.print(accel_x);
-        Serial.print(", ");
-        Serial.print("y_axis= ");
-        Serial.print(accel_y);
-        Serial.print(", ");
-        Serial.print("z_axis= ");
-        Serial.println(accel_z); 
+        Serial.print("vibration= ");
+        Serial.print(value[SENSOR_VIB]);
+        Serial.print(" mg, tamper= ");
+        Serial.println(value[SENSOR_TAMPER]); 
       #endif
     }
+    
+    void SCKAmbient::clearMotion()
+    {
+      // The next reading starts a new window
+      for (byte axis=0; axis<3; axis++)
+      {
+        accelSum[axis] = 0;
+        accelSquares[axis] = 0;
+      }
+      accelCount = 0;
+      accelKnock = false;
+    }
  #else
     uint8_t bits[5];  // buffer to receive data
     
-    #define TIMEOUT 10000
+    #define DHT_IDLE    0
+    #define DHT_LISTEN  1
+    #define DHT_DECODE  2
+    
+    volatile byte dhtEdges = 0;          // Falling edges since the line was released
+    volatile unsigned long dhtRise = 0;  // micros() of the last rising edge
+    byte dhtStep  = DHT_IDLE;
+    byte dhtRetry = 0;
+    
+    ISR(PCINT0_vect)
+    {
+      // DHT22 on IO3: after the 80 us answer every high pulse is one bit, MSB first
+      unsigned long now = micros();
+      if (PINB & _BV(DHT22_PCINT)) 
+      {
+        dhtRise = now;
+        return;
+      }
+      byte edge = dhtEdges++;
+      if ((edge >= 2) && (edge < 42))
+      {
+        byte bit = edge - 2;
+        if ((now - dhtRise) > DHT22_BIT_THRESHOLD) bits[bit >> 3] |= 0x80 >> (bit & 7);
+      }
+      if (edge >= 41) PCMSK0 &= ~_BV(DHT22_PCINT);  // All 40 bits in
+    }
+    
+    void SCKAmbient::startDHT22()
+    {
+            // Start signal, held until listenDHT22()
+            pinMode(IO3, OUTPUT);
+            digitalWrite(IO3, LOW);
+    }
+    
+    void SCKAmbient::listenDHT22()
+    {
+            // Release the line, the sensor answers on its own and the ISR decodes it
+            uint8_t oldSREG = SREG;
+            cli();
+            for (int i=0; i< 5; i++) bits[i] = 0;
+            dhtEdges = 0;
+            PCIFR = _BV(PCIF0);
+            PCMSK0 |= _BV(DHT22_PCINT);
+            PCICR |= _BV(PCIE0);
+            pinMode(IO3, INPUT);
+            SREG = oldSREG;
+    }
     
     boolean SCKAmbient::getDHT22()
     {
-            // Read Values
-            int rv = DhtRead(IO3);
-            if (rv != true)
+            // Result of the last transfer
+            PCMSK0 &= ~_BV(DHT22_PCINT);
+            if (dhtEdges < 42)
             {
                   lastHumidity    = DHTLIB_INVALID_VALUE;  // invalid value, or is NaN prefered?
                   lastTemperature = DHTLIB_INVALID_VALUE;  // invalid value
-                  return rv;
+                  return false;
             }
     
             // Convert and Store
@@ -537,109 +756,76 @@ void SCKAmbient::ini()
             if ((lastTemperature == 0)&&(lastHumidity == 0))return false;
             return true;
     }
+ #endif
+  
+  #if F_CPU == 8000000 
+    // BH1730 ranges from direct sun to night: gain code and ITIME, the integration time is (256 - ITIME)*2.7 ms
+    const uint8_t lightGain[LIGHT_RANGES] = {0x00, 0x00, 0x01, 0x02, 0x03};   // x1, x1, x2, x64, x128
+    const uint8_t lightTime[LIGHT_RANGES] = {0xFC, 0xDA, 0xDA, 0xDA, 0xDA};   // 10.8 ms, 102.6 ms
+    const uint8_t lightGainValue[4] = {1, 2, 64, 128};
+    byte lightRange   = LIGHT_DEFAULT_RANGE;
+    byte lightRetries = 0;
     
-    boolean SCKAmbient::DhtRead(uint8_t pin)
+    void SCKAmbient::setLightRange(byte range)
     {
-            // init Buffer to receive data
-            uint8_t cnt = 7;
-            uint8_t idx = 0;
-    
-            // empty the buffer
-            for (int i=0; i< 5; i++) bits[i] = 0;
-    
-            // request the sensor
-            pinMode(pin, OUTPUT);
-            digitalWrite(pin, LOW);
-            delay(20);
-            digitalWrite(pin, HIGH);
-            delayMicroseconds(40);
-            pinMode(pin, INPUT);
-    
-            // get ACK or timeout
-            unsigned int loopCnt = TIMEOUT;
-            while(digitalRead(pin) == LOW)
-                    if (loopCnt-- == 0) return false;
-    
-            loopCnt = TIMEOUT;
-            while(digitalRead(pin) == HIGH)
-                    if (loopCnt-- == 0) return false;
-    
-            // read Ouput - 40 bits => 5 bytes
-            for (int i=0; i<40; i++)
-            {
-                    loopCnt = TIMEOUT;
-                    while(digitalRead(pin) == LOW)
-                            if (loopCnt-- == 0) return false;
-    
-                    unsigned long t = micros();
-    
-                    loopCnt = TIMEOUT;
-                    while(digitalRead(pin) == HIGH)
-                            if (loopCnt-- == 0) return false;
-    
-                    if ((micros() - t) > 40) bits[idx] |= (1 << cnt);
-                    if (cnt == 0)   // next byte?
-                    {
-                            cnt = 7;  
-                            idx++;      
-                    }
-                    else cnt--;
-            }
+      // Continuous mode, the BH1730 keeps converting and every read gets the last result.
+      // The ADC is stopped first so the valid bit waits for a conversion in the new range.
+      lightRange = range;
+      uint8_t stop[2] = {0x80|0x00, 0x01};                                   //CONTROL: power on, ADC off
+      SCKTwi::write(bh1730, stop, 2);
+      uint8_t command[9] = {0x80|0x00, 0x03, lightTime[range], 0x00, 0x00, 0x00, 0xFF, 0xFF, lightGain[range]};  //CONTROL, TIMING, INTERRUPT, thresholds, GAIN
+      SCKTwi::write(bh1730, command, 9);
+    }
     
-            return true;
+    uint16_t lightConversion()
+    {
+      return (256 - lightTime[lightRange])*2.7 + 3;   // ms, integration and the fixed part
     }
- #endif
+  #endif
   
-  uint16_t SCKAmbient::getLight(){
+  uint32_t SCKAmbient::getLight(){
     #if F_CPU == 8000000 
-      uint8_t TIME0  = 0xDA;
-      uint8_t GAIN0 = 0x00;
-      uint8_t DATA [8] = {0x03, TIME0, 0x00 ,0x00, 0x00, 0xFF, 0xFF ,GAIN0} ;
-      
-      uint16_t DATA0 = 0;
-      uint16_t DATA1 = 0;
-      
-      Wire.beginTransmission(bh1730);
-      Wire.write(0x80|0x00);
-      for(int i= 0; i<8; i++) Wire.write(DATA[i]);
-      Wire.endTransmission();
-      delay(100); 
-      Wire.beginTransmission(bh1730);
-      Wire.write(0x94);	
-      Wire.endTransmission();
-      Wire.requestFrom(bh1730, 4);
-      DATA0 = Wire.read();
-      DATA0=DATA0|(Wire.read()<<8);
-      DATA1 = Wire.read();
-      DATA1=DATA1|(Wire.read()<<8);
-        
-      uint8_t Gain = 0x00; 
-      if (GAIN0 == 0x00) Gain = 1;
-      else if (GAIN0 == 0x01) Gain = 2;
-      else if (GAIN0 == 0x02) Gain = 64;
-      else if (GAIN0 == 0x03) Gain = 128;
-      
-      float ITIME =  (256- TIME0)*2.7;
+      uint8_t control = 0;
+      uint8_t rdata[4];
+      if ((SCKTwi::read(bh1730, 0x80|0x00, &control, 1) != TWI_OK) || !(control & 0x10)) return LIGHT_PENDING;  //ADC_VALID
+      if (SCKTwi::read(bh1730, 0x80|0x14, rdata, 4) != TWI_OK) return LIGHT_PENDING;
+      uint16_t DATA0 = word(rdata[1], rdata[0]);
+      uint16_t DATA1 = word(rdata[3], rdata[2]);
       
+      float scale = lightGainValue[lightGain[lightRange]]*(256 - lightTime[lightRange])*2.7/102.6;   // Gain x ITIME/102.6 ms
       float Lx = 0;
-      float cons = (Gain * 100) / ITIME;
-      float comp = (float)DATA1/DATA0;
+      float comp = DATA0 ? (float)DATA1/DATA0 : 0;
 
+      if (DATA0 == 0) Lx = 0;
+      else if (comp<0.26) Lx = ( 1.290*DATA0 - 2.733*DATA1 ) / scale;
+      else if (comp < 0.55) Lx = ( 0.795*DATA0 - 0.859*DATA1 ) / scale;
+      else if (comp < 1.09) Lx = ( 0.510*DATA0 - 0.345*DATA1 ) / scale;
+      else if (comp < 2.13) Lx = ( 0.276*DATA0 - 0.130*DATA1 ) / scale;
+      else Lx=0;                                    // Infrared only
+      if (Lx < 0) Lx = 0;
       
-      if (comp<0.26) Lx = ( 1.290*DATA0 - 2.733*DATA1 ) / cons;
-      else if (comp < 0.55) Lx = ( 0.795*DATA0 - 0.859*DATA1 ) / cons;
-      else if (comp < 1.09) Lx = ( 0.510*DATA0 - 0.345*DATA1 ) / cons;
-      else if (comp < 2.13) Lx = ( 0.276*DATA0 - 0.130*DATA1 ) / cons;
-      else Lx=0;
+      // Range for the next reading, a saturated one is taken again in the new range
+      uint16_t peak = max(DATA0, DATA1);
+      if ((peak > LIGHT_HIGH) && (lightRange > 0))
+      {
+        setLightRange(lightRange - 1);
+        if (peak == 0xFFFF) return LIGHT_PENDING;
+      }
+      else if (lightRange < LIGHT_RANGES - 1)
+      {
+        float next = lightGainValue[lightGain[lightRange + 1]]*(256 - lightTime[lightRange + 1])*2.7/102.6;
+        if (peak*next/scale < LIGHT_LOW) setLightRange(lightRange + 1);
+      }
       
        #if debugAmbient
         Serial.print("BH1730: ");
         Serial.print(Lx);
-        Serial.println(" Lx");
+        Serial.print(" Lx, range ");
+        Serial.println(lightRange);
       #endif
      return Lx*10;
     #else
-      int temp = map(base_.average(S5), 0, 1023, 0, 1000);
+      int temp = map(base_.oversample(S5, ADC_BITS_LIGHT), 0, ADC_FULL(ADC_BITS_LIGHT), 0, 1000);
       if (temp>1000) temp=1000;
       if (temp<0) temp=0;
       return temp;
@@ -651,10 +837,9 @@ void SCKAmbient::ini()
     
     #if F_CPU == 8000000 
      #define GAIN 10000
-     writeGAIN(GAIN);
-     delay(100);
+     if (writeGAIN(GAIN)) delay(100);
     #endif
-    float mVRaw = (float)((base_.average(S4))/1023.)*Vcc;
+    float mVRaw = (float)base_.oversample(S4, ADC_BITS_NOISE)/ADC_FULL(ADC_BITS_NOISE)*Vcc;
     float dB = 0;
     return mVRaw;  
   }
@@ -691,74 +876,177 @@ void SCKAmbient::ini()
     } 
   #endif
     
-  void SCKAmbient::updateSensors(byte mode) 
+  void SCKAmbient::updateClimate() 
    {   
       boolean ok_read = false; 
-      byte    retry   = 0;
       
       #if F_CPU == 8000000 
-        getSHT21();
-        ok_read = true;
+        // The conversions run while the other tasks use the bus and the CPU, the scheduler calls back
+        if (shtStep == SHT_IDLE)
+        {
+          climateBusy = true;
+          shtValid = true;
+          startSHT21(0xF3);
+          shtStep = SHT_TEMPERATURE;
+          scheduler_.trigger(climateTask, SHT21_T_TIME);
+          return;
+        }
+        uint32_t *reading = (shtStep == SHT_TEMPERATURE) ? &lastTemperature : &lastHumidity;
+        uint8_t status = readSHT21(reading);
+        if ((status == TWI_NACK_ADDR) && (++shtPolls < SHT21_POLLS))
+        {
+          scheduler_.trigger(climateTask, SHT21_POLL_TIME);  // Still converting
+          return;
+        }
+        if (status != TWI_OK) shtValid = false;              // Corrupted or missing, the reading is rejected
+        if (shtStep == SHT_TEMPERATURE)
+        {
+          startSHT21(0xF5);
+          shtStep = SHT_HUMIDITY;
+          scheduler_.trigger(climateTask, SHT21_RH_TIME);
+          return;
+        }
+        shtStep = SHT_IDLE;
+        climateBusy = false;
+        ok_read = shtValid;
+        #if debugAmbient
+          Serial.print("SHT21:  ");
+          Serial.print("Temperature: ");
+          Serial.print(lastTemperature/10.);
+          Serial.print(" C, Humidity: ");
+          Serial.print(lastHumidity/10.);
+          Serial.println(" %");    
+        #endif
       #else
-        base_.timer1Stop();
-        while ((!ok_read)&&(retry<5))
+        // The read runs in steps, the scheduler calls back for the next one
+        if (dhtStep == DHT_IDLE)
         {
-          ok_read = getDHT22();
-          retry++; 
-          if (!ok_read)delay(3000);
+          climateBusy = true;
+          startDHT22();
+          dhtStep = DHT_LISTEN;
+          scheduler_.trigger(climateTask, DHT22_START_TIME);
+          return;
         }
-        base_.timer1Initialize(); 
-      #endif
-        if (((millis()-timeMICS)<=6*minute)||(mode!=ECONOMIC))  //6 minutes
-        {  
-          #if F_CPU == 8000000 
-            getVcc();
-          #endif
-          getMICS();
-          value[5] = getCO(); //ppm
-          value[6] = getNO2(); //ppm
+        if (dhtStep == DHT_LISTEN)
+        {
+          listenDHT22();
+          dhtStep = DHT_DECODE;
+          scheduler_.trigger(climateTask, DHT22_READ_TIME);
+          return;
         }
-        else if((millis()-timeMICS)>=60*minute) 
-              {
-                GasSensor(true);
-                timeMICS = millis();
-              }
-        else
+        dhtStep = DHT_IDLE;
+        climateBusy = false;
+        ok_read = getDHT22();
+        byte retry = ++dhtRetry;
+        if ((!ok_read)&&(retry<DHT22_RETRIES))
         {
-          GasSensor(false);
+          scheduler_.trigger(climateTask, DHT22_RETRY_TIME);  // Keeps the last reading meanwhile
+          return;
         }
-        
+        dhtRetry = 0;
+        if (!ok_read || (retry > 1)) TRACE(TRACE_DHT_RETRY, ok_read ? retry - 1 : retry);
+      #endif
         if (ok_read )  
         {
           #if ((decouplerComp)&&(F_CPU > 8000000 ))
             uint16_t battery = base_.getBattery(Vcc);
             decoupler.update(battery);
-            value[0] = getTemperature() - (int) decoupler.getCompensation();
+            value[SENSOR_TEMP] = getTemperature() - (int) decoupler.getCompensation();
           #else
-            value[0] = getTemperature();
+            value[SENSOR_TEMP] = getTemperature();
           #endif
-           value[1] = getHumidity();
+           value[SENSOR_HUM] = getHumidity();
         }
         else 
         {
-          value[0] = 0; // ºC
-          value[1] = 0; // %
+          value[SENSOR_TEMP] = 0; // ºC
+          value[SENSOR_HUM] = 0; // %
         }  
-        value[2] = getLight(); //mV
-        value[3] = base_.getBattery(Vcc); //%
-        value[4] = base_.getPanel(Vcc);  // %
-        value[7] = getNoise(); //mV     
-        if (mode == NOWIFI)
-             {
-               value[8] = 0;  //Wifi Nets
-               base_.RTCtime(time);
-             } 
-        else if (mode == OFFLINE)
+   }
+
+  void SCKAmbient::updateGas() 
+   {   
+        if (!heaterReady(MICS_5525) || !heaterReady(MICS_2710)) return; // Keep the last readings
+        #if F_CPU == 8000000 
+          getVcc();
+        #endif
+        getMICS();
+        value[SENSOR_CO] = getCO(); //ppm
+        value[SENSOR_NO2] = getNO2(); //ppm
+        if (sensor_mode == ECONOMIC) GasSensor(false); // Heaters off until the next ECONOMIC_GAS_PERIOD
+   }
+
+  void SCKAmbient::updateLight() 
+   {   
+        uint32_t light = getLight();
+        #if F_CPU == 8000000 
+          if ((light == LIGHT_PENDING) && (++lightRetries <= LIGHT_RANGES))
           {
-            value[8] = base_.scan();  //Wifi Nets
-            base_.RTCtime(time);
+            scheduler_.trigger(lightTask, lightConversion());  // No result yet or out of range, read again after one conversion
+            return;
           }
+          lightRetries = 0;
+          if (light == LIGHT_PENDING) return;                   // No BH1730, keep the last reading
+        #endif
+        value[SENSOR_LIGHT] = light; //mV
    }
+
+  void SCKAmbient::updatePower() 
+   {   
+        value[SENSOR_BAT] = base_.getBattery(Vcc); //%
+        value[SENSOR_PANEL] = base_.getPanel(Vcc);  // %
+   }
+
+  void SCKAmbient::updateNoise() 
+   {   
+        value[SENSOR_NOISE] = getNoise(); //mV     
+   }
+
+  void SCKAmbient::updateNets() 
+   {   
+        if (base_.scanDue()) base_.scan();
+        value[SENSOR_NETS] = base_.nets();  //Wifi Nets
+   }
+
+  void SCKAmbient::publish() 
+   {   
+        TimeUpdate = SCKConfig::timeUpdate();     // Time between transmissions in sec.
+        NumUpdates = SCKConfig::numberUpdates();  // Number of readings before batch update
+        schedule();
+        if (sensor_mode == NOWIFI) value[SENSOR_NETS] = 0;  //Wifi Nets
+        if (sensor_mode <= NOWIFI) base_.RTCtime(time);
+        if ((sensor_mode)>NOWIFI) server_.send(sleep, &wait_moment, value, time, instantPost);
+        #if USBEnabled
+          txDebug();
+        #endif
+        instantPost = false;
+        #if F_CPU == 8000000
+          clearMotion();
+        #endif
+        SCKConfig::commit();  // FIFO pointers moved by this cycle
+        SCKBackoff::save();
+        SCKTrace::flush();
+   }
+
+void SCKAmbient::taskHeater()  { STAGE_BEGIN("heater");  ambient_.heaterControl(); STAGE_END("heater"); }
+void SCKAmbient::taskClimate() { STAGE_BEGIN("climate"); ambient_.updateClimate(); STAGE_END("climate"); }
+void SCKAmbient::taskGas()     { STAGE_BEGIN("gas");     ambient_.updateGas();     STAGE_END("gas"); }
+void SCKAmbient::taskLight()   { STAGE_BEGIN("light");   ambient_.updateLight();   STAGE_END("light"); }
+void SCKAmbient::taskPower()   { STAGE_BEGIN("power");   ambient_.updatePower();   STAGE_END("power"); }
+void SCKAmbient::taskNoise()   { STAGE_BEGIN("noise");   ambient_.updateNoise();   STAGE_END("noise"); }
+void SCKAmbient::taskNets()    { STAGE_BEGIN("nets");    ambient_.updateNets();    STAGE_END("nets"); }
+void SCKAmbient::taskPublish()
+  {
+    if (climateBusy) 
+    {
+      scheduler_.trigger(publishTask, CLIMATE_WAIT);  // Send the temperature and humidity read in flight
+      return;
+    }
+    STAGE_BEGIN("publish"); ambient_.publish(); STAGE_END("publish");
+  }
+#if F_CPU == 8000000
+  void SCKAmbient::taskMotion()  { STAGE_BEGIN("motion");  ambient_.updateMotion();  STAGE_END("motion"); }
+#endif
   
 boolean SCKAmbient::debug_state()
   {
@@ -811,47 +1099,34 @@ void SCKAmbient::execute(boolean instant) {
           }
         #endif
       }
-    } else {
-      if ((millis()-timetransmit) >= (unsigned long)TimeUpdate*second || instant) {
-        if(!instant) timetransmit = millis();                          // Only reset timer if execute() is called by timer
-        TimeUpdate = base_.readData(EE_ADDR_TIME_UPDATE, INTERNAL);    // Time between transmissions in sec.
-        NumUpdates = base_.readData(EE_ADDR_NUMBER_UPDATES, INTERNAL); // Number of readings before batch update
-        if (!debugON) {                                                // CMD Mode False
-          updateSensors(sensor_mode);
-          if ((sensor_mode)>NOWIFI) server_.send(sleep, &wait_moment, value, time, instant);
-          #if USBEnabled
-            txDebug();
-          #endif
-        }
+    } else if (!debugON) {                                           // CMD Mode False
+      if (instant) {                                                   // Read and post now, the periodic deadlines are kept
+        instantPost = true;
+        scheduler_.trigger(climateTask);
+        scheduler_.trigger(gasTask);
+        scheduler_.trigger(lightTask);
+        scheduler_.trigger(powerTask);
+        scheduler_.trigger(noiseTask);
+        scheduler_.trigger(netsTask);
+        scheduler_.trigger(motionTask);
+        scheduler_.trigger(publishTask);
       }
+      SCKTwi::service();                                               // I2C transactions past their timeout
+      while (scheduler_.run());                                        // Every task that is due, most overdue first
     }
   }
            
 void SCKAmbient::txDebug() {
   if (debugON== false) {
     Serial.println(F("*******************"));
-    float dec = 0;
-    for(int i=0; i<9; i++) 
+    for(byte i=0; i<SENSORS; i++) 
     {
-      #if F_CPU == 8000000 
-        if (i<2) dec = 1;
-        else if (i<4) dec = 10;
-        else if (i<5) dec = 1;
-        else if (i<7) dec = 1000;
-        else if (i<8) dec = 1;
-      #else
-        if (i<4) dec = 10;
-        else if (i<5) dec = 1;
-        else if (i<7) dec = 1000;
-        else if (i<8) dec = 1;
-      #endif
-        else dec = 1;
-      Serial.print(SENSOR[i]); 
-      if (dec>1) Serial.print((float)(value[i]/dec)); 
-      else Serial.print((unsigned int)(value[i]/dec)); 
-      Serial.println(UNITS[i]);
+      Serial.print(SENSOR_LABEL[i]); 
+      if (SENSOR_SCALE[i]>1) Serial.print((float)value[i]/SENSOR_SCALE[i]); 
+      else Serial.print((unsigned int)value[i]); 
+      Serial.println(SENSOR_UNITS[i]);
     }
-    Serial.print(SENSOR[9]);
+    Serial.print(F("UTC: "));
     Serial.println(time);
     Serial.println(F("*******************"));    
   } 
@@ -901,11 +1176,11 @@ int SCKAmbient::addData(byte inByte)
     
 boolean SCKAmbient::printNetWorks(unsigned int address_eeprom, boolean endLine=true)
     {
-      int nets_temp = base_.readData(EE_ADDR_NUMBER_NETS, INTERNAL);
+      int nets_temp = SCKConfig::nets();
       if (nets_temp>0){
         for (int i = 0; i<nets_temp; i++)
           {
-            Serial.print(base_.readData(address_eeprom, i, INTERNAL));
+            base_.printData(Serial, address_eeprom, i, INTERNAL);
             if (i<(nets_temp - 1)) Serial.print(' ');
           }
         if (endLine) Serial.println();
@@ -915,11 +1190,11 @@ boolean SCKAmbient::printNetWorks(unsigned int address_eeprom, boolean endLine=t
 void SCKAmbient::addNetWork(unsigned int address_eeprom, char* text)
     {
       int pos = 0;
-      int nets_temp = base_.readData(EE_ADDR_NUMBER_NETS, INTERNAL);
+      int nets_temp = SCKConfig::nets();
       if (address_eeprom < DEFAULT_ADDR_PASS)
         {
           nets_temp = nets_temp + 1;
-          if (nets_temp<=5) base_.writeData(EE_ADDR_NUMBER_NETS, nets_temp , INTERNAL); 
+          if (nets_temp<=5) SCKConfig::setNets(nets_temp); 
         }
       if (nets_temp<=5)
         {
@@ -931,9 +1206,7 @@ void SCKAmbient::addNetWork(unsigned int address_eeprom, char* text)
     
     
 boolean serial_bridge = false;
-boolean eeprom_write_ok      = false;
 boolean text_write           = true;
-unsigned int address_eeprom  = 0;
 int temp_mode = NORMAL;
 
 void SCKAmbient::serialRequests()
@@ -977,20 +1250,26 @@ void SCKAmbient::serialRequests()
             /*Reading commands*/
             else if (base_.checkText("get sck info\r", buffer_int))           Serial.println(FirmWare);
             else if (base_.checkText("get wifi info\r", buffer_int))          Serial.println(base_.getWiFlyVersion());
-            else if (base_.checkText("get mac\r", buffer_int))                Serial.println(base_.readData(EE_ADDR_MAC, 0, INTERNAL));
+            else if (base_.checkText("get mac\r", buffer_int))                { base_.printData(Serial, EE_ADDR_MAC, 0, INTERNAL); Serial.println(); }
             else if (base_.checkText("get wlan ssid\r", buffer_int))          printNetWorks(DEFAULT_ADDR_SSID, true);
             else if (base_.checkText("get wlan phrase\r", buffer_int))        printNetWorks(DEFAULT_ADDR_PASS, true);
             else if (base_.checkText("get wlan auth\r", buffer_int))          printNetWorks(DEFAULT_ADDR_AUTH, true);
             else if (base_.checkText("get wlan ext_antenna\r", buffer_int))   printNetWorks(DEFAULT_ADDR_ANTENNA, true);
-            else if (base_.checkText("get mode sensor\r", buffer_int))        Serial.println(base_.readData(EE_ADDR_SENSOR_MODE, INTERNAL));
-            else if (base_.checkText("get time update\r", buffer_int))        Serial.println(base_.readData(EE_ADDR_TIME_UPDATE, INTERNAL));
-            else if (base_.checkText("get number updates\r", buffer_int))     Serial.println(base_.readData(EE_ADDR_NUMBER_UPDATES, INTERNAL));
-            else if (base_.checkText("get apikey\r", buffer_int))             Serial.println(base_.readData(EE_ADDR_APIKEY, 0, INTERNAL));
+            else if (base_.checkText("get mode sensor\r", buffer_int))        Serial.println(SCKConfig::sensorMode());
+            else if (base_.checkText("get time update\r", buffer_int))        Serial.println(SCKConfig::timeUpdate());
+            else if (base_.checkText("get number updates\r", buffer_int))     Serial.println(SCKConfig::numberUpdates());
+            else if (base_.checkText("get apikey\r", buffer_int))             { base_.printData(Serial, EE_ADDR_APIKEY, 0, INTERNAL); Serial.println(); }
+            else if (base_.checkText("get mics ranges\r", buffer_int))        printRanges();
+            else if (base_.checkText("get trace\r", buffer_int))              SCKTrace::print();
+            #if benchEnabled
+              else if (base_.checkText("bench json\r", buffer_int))          server_.benchmark(value, time);
+            #endif
+            else if (base_.checkText("get telemetry\r", buffer_int))          Serial.println(SCKConfig::telemetry());
             else if (base_.checkText("get all\r", buffer_int)) {
               Serial.print(F("|"));
               Serial.print(FirmWare);
               Serial.print(F("|"));
-              Serial.print(base_.readData(EE_ADDR_MAC, 0, INTERNAL)); //MAC
+              base_.printData(Serial, EE_ADDR_MAC, 0, INTERNAL); //MAC
               Serial.print(F("|"));
               printNetWorks(DEFAULT_ADDR_SSID, false);
               Serial.print(F(","));
@@ -1002,9 +1281,9 @@ void SCKAmbient::serialRequests()
               Serial.print(F("|"));
               Serial.print(networks);
               Serial.print(F("|"));
-              Serial.print(base_.readData(EE_ADDR_TIME_UPDATE, INTERNAL));
+              Serial.print(SCKConfig::timeUpdate());
               Serial.print(F("|"));
-              Serial.print(base_.readData(EE_ADDR_NUMBER_UPDATES, INTERNAL));
+              Serial.print(SCKConfig::numberUpdates());
               Serial.println(F("|"));
             } else if (base_.checkText("post data\r", buffer_int)) {
               execute(true);
@@ -1013,26 +1292,34 @@ void SCKAmbient::serialRequests()
             else if (base_.checkText("set wlan ssid ", buffer_int))
             {
                 addNetWork(DEFAULT_ADDR_SSID, buffer_int);
-                sensor_mode = base_.readData(EE_ADDR_SENSOR_MODE, INTERNAL); 
+                sensor_mode = SCKConfig::sensorMode(); 
                 if (TimeUpdate < 60) sleep = false;
                 else sleep = true; 
             }
             else if (base_.checkText("set wlan phrase ", buffer_int)) addNetWork(DEFAULT_ADDR_PASS, buffer_int);
-            else if (base_.checkText("set wlan key ", buffer_int)) addNetWork(EE_ADDR_NUMBER_NETS, buffer_int);
+            else if (base_.checkText("set wlan key ", buffer_int)) addNetWork(DEFAULT_ADDR_PASS, buffer_int);  // WEP key, sent as the phrase by connect()
             else if (base_.checkText("set wlan ext_antenna ", buffer_int))  addNetWork(DEFAULT_ADDR_ANTENNA, buffer_int);
             else if (base_.checkText("set wlan auth ", buffer_int)) addNetWork(DEFAULT_ADDR_AUTH, buffer_int);
-            else if (base_.checkText("clear nets\r", buffer_int)) base_.writeData(EE_ADDR_NUMBER_NETS, networks, INTERNAL);
-            else if (base_.checkText("set mode sensor ", buffer_int)) base_.writeData(EE_ADDR_SENSOR_MODE, atol(buffer_int), INTERNAL);
+            else if (base_.checkText("clear nets\r", buffer_int)) SCKConfig::setNets(networks);
+            else if (base_.checkText("set mode sensor ", buffer_int)) SCKConfig::setSensorMode(atol(buffer_int));
             else if (base_.checkText("set time update ", buffer_int)) {
               TimeUpdate = atol(buffer_int);
-              base_.writeData(EE_ADDR_TIME_UPDATE, TimeUpdate, INTERNAL);
+              SCKConfig::setTimeUpdate(TimeUpdate);
             }
-            else if (base_.checkText("set number updates ", buffer_int)) base_.writeData(EE_ADDR_NUMBER_UPDATES, atol(buffer_int), INTERNAL);
+            else if (base_.checkText("set number updates ", buffer_int)) SCKConfig::setNumberUpdates(atol(buffer_int));
+            else if (base_.checkText("set telemetry ", buffer_int)) SCKConfig::setTelemetry(atol(buffer_int));
             else if (base_.checkText("set apikey ", buffer_int)){
-              eeprom_write_ok = true;
-              address_eeprom = EE_ADDR_APIKEY;
+              // The slot holds buffer_length bytes, a longer key would overwrite the MAC after it
+              if (strlen(buffer_int) > buffer_length) Serial.println(F("Apikey too long."));
+              else
+              {
+                base_.writeData(EE_ADDR_APIKEY, 0, buffer_int, INTERNAL);
+                server_.headerChanged();
+              }
             } 
             else if (base_.checkText("clear memory\r", buffer_int)) base_.clearmemory();
+            else if (base_.checkText("clear trace\r", buffer_int)) SCKTrace::clear();
+            SCKConfig::commit();
           }
         else if (check_data == -1) Serial.println("Invalid command.");
         if (serial_bridge) Serial1.write(inByte); 
@@ -1048,6 +1335,18 @@ void SCKAmbient::serialRequests()
       base_.timer1Initialize(); // set a timer of length 1000000 microseconds (or 1 sec - or 1Hz)  
   }
   
+void SCKAmbient::powerSave()
+  {
+    #if powerSaving
+      // Sleep until the next task is due, unless someone is talking to the kit
+      if (debugON || serial_bridge || terminal_mode || wait_moment) return;
+      if (SCKTwi::busy()) return;                                    // The TWI clock stops in power-down
+      uint32_t idle = scheduler_.idleTime();
+      if ((idle < MIN_SLEEP_TIME) || (idle == 0xFFFFFFFF)) return;
+      base_.sleepMCU(idle);
+    #endif
+  }
+  
 ISR(TIMER1_OVF_vect)
 {
   ambient_.serialRequests();
@@ -27,19 +27,27 @@ SENSOR Contants and Defaults
 
 #define TIME_BUFFER_SIZE 20 
 
+#define HEATER_OFF      0
+#define HEATER_WARMING  1
+#define HEATER_READY    2
+
 class SCKAmbient {
 public:
   void begin();
   void ini();
   void execute(boolean instant);
-  void writeGAIN(long value);
+  void powerSave();
+  boolean writeGAIN(long value);
   float readGAIN(); 
   void GasSensor(boolean active);
+  boolean heaterReady(byte device);
   void getMICS(); 
   unsigned long getCO();
   unsigned long getNO2();
 
-  void getSHT21(); 
+  void startSHT21(uint8_t command);
+  void startDHT22();
+  void listenDHT22();
   boolean getDHT22();
   #if F_CPU == 8000000 
     uint32_t getTemperature();
@@ -50,7 +58,7 @@ public:
   #endif
   
   void readADXL(byte address, int num, byte buff[]);
-  uint16_t getLight(); 
+  uint32_t getLight(); 
   unsigned int getNoise();
   
   void txDebug();
@@ -62,17 +70,37 @@ private:
   float readVH(byte device);
   void writeRL(byte device, long resistor);
   float readRL(byte device);
-  void writeRGAIN(byte device, long resistor);
+  boolean writeRGAIN(byte device, long resistor);
   float readRGAIN(byte device);
   void getVcc();
   void heat(byte device, int current);
+  void heaterControl();
   float readRs(byte device);
   float readMICS(byte device);
+  boolean rangeRL(byte device, float resistor);
+  void printRanges();
   void writeADXL(byte address, byte val);
-  void averageADXL();
-  void updateSensors(byte mode);
-  uint16_t readSHT21(uint8_t type);
-  boolean DhtRead(uint8_t pin);
+  void setLightRange(byte range);
+  void updateMotion();
+  void clearMotion();
+  void schedule();
+  void updateClimate();
+  void updateGas();
+  void updateLight();
+  void updatePower();
+  void updateNoise();
+  void updateNets();
+  void publish();
+  static void taskHeater();
+  static void taskClimate();
+  static void taskGas();
+  static void taskLight();
+  static void taskPower();
+  static void taskNoise();
+  static void taskNets();
+  static void taskPublish();
+  static void taskMotion();
+  uint8_t readSHT21(uint32_t *value);
   int addData(byte inByte);
   boolean printNetWorks(unsigned int address_eeprom, boolean endLine);
   void addNetWork(unsigned int address_eeprom, char* text);
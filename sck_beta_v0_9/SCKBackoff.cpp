@@ -0,0 +1,101 @@
+/*
+
+  SCKBackoff.cpp
+  When to try the next upload after a failed one.
+
+*/
+
+#include "Constants.h"
+#include "SCKBackoff.h"
+#include "SCKTrace.h"
+#include <EEPROM.h>
+#include <stddef.h>
+
+#define debugBackoff false
+
+static_assert(BACKOFF_ADDR >= CONFIG_ADDR + 2*CONFIG_SLOT_SIZE, "The backoff snapshot overlaps the configuration slots");
+static_assert(BACKOFF_ADDR + sizeof(SCKBackoffState) <= 1024, "The backoff snapshot doesn't fit in the internal EEPROM");
+
+SCKBackoffState SCKBackoff::state;
+uint32_t backoffStart   = 0;      // millis() of the last failed attempt
+uint32_t backoffWait    = 0;      // ms from it to the next attempt, 0: no wait
+uint32_t backoffSavedAt = 0;      // millis() of the last snapshot
+boolean  backoffDirty   = false;
+
+uint8_t SCKBackoff::checksum() {
+  const uint8_t *data = (const uint8_t *)&state;
+  uint8_t sum = 0;
+  for (uint8_t i = 0; i < offsetof(SCKBackoffState, check); i++) sum += data[i];
+  return ~sum;
+}
+
+void SCKBackoff::begin() {
+  uint8_t *data = (uint8_t *)&state;
+  for (uint8_t i = 0; i < sizeof(SCKBackoffState); i++) data[i] = EEPROM.read(BACKOFF_ADDR + i);
+  if ((state.version != BACKOFF_VERSION) || (state.check != checksum())) defaults();
+  backoffWait = 0;
+  // The jitter differs from kit to kit (MAC) and from boot to boot
+  uint32_t seed = micros();
+  for (uint8_t i = 0; i < 17; i++) seed = seed*31 + EEPROM.read(EE_ADDR_MAC + i);
+  randomSeed(seed);
+}
+
+void SCKBackoff::defaults() {
+  state.version = BACKOFF_VERSION;
+  for (uint8_t hour = 0; hour < BACKOFF_HOURS; hour++) state.score[hour] = 255;  // Unknown hours count as working
+  state.failures = 0;
+  backoffWait = 0;
+  backoffDirty = true;
+}
+
+boolean SCKBackoff::due() {
+  return (backoffWait == 0) || ((millis() - backoffStart) >= backoffWait);
+}
+
+void SCKBackoff::learn(uint8_t hour, boolean worked) {
+  // Moving average, every attempt weighs 1/8
+  if (hour >= BACKOFF_HOURS) return;
+  uint16_t score = state.score[hour] - (state.score[hour] >> 3) + (worked ? 32 : 0);
+  if (score > 255) score = 255;
+  if (score != state.score[hour]) backoffDirty = true;
+  state.score[hour] = score;
+}
+
+void SCKBackoff::success(uint8_t hour) {
+  learn(hour, true);
+  if (state.failures) backoffDirty = true;
+  state.failures = 0;
+  backoffWait = 0;
+}
+
+void SCKBackoff::failure(uint8_t hour) {
+  learn(hour, false);
+  if (state.failures < 0xFF) state.failures++;
+  backoffDirty = true;
+  uint32_t cap = ((hour < BACKOFF_HOURS) && (state.score[hour] >= BACKOFF_LIKELY)) ? BACKOFF_LIKELY_MAX : BACKOFF_MAX;
+  uint8_t doublings = state.failures - 1;
+  uint32_t wait = (doublings < 8) ? (BACKOFF_MIN << doublings) : cap;
+  if (wait > cap) wait = cap;
+  wait = wait - wait/4 + random(wait/2 + 1);  // +-25%
+  backoffWait = wait;
+  backoffStart = millis();
+  TRACE(TRACE_BACKOFF, wait/1000);
+  #if debugBackoff
+    Serial.print(F("Backoff: "));
+    Serial.print(state.failures);
+    Serial.print(F(" failures, next attempt in "));
+    Serial.print(wait/1000);
+    Serial.println(F(" s"));
+  #endif
+}
+
+boolean SCKBackoff::save() {
+  // Returns true if the snapshot was written
+  if (!backoffDirty || ((millis() - backoffSavedAt) < BACKOFF_SAVE_INTERVAL)) return false;
+  state.check = checksum();
+  const uint8_t *data = (const uint8_t *)&state;
+  for (uint8_t i = 0; i < sizeof(SCKBackoffState); i++) EEPROM.update(BACKOFF_ADDR + i, data[i]);
+  backoffDirty = false;
+  backoffSavedAt = millis();
+  return true;
+}
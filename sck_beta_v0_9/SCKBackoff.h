@@ -0,0 +1,46 @@
+/*
+
+  SCKBackoff.h
+  When to try the next upload after a failed one.
+
+  - Every failed attempt in a row doubles the wait, from BACKOFF_MIN up to
+    BACKOFF_MAX, with +-25% jitter so kits behind the same access point
+    don't retry in step. The readings go to the FIFO meanwhile.
+  - Every attempt also scores the hour of the day (RTC) it was made in.
+    A failure in an hour that usually works is likely short, the wait is
+    capped at BACKOFF_LIKELY_MAX then.
+  - The state lives in RAM. A snapshot with a checksum is written to the
+    internal EEPROM at most once every BACKOFF_SAVE_INTERVAL, only the
+    bytes that changed.
+
+*/
+
+#ifndef __SCKBACKOFF_H__
+#define __SCKBACKOFF_H__
+
+#include <Arduino.h>
+
+#define BACKOFF_HOURS     24
+#define BACKOFF_NO_HOUR   0xFF   // No RTC, the attempt is not scored
+
+struct SCKBackoffState {
+  uint8_t version;               // BACKOFF_VERSION
+  uint8_t score[BACKOFF_HOURS];  // Share of the attempts that worked, 0 to 255
+  uint8_t failures;              // Failed attempts in a row
+  uint8_t check;                 // Sum of everything above, inverted
+};
+
+class SCKBackoff {
+public:
+  static void begin();
+  static void defaults();
+  static boolean due();
+  static void success(uint8_t hour);
+  static void failure(uint8_t hour);
+  static boolean save();
+private:
+  static SCKBackoffState state;
+  static void learn(uint8_t hour, boolean worked);
+  static uint8_t checksum();
+};
+#endif
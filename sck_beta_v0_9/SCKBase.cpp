@@ -14,16 +14,36 @@
 
 #include "Constants.h"
 #include "SCKBase.h"
-#include <Wire.h>
+#include "SCKTrace.h"
+#include "SCKConfig.h"
+#include "SCKBackoff.h"
+#include "SCKTwi.h"
 #include <EEPROM.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
 
 #define debugBASE false
 
+byte resetFlags = 0;            // Reset cause, MCUSR bits (resetCause())
+uint16_t resetMarker __attribute__((section(".noinit")));  // RESET_MARKER while the RAM keeps its power
+uint16_t numCommandRetries = 0; // Failed command mode entries since clearRetries()
+uint16_t numOpenRetries = 0;    // Failed open() since clearRetries()
+uint32_t scanNets = 0;          // Networks found by the last scan
+uint32_t scanTime = 0;          // millis() of the last scan, failed ones too (0: none yet)
+uint32_t netsTime = 0;          // millis() of the last scan that counted the networks
+boolean  scanned  = false;
 
 
 void SCKBase::begin() {
-  Wire.begin();
-  TWBR = ((F_CPU / TWI_FREQ) - 16) / 2;  
+  // The Caterina bootloader clears MCUSR before it starts the sketch, only a kit flashed without
+  // it sees the flags. Otherwise the marker left in .noinit RAM tells a power-on (RAM lost, PORF)
+  // from a reset that kept the power: button, upload or watchdog, all reported as EXTRF
+  resetFlags = MCUSR;
+  MCUSR = 0;
+  if (!resetFlags) resetFlags = (resetMarker == RESET_MARKER) ? _BV(EXTRF) : _BV(PORF);
+  resetMarker = RESET_MARKER;
+  SCKTwi::begin(TWI_FREQ);
+  loadMCP();
   Serial.begin(115200);
   Serial1.begin(9600);
   pinMode(IO0, OUTPUT); //VH_MICS5525
@@ -55,50 +75,52 @@ void SCKBase::eepromCheck() {
     #endif
     strncpy(temp, MAC(), 18);
   }
-  if (!compareData(temp, readData(EE_ADDR_MAC, 0, INTERNAL))) doClearMemory = true;
-  uint32_t intTemp;
-  intTemp = readData(EE_ADDR_SENSOR_MODE, INTERNAL);
-  if (intTemp < 0 || intTemp > 3) doClearMemory = true;
-  intTemp = readData(EE_ADDR_TIME_UPDATE, INTERNAL);
-  if (intTemp < MIN_TIME_UPDATE || intTemp > MAX_TIME_UPDATE) doClearMemory = true;
-  intTemp = readData(EE_ADDR_NUMBER_UPDATES, INTERNAL);
-  if (intTemp < DEFAULT_MIN_UPDATES || intTemp > POST_MAX) doClearMemory = true;
+  if (!matchData(EE_ADDR_MAC, 0, temp, INTERNAL)) doClearMemory = true;
+  if (!SCKConfig::begin()) doClearMemory = true;   //No block with a good CRC and sane values
+  SCKBackoff::begin();
   if (doClearMemory) clearmemory();
 
+  //readings stored with another sensor registry or record layout can't be decoded, drop them
+  uint16_t layout = SCKConfig::fifoLayout();
+  if (layout == 0) layout = FIFO_LEGACY_SIZE;
+  if (layout != FIFO_RECORD_SIZE)
+  {
+    SCKConfig::setWriteMeasure(0);
+    SCKConfig::setReadMeasure(0);
+  }
+  SCKConfig::setFifoLayout(FIFO_RECORD_SIZE);
+
   //if there are hardcoded networks write them without clearing memory
   //so the user can add more networks after hardcoded one's
   #if (networks > 0)
-    intTemp = readData(EE_ADDR_NUMBER_NETS, INTERNAL);
-    if (intTemp < networks || intTemp > 5) writeData(EE_ADDR_NUMBER_NETS, networks, INTERNAL);
+    if (SCKConfig::nets() < networks || SCKConfig::nets() > 5) SCKConfig::setNets(networks);
     for (byte i=0; i<networks; i++){
-      if (!compareData(readData(DEFAULT_ADDR_SSID, i, INTERNAL), mySSID[i])) writeData(DEFAULT_ADDR_SSID, i, mySSID[i], INTERNAL);
-      if (!compareData(readData(DEFAULT_ADDR_PASS, i, INTERNAL), myPassword[i])) writeData(DEFAULT_ADDR_PASS, i, myPassword[i], INTERNAL);
-      if (!compareData(readData(DEFAULT_ADDR_AUTH, i, INTERNAL), wifiEncript[i])) writeData(DEFAULT_ADDR_AUTH, i, wifiEncript[i], INTERNAL);
-      if (!compareData(readData(DEFAULT_ADDR_ANTENNA, i, INTERNAL), antennaExt[i])) writeData(DEFAULT_ADDR_ANTENNA, i, antennaExt[i], INTERNAL);
+      if (!matchData(DEFAULT_ADDR_SSID, i, mySSID[i], INTERNAL)) writeData(DEFAULT_ADDR_SSID, i, mySSID[i], INTERNAL);
+      if (!matchData(DEFAULT_ADDR_PASS, i, myPassword[i], INTERNAL)) writeData(DEFAULT_ADDR_PASS, i, myPassword[i], INTERNAL);
+      if (!matchData(DEFAULT_ADDR_AUTH, i, wifiEncript[i], INTERNAL)) writeData(DEFAULT_ADDR_AUTH, i, wifiEncript[i], INTERNAL);
+      if (!matchData(DEFAULT_ADDR_ANTENNA, i, antennaExt[i], INTERNAL)) writeData(DEFAULT_ADDR_ANTENNA, i, antennaExt[i], INTERNAL);
     }
     reset();
   #endif
+  SCKConfig::commit();
 }
 
 void SCKBase::clearmemory() {
     for(uint16_t i=0; i<(DEFAULT_ADDR_ANTENNA + 160); i++) EEPROM.write(i, 0x00);  // Memory erasing
-    writeData(EE_ADDR_SENSOR_MODE, DEFAULT_MODE_SENSOR, INTERNAL);
-    writeData(EE_ADDR_TIME_UPDATE, DEFAULT_TIME_UPDATE, INTERNAL);
-    writeData(EE_ADDR_NUMBER_UPDATES, DEFAULT_MIN_UPDATES, INTERNAL);
+    SCKConfig::defaults();
+    SCKConfig::commit();
+    SCKBackoff::defaults();
     writeData(EE_ADDR_MAC, 0, MAC(), INTERNAL);
 }
   
-float SCKBase::average(int anaPin) {
-  int lecturas = 100;
-  long total = 0;
-  float average = 0;
-  for(int i=0; i<lecturas; i++)
-  {
-    //delay(1);
-    total = total + analogRead(anaPin);
-  }
-  average = (float)total / lecturas;  
-  return(average);
+uint16_t SCKBase::oversample(int anaPin, byte bits) {
+  // Sum of 4^n readings shifted right n times: a 10 + n bits result, full scale ADC_FULL(bits).
+  // The extra bits come from the ADC noise (at least 1 LSB), a steady input only gets averaged.
+  byte extra = bits - 10;
+  uint16_t samples = 1 << (2*extra);
+  uint32_t total = 0;
+  for (uint16_t i = 0; i < samples; i++) total += analogRead(anaPin);
+  return total >> extra;
 }
 
 boolean SCKBase::checkText(char* text, char *text1)
@@ -141,36 +163,56 @@ boolean SCKBase::compareData(char* text, char* text1)
 
 float kr= ((float)P1*1000)/RES;     //  Resistance conversion Constant for the digital pot.
 
-void SCKBase::writeMCP(byte deviceaddress, byte address, int data ) {
+#if F_CPU == 8000000 
+  #define MCP3               0x2D    // Direction of the mcp3 Ajust the battary charge
+  const byte mcpDevices[MCP_DEVICES] = {MCP1, MCP2, MCP3};
+#else
+  const byte mcpDevices[MCP_DEVICES] = {MCP1, MCP2};
+#endif
+const byte mcpWipers[MCP_WIPERS] = {0x00, 0x01, 0x06, 0x07};  // Volatile wipers 0 to 3
+int mcpShadow[MCP_DEVICES][MCP_WIPERS];                        // Last value of every wiper, MCP_UNKNOWN until read
+
+int *mcpWiper(byte deviceaddress, byte address) {
+  for (byte i = 0; i < MCP_DEVICES; i++)
+    if (mcpDevices[i] == deviceaddress)
+      for (byte j = 0; j < MCP_WIPERS; j++)
+        if (mcpWipers[j] == address) return &mcpShadow[i][j];
+  return 0;
+}
+
+int readMCPWiper(byte deviceaddress, byte address) {
+  uint8_t rdata[2];
+  if (SCKTwi::read(deviceaddress, (address<<4)|B00001100, rdata, 2) != TWI_OK) return MCP_UNKNOWN;
+  return (rdata[0]<<8)|rdata[1];
+}
+
+void SCKBase::loadMCP() {
+  // Wipers are only read from the pots once, afterwards they come from the shadow
+  for (byte i = 0; i < MCP_DEVICES; i++)
+    for (byte j = 0; j < MCP_WIPERS; j++) mcpShadow[i][j] = readMCPWiper(mcpDevices[i], mcpWipers[j]);
+}
+
+boolean SCKBase::writeMCP(byte deviceaddress, byte address, int data ) {
+  // Returns true if the wiper moved, an unchanged value is not written (nor waited for)
   if (data>RES) data=RES;
-  Wire.beginTransmission(deviceaddress);
-  address=(address<<4)|bitRead(data, 8) ;
-  Wire.write(address);
-  Wire.write(lowByte(data));
-  Wire.endTransmission();
+  int *shadow = mcpWiper(deviceaddress, address);
+  if (shadow && (*shadow == data)) return false;
+  uint8_t command[2] = {(uint8_t)((address<<4)|bitRead(data, 8)), lowByte(data)};
+  uint8_t status = SCKTwi::write(deviceaddress, command, 2);
+  if (shadow) *shadow = (status == TWI_OK) ? data : MCP_UNKNOWN;
   delay(4);
+  return true;
 }
 
 int SCKBase::readMCP(int deviceaddress, uint16_t address ) {
-  byte rdata = 0xFF;
-  int  data = 0x0000;
-  Wire.beginTransmission(deviceaddress);
-  address=(address<<4)|B00001100;
-  Wire.write(address);
-  Wire.endTransmission();
-  Wire.requestFrom(deviceaddress,2);
-  unsigned long time = millis();
-  while (!Wire.available()) if ((millis() - time)>500) return 0x00;
-  rdata = Wire.read(); 
-  data=rdata<<8;
-  while (!Wire.available()); 
-  rdata = Wire.read(); 
-  data=data|rdata;
-  return data;
+  int *shadow = mcpWiper(deviceaddress, address);
+  if (shadow && (*shadow != MCP_UNKNOWN)) return *shadow;
+  int data = readMCPWiper(deviceaddress, address);
+  if (shadow) *shadow = data;
+  return (data == MCP_UNKNOWN) ? 0x00 : data;
 }
 
 #if F_CPU == 8000000 
-  #define MCP3               0x2D    // Direction of the mcp3 Ajust the battary charge
 float SCKBase::readCharge() {
   float resistor = kr*readMCP(MCP3, 0x00)/1000;    
   float current = 1000./(2+((resistor * 10)/(resistor + 10)));
@@ -209,28 +251,40 @@ void SCKBase::writeEEPROM(uint16_t eeaddress, uint8_t data) {
   uint8_t retry = 0;
   while ((readEEPROM(eeaddress)!=data)&&(retry<10))
   {  
-    Wire.beginTransmission(E2PROM);
-    Wire.write((byte)(eeaddress >> 8));   // MSB
-    Wire.write((byte)(eeaddress & 0xFF)); // LSB
-    Wire.write(data);
-    Wire.endTransmission();
+    uint8_t block[3] = {(byte)(eeaddress >> 8), (byte)(eeaddress & 0xFF), data};  // MSB, LSB, data
+    SCKTwi::write(E2PROM, block, 3);
     delay(6);
     retry++;
   }
 }
 
+void SCKBase::writeEEPROM(uint16_t eeaddress, const uint8_t *data, uint8_t length) {
+  // Page write, the block must fit in one 64 byte page
+  uint8_t block[2 + 64];
+  if (length > 64) length = 64;
+  block[0] = (byte)(eeaddress >> 8);    // MSB
+  block[1] = (byte)(eeaddress & 0xFF);  // LSB
+  memcpy(block + 2, data, length);
+  SCKTwi::write(E2PROM, block, 2 + length);
+  delay(6);
+}
+
 byte SCKBase::readEEPROM(uint16_t eeaddress) {
   byte rdata = 0xFF;
-  Wire.beginTransmission(E2PROM);
-  Wire.write((byte)(eeaddress >> 8));   // MSB
-  Wire.write((byte)(eeaddress & 0xFF)); // LSB
-  Wire.endTransmission();
-  Wire.requestFrom(E2PROM,1);
-  while (!Wire.available()); 
-  rdata = Wire.read();
+  uint8_t pointer[2] = {(byte)(eeaddress >> 8), (byte)(eeaddress & 0xFF)};  // MSB, LSB
+  // The EEPROM NACKs its address during a write cycle (5 ms), poll it until it answers
+  unsigned long time = millis();
+  while ((SCKTwi::transfer(E2PROM, pointer, 2, &rdata, 1) == TWI_NACK_ADDR) && ((millis() - time) < 10));
   return rdata;
 }
 
+void SCKBase::readEEPROM(uint16_t eeaddress, uint8_t *data, uint8_t length) {
+  // Sequential read, the address counter of the EEPROM runs across the pages
+  uint8_t pointer[2] = {(byte)(eeaddress >> 8), (byte)(eeaddress & 0xFF)};  // MSB, LSB
+  unsigned long time = millis();
+  while ((SCKTwi::transfer(E2PROM, pointer, 2, data, length) == TWI_NACK_ADDR) && ((millis() - time) < 10));
+}
+
 void SCKBase::writeData(uint32_t eeaddress, long data, uint8_t location)
 {
     for (int i =0; i<4; i++) 
@@ -272,41 +326,62 @@ uint32_t SCKBase::readData(uint16_t eeaddress, uint8_t location)
   return data;
 }
 
-char* SCKBase::readData(uint16_t eeaddress, uint16_t pos, uint8_t location)
+uint8_t SCKBase::readStored(uint16_t eeaddress, uint8_t location)
 {
+  // One character of a stored string, 0x00 at its end (or past anything not printable)
+  uint8_t data = (location == EXTERNAL) ? readEEPROM(eeaddress) : EEPROM.read(eeaddress);
+  if ((data<0x7E)&&(data>0x1F)) return data;
+  return 0x00;
+}
+
+uint8_t SCKBase::readData(uint16_t eeaddress, uint16_t pos, char *text, uint8_t length, uint8_t location)
+{
+  // Copies a stored string into text (length bytes with the 0x00), returns its length
   eeaddress = eeaddress + buffer_length * pos;
-  uint16_t i;
-  if (location == EXTERNAL)
-    {
-      uint8_t temp = readEEPROM(eeaddress);
-      for ( i = eeaddress; ((temp!= 0x00)&&(temp<0x7E)&&(temp>0x1F)&&((i - eeaddress)<buffer_length)); i++) 
-      {
-        buffer[i - eeaddress] = readEEPROM(i);
-        temp = readEEPROM(i + 1);
-      }
-    }
-  else
-    {
-      uint8_t temp = EEPROM.read(eeaddress);
-      for ( i = eeaddress; ((temp!= 0x00)&&(temp<0x7E)&&(temp>0x1F)&&((i - eeaddress)<buffer_length)); i++) 
-      {
-        buffer[i - eeaddress] = EEPROM.read(i);
-        temp = EEPROM.read(i + 1);
-      }
-    }
-  buffer[i - eeaddress] = 0x00; 
-  return buffer;
+  uint8_t i = 0;
+  for (; (i < buffer_length) && (i < (length - 1)); i++)
+  {
+    text[i] = readStored(eeaddress + i, location);
+    if (text[i] == 0x00) return i;
+  }
+  text[i] = 0x00;
+  return i;
+}
+
+uint8_t SCKBase::printData(Print &out, uint16_t eeaddress, uint16_t pos, uint8_t location)
+{
+  // Streams a stored string straight to out (e.g. Serial1), returns its length
+  eeaddress = eeaddress + buffer_length * pos;
+  uint8_t i = 0;
+  for (; i < buffer_length; i++)
+  {
+    uint8_t data = readStored(eeaddress + i, location);
+    if (data == 0x00) break;
+    out.write(data);
+  }
+  return i;
+}
+
+boolean SCKBase::matchData(uint16_t eeaddress, uint16_t pos, const char *text, uint8_t location)
+{
+  // True if the stored string is text
+  eeaddress = eeaddress + buffer_length * pos;
+  for (uint8_t i = 0; i < buffer_length; i++)
+  {
+    uint8_t data = readStored(eeaddress + i, location);
+    if (data != (uint8_t)text[i]) return false;
+    if (data == 0x00) return true;
+  }
+  return (text[buffer_length] == 0x00);
 }
 
 boolean SCKBase::checkRTC() {
-  Wire.beginTransmission(RTC_ADDRESS);
-  Wire.write(0x00); //Address
-  Wire.endTransmission();
-  delay(4);
-  Wire.requestFrom(RTC_ADDRESS,1);
-  unsigned long time = millis();
-  while (!Wire.available()) if ((millis() - time)>500) return false;
-  Wire.read();
+  uint8_t seconds;
+  if (SCKTwi::read(RTC_ADDRESS, 0x00, &seconds, 1) != TWI_OK) 
+  {
+    TRACE(TRACE_RTC_FAIL, 0);
+    return false;
+  }
   return true;
 }
 
@@ -328,34 +403,14 @@ boolean SCKBase::RTCadjust(char *time) {
   }  
   if (data_count == 5)
   {
+    uint8_t registers[9] = {0x00, rtc[5], rtc[4], rtc[3], 0x00, rtc[2], rtc[1], rtc[0], 0x00};  //Address, time
 #if F_CPU == 8000000 
-    Wire.beginTransmission(RTC_ADDRESS);
-    Wire.write((int)0);
-    Wire.write(rtc[5]);
-    Wire.write(rtc[4]);
-    Wire.write(rtc[3]);
-    Wire.write(0x00);
-    Wire.write(rtc[2]);
-    Wire.write(rtc[1]);
-    Wire.write(rtc[0]);
-    Wire.endTransmission();
+    SCKTwi::write(RTC_ADDRESS, registers, 8);
     delay(4);
-    Wire.beginTransmission(RTC_ADDRESS);
-    Wire.write(0x0E); //Address
-    Wire.write(0x00); //Value
-    Wire.endTransmission();
+    uint8_t control[2] = {0x0E, 0x00};  //Address, value
+    SCKTwi::write(RTC_ADDRESS, control, 2);
 #else
-    Wire.beginTransmission(RTC_ADDRESS);
-    Wire.write((int)0);
-    Wire.write(rtc[5]);
-    Wire.write(rtc[4]);
-    Wire.write(rtc[3]);
-    Wire.write(0x00);
-    Wire.write(rtc[2]);
-    Wire.write(rtc[1]);
-    Wire.write(rtc[0]);
-    Wire.write((int)0);
-    Wire.endTransmission();
+    SCKTwi::write(RTC_ADDRESS, registers, 9);
     return true;
 #endif
     return true;
@@ -364,17 +419,14 @@ boolean SCKBase::RTCadjust(char *time) {
 }
 
 boolean SCKBase::RTCtime(char *time) {
-  Wire.beginTransmission(RTC_ADDRESS);
-  Wire.write((int)0);	
-  Wire.endTransmission();
-  Wire.requestFrom(RTC_ADDRESS, 7);
-  uint8_t seconds = (Wire.read() & 0x7F);
-  uint8_t minutes = Wire.read();
-  uint8_t hours = Wire.read();
-  Wire.read();
-  uint8_t day = Wire.read();
-  uint8_t month = Wire.read();
-  uint8_t year = Wire.read();
+  uint8_t registers[7];
+  SCKTwi::read(RTC_ADDRESS, 0x00, registers, 7);
+  uint8_t seconds = (registers[0] & 0x7F);
+  uint8_t minutes = registers[1];
+  uint8_t hours = registers[2];
+  uint8_t day = registers[4];
+  uint8_t month = registers[5];
+  uint8_t year = registers[6];
   time[0] = '2';
   time[1] = '0';
   time[2] = (year>>4) + '0';
@@ -400,18 +452,28 @@ boolean SCKBase::RTCtime(char *time) {
 
 boolean SCKBase::RTCisValid(char *time) {
   RTCtime(time);
-  //If year is 2016 we consider rtc data to ba a valid date (without update RTC starts in year 2000)
-  if (time[0] == '2' && time[1] == '0' && time[2] == '1' && time[3] == '6') return true;
+  //From 2016 on we consider rtc data to be a valid date (without update RTC starts in year 2000)
+  if (time[0] == '2' && time[1] == '0' && ((time[2] > '1') || (time[2] == '1' && time[3] >= '6'))) return true;
   return false;
 }
 
+uint32_t SCKBase::RTCseconds() {
+  // Seconds since midnight, used to check the time slept against the RTC
+  uint8_t registers[3];
+  SCKTwi::read(RTC_ADDRESS, 0x00, registers, 3);
+  uint8_t seconds = (registers[0] & 0x7F);
+  uint8_t minutes = registers[1];
+  uint8_t hours = (registers[2] & 0x3F);
+  return ((uint32_t)((hours>>4)*10 + (hours&0x0F))*3600) + ((minutes>>4)*10 + (minutes&0x0F))*60 + (seconds>>4)*10 + (seconds&0x0F);
+}
+
 uint16_t SCKBase::getPanel(float Vref){
 #if F_CPU == 8000000 
-  uint16_t value = 11*average(PANEL)*Vref/1023.;
+  uint16_t value = 11.*oversample(PANEL, ADC_BITS_PANEL)*Vref/ADC_FULL(ADC_BITS_PANEL);
   if (value > 500) value = value + 120; //Voltage protection diode
   else value = 0;
 #else
-  uint16_t value = 3*average(PANEL)*Vref/1023.;
+  uint16_t value = 3.*oversample(PANEL, ADC_BITS_PANEL)*Vref/ADC_FULL(ADC_BITS_PANEL);
   if (value > 500) value = value + 750; //Voltage protection diode
   else value = 0;
 #endif
@@ -527,12 +589,10 @@ const uint16_t batTable[] = {
 };
 
 uint16_t SCKBase::getBattery(float Vref) {
-  uint16_t temp = average(BAT);
+  uint16_t temp = oversample(BAT, ADC_BITS_BATTERY);
+  float voltage = Vref*temp/ADC_FULL(ADC_BITS_BATTERY);
 #if F_CPU == 8000000 
-  float voltage = Vref*temp/1023.;
   voltage = voltage + (voltage/180)*100;
-#else
-  float voltage = Vref*temp/1023.;
 #endif
   uint16_t percent = 1000;
   for(uint16_t i = 0; i < 100; i++) {
@@ -654,9 +714,13 @@ boolean SCKBase::enterCommandMode() {
     Serial1.println();
     if (findInResponse("\r\n<", 1000))
     {
+      if (retryCount > 0) TRACE(TRACE_CMD_RETRY, retryCount + 1);
+      numCommandRetries += retryCount;
       return true;
     }
   }
+  TRACE(TRACE_CMD_FAIL, COMMAND_MODE_ENTER_RETRY_ATTEMPTS);
+  numCommandRetries += COMMAND_MODE_ENTER_RETRY_ATTEMPTS;
   return false;
 }
 
@@ -688,7 +752,7 @@ boolean SCKBase::connect()
 {
   if (!ready())
   {
-    if (readData(EE_ADDR_NUMBER_NETS, INTERNAL)<1) return false;
+    if (SCKConfig::nets()<1) return false;
     if(enterCommandMode())
     {    
       sendCommand(F("set comm remote 0")); // FFR Hide Hello message
@@ -697,26 +761,23 @@ boolean SCKBase::connect()
       sendCommand(F("set ip proto 10")); //TCP mode and HTML mode
       sendCommand(F(DEFAULT_WIFLY_FTP_UPDATE)); //ftp server update
       sendCommand(F("set ftp mode 1"));
-      char* auth;
-      char* ssid;
-      char* pass;
-      char* antenna;
-      for (uint16_t nets = 0  ; nets < readData(EE_ADDR_NUMBER_NETS, INTERNAL); nets++) {
-        auth = readData(DEFAULT_ADDR_AUTH, nets, INTERNAL);
+      // The stored settings go straight from the EEPROM to the WiFly, sendCommand("") ends each line
+      for (uint16_t nets = 0  ; nets < SCKConfig::nets(); nets++) {
         sendCommand(F("set wlan auth "), true);
-        sendCommand(auth);
+        printData(Serial1, DEFAULT_ADDR_AUTH, nets, INTERNAL);
+        sendCommand("");
         boolean mode = true;
-        if ((auth==WEP)||(auth==WEP64)) mode=false;
-        ssid = readData(DEFAULT_ADDR_SSID, nets, INTERNAL);
+        if (matchData(DEFAULT_ADDR_AUTH, nets, WEP, INTERNAL) || matchData(DEFAULT_ADDR_AUTH, nets, WEP64, INTERNAL)) mode=false;
         sendCommand(F("set wlan ssid "), true);
-        sendCommand(ssid);
-        pass = readData(DEFAULT_ADDR_PASS, nets, INTERNAL);
+        printData(Serial1, DEFAULT_ADDR_SSID, nets, INTERNAL);
+        sendCommand("");
         if (mode) sendCommand(F("set wlan phrase "), true);  // WPA1, WPA2, OPEN
         else sendCommand(F("set wlan key "), true);
-        sendCommand(pass);
-        antenna = readData(DEFAULT_ADDR_ANTENNA, nets, INTERNAL);
+        printData(Serial1, DEFAULT_ADDR_PASS, nets, INTERNAL);
+        sendCommand("");
         sendCommand(F("set wlan ext_antenna "), true);
-        sendCommand(antenna);
+        printData(Serial1, DEFAULT_ADDR_ANTENNA, nets, INTERNAL);
+        sendCommand("");
         sendCommand(F("save"), false, "Storing in config"); // Store settings
         sendCommand(F("reboot"), false, "*READY*");
         if (ready()) return true;
@@ -759,15 +820,19 @@ boolean SCKBase::ready()
   }
   else
   {
+    if (scanDue()) scanCommand();  // Not associated yet, the scan costs no extra command mode
     Serial1.println(F("join"));
+    uint32_t start = millis();
     if (findInResponse("Associated!", 8000)) 
     {
+      TRACE(TRACE_JOIN, millis() - start);
       skipRemainderOfResponse(3000);
       exitCommandMode();
       return(true);
     }
+    TRACE(TRACE_JOIN_FAIL, millis() - start);
   } 
- 
+  return(false);
 }
 
 boolean connected = false;
@@ -783,12 +848,16 @@ boolean SCKBase::open(const char *addr, int port) {
     sendCommand(addr, true);
     Serial1.print(F(" "));
     Serial1.print(port);
+    uint32_t start = millis();
     if (sendCommand("", false, "*OPEN*")) 
     {
+      TRACE(TRACE_OPEN, millis() - start);
       connected = true;
       return true;
     }
-    else return false;
+    TRACE(TRACE_OPEN_FAIL, millis() - start);
+    numOpenRetries++;
+    return false;
   }
   enterCommandMode();
   return false;
@@ -858,36 +927,64 @@ char* SCKBase::id() {
 
 #define SCAN_BUFFER_SIZE 4 
 
+/*
+
+  A scan blocks the WiFly for seconds and drops its association, so the
+  number of networks is cached. ready() scans while it is in command mode
+  anyway, before the join, once the cache is older than SCAN_INTERVAL.
+
+*/
+
+boolean SCKBase::scanCommand() {
+  // Command mode already entered. A failed scan waits SCAN_INTERVAL too, the cached count is kept
+  scanTime = millis();
+  if (!sendCommand(F("scan"), false, "Found ")) return false;
+  char newChar;
+  byte offset = 0;
+  unsigned long time = millis();
+  while (offset < SCAN_BUFFER_SIZE) {
+    if (Serial1.available())
+    {
+      newChar = Serial1.read();
+      time = millis();
+      if ((newChar == '\r')||(newChar < '0')) break;
+      buffer[offset] = newChar;
+      offset++;
+    }
+    else if ((millis() - time) > 1000) break;
+  }
+  buffer[(offset < SCAN_BUFFER_SIZE) ? offset : SCAN_BUFFER_SIZE-1] = '\x00';
+  findInResponse("END:\r\n", 2000);
+  scanNets = atol(buffer);
+  netsTime = millis();
+  scanned = true;
+  return true;
+}
+
 uint32_t SCKBase::scan() {
+  // Scans now, returns the cached count if it fails
   if (enterCommandMode()) 
   {
-    if (sendCommand(F("scan"), false, "Found "))
-    {
-      char newChar;
-      byte offset = 0;
-
-      while (offset < SCAN_BUFFER_SIZE) {
-        if (Serial1.available())
-        {
-          newChar = Serial1.read();
-          if ((newChar == '\r')||(newChar < '0')) {
-            buffer[offset] = '\x00';
-            break;
-          } 
-          else if (newChar != -1) {
-            buffer[offset] = newChar;
-            offset++;
-          }
-        }
-      }
-      buffer[SCAN_BUFFER_SIZE-1] = '\x00';
-      findInResponse("END:\r\n", 2000);
-      exitCommandMode();
-    }        
+    scanCommand();
+    exitCommandMode();
   }
-  return atol(buffer);
+  else scanTime = millis();      // Waits SCAN_INTERVAL like a failed scan
+  return scanNets;
 } 
 
+boolean SCKBase::scanDue() {
+  return (!scanned && (scanTime == 0)) || ((millis() - scanTime) >= SCAN_INTERVAL);
+}
+
+uint32_t SCKBase::nets() {
+  return scanNets;
+}
+
+uint32_t SCKBase::netsAge() {
+  // s since the last scan (since boot if there was none)
+  return (millis() - netsTime)/1000;
+}
+
 int SCKBase::checkWiFly() {
   int ver = getWiFlyVersion();
   if (ver > 0)
@@ -976,6 +1073,123 @@ void SCKBase::repair()
   }
 }
 
+/*POWER*/
+
+extern volatile unsigned long timer0_millis;  // Arduino core millis() counter
+
+volatile boolean wdtWake = false;
+
+ISR(WDT_vect)
+{
+  wdtWake = true;
+}
+
+ISR(INT2_vect)
+{
+  EIMSK &= ~_BV(INT2);  // Level interrupt, it's only used to wake up on Serial1 (WiFly) activity
+}
+
+const uint16_t wdtPeriods[] = {16, 32, 64, 128, 256, 512, 1024};  // WDTO_15MS to WDTO_1S (ms), 2K to 128K cycles at 128 kHz
+
+boolean SCKBase::usbAttached() {
+  return (USBSTA & _BV(VBUS));
+}
+
+uint32_t SCKBase::sleepMCU(uint32_t ms) {
+  if (usbAttached()) 
+  {
+    // USB needs the clocks running, just halt the CPU until the next interrupt (millis tick, USB or UART)
+    uint32_t start = millis();
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    while (((millis() - start) < ms) && !Serial.available() && !Serial1.available()) sleep_mode();
+    return millis() - start;
+  }
+
+  // Power-down, woken up by the watchdog or by a start bit on Serial1 RX (INT2).
+  // Timer0 stops, so the time slept is added to millis() afterwards.
+  uint32_t slept = 0;
+  boolean rtc = (ms >= MIN_RTC_SLEEP) && checkRTC();
+  uint32_t rtcStart = 0;
+  if (rtc) rtcStart = RTCseconds();
+  timer1Stop();
+  ADCSRA &= ~_BV(ADEN);
+  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  while ((ms - slept) >= wdtPeriods[0])
+  {
+    byte period = WDTO_1S;
+    while ((period > WDTO_15MS) && (wdtPeriods[period] > (ms - slept))) period--;
+    cli();
+    wdtWake = false;
+    EICRA &= ~(_BV(ISC21) | _BV(ISC20));  // INT2 on low level, edges need the I/O clock
+    EIFR = _BV(INTF2);
+    EIMSK |= _BV(INT2);
+    MCUSR &= ~_BV(WDRF);
+    wdt_reset();
+    WDTCSR = _BV(WDCE) | _BV(WDE);
+    WDTCSR = _BV(WDIE) | period;          // Interrupt mode, no reset
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    wdt_disable();
+    EIMSK &= ~_BV(INT2);
+    if (!wdtWake) break;                  // Serial activity
+    slept += wdtPeriods[period];
+    if (usbAttached()) break;             // USB plugged in
+  }
+  ADCSRA |= _BV(ADEN);
+  timer1Initialize();
+
+  // The watchdog oscillator is only accurate to 10%, trust the RTC on long sleeps
+  if (rtc)
+  {
+    uint32_t elapsed = ((RTCseconds() + 86400 - rtcStart) % 86400)*second;
+    if ((elapsed > slept + second) || (elapsed + second < slept)) slept = elapsed;
+  }
+  uint8_t oldSREG = SREG;
+  cli();
+  timer0_millis += slept;
+  SREG = oldSREG;
+  
+  // The rest is shorter than a watchdog period, the CPU halts until the next millis tick instead of spinning the loop
+  if (wdtWake && (ms > slept))
+  {
+    uint32_t start = millis();
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    while (((millis() - start) < (ms - slept)) && !Serial.available() && !Serial1.available()) sleep_mode();
+  }
+  #if debugBASE
+    Serial.print(F("Slept: "));
+    Serial.print(slept);
+    Serial.println(F(" ms"));
+  #endif
+  return slept;
+}
+
+byte SCKBase::resetCause() {
+  return resetFlags;
+}
+
+int SCKBase::freeRAM() {
+  // Gap between the heap and the stack
+  extern int __heap_start, *__brkval;
+  int v;
+  return (int)(size_t)&v - (__brkval == 0 ? (int)(size_t)&__heap_start : (int)(size_t)__brkval);
+}
+
+uint16_t SCKBase::commandRetries() {
+  return numCommandRetries;
+}
+
+uint16_t SCKBase::openRetries() {
+  return numOpenRetries;
+}
+
+void SCKBase::clearRetries() {
+  numCommandRetries = 0;
+  numOpenRetries = 0;
+}
+
 /*TIMER*/
 
 #define RESOLUTION 65536    // Timer1 is 16 bit
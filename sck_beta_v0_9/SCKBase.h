@@ -23,18 +23,23 @@ public:
     void config();
     void eepromCheck();
     void clearmemory();
-    float average(int anaPin);
+    uint16_t oversample(int anaPin, byte bits);
     boolean checkText(char* text, char* text1);
     boolean compareData(char* text, char* text1);
-    void writeMCP(byte deviceaddress, byte address, int data );
+    void loadMCP();
+    boolean writeMCP(byte deviceaddress, byte address, int data );
     int readMCP(int deviceaddress, uint16_t address );
     float readCharge();
     void writeCharge(int current);
     void writeEEPROM(uint16_t eeaddress, uint8_t data);
+    void writeEEPROM(uint16_t eeaddress, const uint8_t *data, uint8_t length);
     byte readEEPROM(uint16_t eeaddress);
+    void readEEPROM(uint16_t eeaddress, uint8_t *data, uint8_t length);
     void writeData(uint32_t eeaddress, long data, uint8_t location);
     void writeData(uint32_t eeaddress, uint16_t pos, char* text, uint8_t location);
-    char* readData(uint16_t eeaddress, uint16_t pos, uint8_t location);
+    uint8_t readData(uint16_t eeaddress, uint16_t pos, char *text, uint8_t length, uint8_t location);
+    uint8_t printData(Print &out, uint16_t eeaddress, uint16_t pos, uint8_t location);
+    boolean matchData(uint16_t eeaddress, uint16_t pos, const char *text, uint8_t location);
     uint32_t readData(uint16_t eeaddress, uint8_t location);
     
     uint16_t getPanel(float Vref);
@@ -45,6 +50,7 @@ public:
     boolean RTCadjust(char *time);
     boolean RTCtime(char *time);
     boolean RTCisValid(char *time);
+    uint32_t RTCseconds();
     
     /*Wifi commands*/
     boolean findInResponse(const char *toMatch,
@@ -68,16 +74,31 @@ public:
     char* MAC();
     char* id();
     uint32_t scan();
+    boolean scanDue();
+    uint32_t nets();
+    uint32_t netsAge();
     int checkWiFly();
     int getWiFlyVersion();
     boolean update();
     void repair();
     
+    /*Power commands*/
+    boolean usbAttached();
+    uint32_t sleepMCU(uint32_t ms);
+    
+    /*Health commands*/
+    byte resetCause();
+    int freeRAM();
+    uint16_t commandRetries();
+    uint16_t openRetries();
+    void clearRetries();
+    
     /*Timer commands*/
     void timer1SetPeriod(long microseconds);
     void timer1Initialize();
     void timer1Stop();
 private:
-    
+    uint8_t readStored(uint16_t eeaddress, uint8_t location);
+    boolean scanCommand();
 };
 #endif
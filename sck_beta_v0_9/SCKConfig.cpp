@@ -0,0 +1,129 @@
+/*
+
+  SCKConfig.cpp
+  Kit configuration kept in RAM, loaded once at boot.
+
+*/
+
+#include "Constants.h"
+#include "SCKConfig.h"
+#include <EEPROM.h>
+#include <stddef.h>
+
+#define debugConfig false
+
+#define CONFIG_SET(field, value) if (block.field != (value)) { block.field = (value); configDirty = true; }
+
+SCKConfigBlock SCKConfig::block;
+byte    configSlot  = 0;       // Slot holding the current block
+boolean configDirty = false;
+
+uint16_t SCKConfig::crc(const SCKConfigBlock *config) {
+  // CRC-16/CCITT (0x1021), initial value 0xFFFF
+  const uint8_t *data = (const uint8_t *)config;
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 0; i < offsetof(SCKConfigBlock, crc); i++)
+  {
+    crc ^= (uint16_t)data[i] << 8;
+    for (byte bit = 0; bit < 8; bit++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+  }
+  return crc;
+}
+
+boolean SCKConfig::load(uint8_t slot, SCKConfigBlock *config) {
+  uint16_t eeaddress = CONFIG_ADDR + slot*CONFIG_SLOT_SIZE;
+  uint8_t *data = (uint8_t *)config;
+  for (uint8_t i = 0; i < sizeof(SCKConfigBlock); i++) data[i] = EEPROM.read(eeaddress + i);
+  return (config->version == CONFIG_VERSION) && (config->crc == crc(config));
+}
+
+uint32_t readLegacy(uint16_t eeaddress) {
+  // 4 bytes MSB first, as SCKBase::writeData() stored them
+  uint32_t data = 0;
+  for (byte i = 0; i < 4; i++) data = (data << 8) | EEPROM.read(eeaddress + i);
+  return data;
+}
+
+void SCKConfig::import() {
+  block.version       = CONFIG_VERSION;
+  block.sensorMode    = readLegacy(EE_ADDR_SENSOR_MODE);
+  block.timeUpdate    = readLegacy(EE_ADDR_TIME_UPDATE);
+  block.numberUpdates = readLegacy(EE_ADDR_NUMBER_UPDATES);
+  block.readMeasure   = readLegacy(EE_ADDR_NUMBER_READ_MEASURE);
+  block.writeMeasure  = readLegacy(EE_ADDR_NUMBER_WRITE_MEASURE);
+  block.telemetry     = readLegacy(EE_ADDR_TELEMETRY) & TELEMETRY_ALL;
+  block.fifoLayout    = readLegacy(EE_ADDR_FIFO_LAYOUT);
+  block.nets          = readLegacy(EE_ADDR_NUMBER_NETS);
+  block.sequence      = 0;
+}
+
+boolean SCKConfig::begin() {
+  // Returns false if there was no usable configuration, the defaults are loaded then
+  SCKConfigBlock other;
+  boolean validA = load(0, &block);
+  boolean validB = load(1, &other);
+  configDirty = false;
+  configSlot = 0;
+  if (validB && (!validA || ((int8_t)(other.sequence - block.sequence) > 0)))
+  {
+    block = other;
+    configSlot = 1;
+  }
+  else if (!validA)
+  {
+    import();
+    configDirty = true;
+    #if debugConfig
+      Serial.println(F("Config: legacy fields imported"));
+    #endif
+  }
+  if (valid()) return true;
+  defaults();
+  return false;
+}
+
+void SCKConfig::defaults() {
+  block.version       = CONFIG_VERSION;
+  block.sensorMode    = DEFAULT_MODE_SENSOR;
+  block.timeUpdate    = DEFAULT_TIME_UPDATE;
+  block.numberUpdates = DEFAULT_MIN_UPDATES;
+  block.readMeasure   = 0;
+  block.writeMeasure  = 0;
+  block.telemetry     = 0;
+  block.fifoLayout    = FIFO_RECORD_SIZE;
+  block.nets          = 0;
+  configDirty = true;
+}
+
+boolean SCKConfig::valid() {
+  if (block.sensorMode > ECONOMIC) return false;
+  if ((block.timeUpdate < MIN_TIME_UPDATE) || (block.timeUpdate > MAX_TIME_UPDATE)) return false;
+  if ((block.numberUpdates < DEFAULT_MIN_UPDATES) || (block.numberUpdates > POST_MAX)) return false;
+  return true;
+}
+
+boolean SCKConfig::commit() {
+  // Returns true if the block was written
+  if (!configDirty) return false;
+  block.sequence++;
+  block.crc = crc(&block);
+  configSlot ^= 1;
+  uint16_t eeaddress = CONFIG_ADDR + configSlot*CONFIG_SLOT_SIZE;
+  const uint8_t *data = (const uint8_t *)&block;
+  for (uint8_t i = 0; i < sizeof(SCKConfigBlock); i++) EEPROM.update(eeaddress + i, data[i]);
+  configDirty = false;
+  #if debugConfig
+    Serial.print(F("Config: slot "));
+    Serial.println(configSlot);
+  #endif
+  return true;
+}
+
+void SCKConfig::setSensorMode(uint8_t mode)        { CONFIG_SET(sensorMode, mode); }
+void SCKConfig::setTimeUpdate(uint16_t seconds)    { CONFIG_SET(timeUpdate, seconds); }
+void SCKConfig::setNumberUpdates(uint16_t updates) { CONFIG_SET(numberUpdates, updates); }
+void SCKConfig::setReadMeasure(uint16_t eeaddress) { CONFIG_SET(readMeasure, eeaddress); }
+void SCKConfig::setWriteMeasure(uint16_t eeaddress){ CONFIG_SET(writeMeasure, eeaddress); }
+void SCKConfig::setTelemetry(uint16_t fields)      { CONFIG_SET(telemetry, fields & TELEMETRY_ALL); }
+void SCKConfig::setFifoLayout(uint16_t size)       { CONFIG_SET(fifoLayout, size); }
+void SCKConfig::setNets(uint8_t nets)              { CONFIG_SET(nets, nets); }
@@ -0,0 +1,65 @@
+/*
+
+  SCKConfig.h
+  Kit configuration kept in RAM, loaded once at boot.
+
+  - All the settings live in one block with a CRC, reads cost nothing.
+  - Setters only mark the block dirty, commit() writes it back in one go.
+  - Two slots (A/B) in the internal EEPROM: a commit goes to the slot not
+    in use, so a reset in the middle of it leaves the previous block valid.
+    Only the bytes that changed are written.
+  - A kit without a valid block imports the loose 4 byte fields of the
+    older firmware (EE_ADDR_*) on its first boot.
+
+*/
+
+#ifndef __SCKCONFIG_H__
+#define __SCKCONFIG_H__
+
+#include <Arduino.h>
+
+struct SCKConfigBlock {
+  uint8_t  version;        // CONFIG_VERSION
+  uint8_t  sensorMode;     // OFFLINE, NOWIFI, NORMAL, ECONOMIC
+  uint16_t timeUpdate;     // s between readings
+  uint16_t numberUpdates;  // Readings before posting
+  uint16_t readMeasure;    // FIFO pointers in the external EEPROM
+  uint16_t writeMeasure;
+  uint16_t telemetry;      // TELEMETRY_* fields posted with the live reading
+  uint16_t fifoLayout;     // FIFO_RECORD_SIZE of the stored readings (0: legacy layout)
+  uint8_t  nets;           // Networks in the memory
+  uint8_t  sequence;       // The newer of the two slots is the current one
+  uint16_t crc;            // CRC-16 of everything above
+};
+
+class SCKConfig {
+public:
+  static boolean begin();
+  static void defaults();
+  static boolean valid();
+  static boolean commit();
+
+  static uint8_t  sensorMode()    { return block.sensorMode; }
+  static uint16_t timeUpdate()    { return block.timeUpdate; }
+  static uint16_t numberUpdates() { return block.numberUpdates; }
+  static uint16_t readMeasure()   { return block.readMeasure; }
+  static uint16_t writeMeasure()  { return block.writeMeasure; }
+  static uint16_t telemetry()     { return block.telemetry; }
+  static uint16_t fifoLayout()    { return block.fifoLayout; }
+  static uint8_t  nets()          { return block.nets; }
+
+  static void setSensorMode(uint8_t mode);
+  static void setTimeUpdate(uint16_t seconds);
+  static void setNumberUpdates(uint16_t updates);
+  static void setReadMeasure(uint16_t eeaddress);
+  static void setWriteMeasure(uint16_t eeaddress);
+  static void setTelemetry(uint16_t fields);
+  static void setFifoLayout(uint16_t size);
+  static void setNets(uint8_t nets);
+private:
+  static SCKConfigBlock block;
+  static boolean load(uint8_t slot, SCKConfigBlock *config);
+  static void import();
+  static uint16_t crc(const SCKConfigBlock *config);
+};
+#endif
@@ -0,0 +1,151 @@
+/*
+
+  SCKScheduler.cpp
+  Cooperative deadline scheduler for the sensor and network tasks.
+
+*/
+
+#include "Constants.h"
+#include "SCKScheduler.h"
+
+#define debugScheduler false
+
+struct SCKTask {
+  SCKTaskCallback callback;
+  uint32_t period;     // ms
+  uint32_t warmup;     // ms
+  uint32_t budget;     // ms
+  uint32_t deadline;   // millis() of the next run
+  uint32_t duration;   // ms used by the last run
+  uint16_t overruns;   // runs longer than budget
+  boolean  active;
+  boolean  pending;    // run once outside the period (trigger)
+  uint32_t triggered;  // millis() when the triggered run is due
+};
+
+SCKTask tasks[MAX_TASKS];
+byte numTasks = 0;
+
+void SCKScheduler::begin() {
+  numTasks = 0;
+}
+
+byte SCKScheduler::add(SCKTaskCallback callback, uint32_t period, uint32_t warmup, uint32_t budget) {
+  if (numTasks >= MAX_TASKS) return NO_TASK;
+  if (period == 0) period = 1;
+  SCKTask *task = &tasks[numTasks];
+  task->callback = callback;
+  task->period   = period;
+  task->warmup   = warmup;
+  task->budget   = budget;
+  task->duration = 0;
+  task->overruns = 0;
+  task->pending  = false;
+  task->active   = false;
+  numTasks++;
+  enable(numTasks - 1, true);
+  return numTasks - 1;
+}
+
+void SCKScheduler::setPeriod(byte task, uint32_t period) {
+  if (task >= numTasks) return;
+  if (period == 0) period = 1;
+  if (tasks[task].period == period) return;
+  // Move the pending deadline so the new period applies from the last run
+  tasks[task].deadline = tasks[task].deadline - tasks[task].period + period;
+  tasks[task].period = period;
+}
+
+void SCKScheduler::enable(byte task, boolean active) {
+  if (task >= numTasks) return;
+  if (active && !tasks[task].active) tasks[task].deadline = millis() + tasks[task].warmup;
+  if (!active) tasks[task].pending = false;
+  tasks[task].active = active;
+}
+
+boolean SCKScheduler::enabled(byte task) {
+  if (task >= numTasks) return false;
+  return tasks[task].active;
+}
+
+void SCKScheduler::trigger(byte task, uint32_t delay) {
+  // Runs the task once, after delay ms, without touching its periodic deadline
+  if (task >= numTasks) return;
+  if (!tasks[task].active) return;
+  tasks[task].pending = true;
+  tasks[task].triggered = millis() + delay;
+}
+
+byte SCKScheduler::next() {
+  // Due triggered tasks first (in order of creation), then the most overdue one
+  byte selected = NO_TASK;
+  int32_t late = -1;
+  uint32_t now = millis();
+  for (byte i = 0; i < numTasks; i++) {
+    if (!tasks[i].active) continue;
+    if (tasks[i].pending && ((int32_t)(now - tasks[i].triggered) >= 0)) return i;
+    int32_t overdue = (int32_t)(now - tasks[i].deadline);
+    if (overdue > late) {
+      late = overdue;
+      selected = i;
+    }
+  }
+  return selected;
+}
+
+boolean SCKScheduler::run() {
+  byte i = next();
+  if (i == NO_TASK) return false;
+  SCKTask *task = &tasks[i];
+  boolean periodic = !task->pending || ((int32_t)(millis() - task->triggered) < 0);
+  if (!periodic) task->pending = false;
+
+  uint32_t start = millis();
+  task->callback();
+  task->duration = millis() - start;
+  if (task->duration > task->budget) {
+    task->overruns++;
+    #if debugScheduler
+      Serial.print(F("Task "));
+      Serial.print(i);
+      Serial.print(F(" over budget: "));
+      Serial.print(task->duration);
+      Serial.println(F(" ms"));
+    #endif
+  }
+
+  if (periodic) {
+    // Skip the slots missed during a stall but keep the phase
+    uint32_t now = millis();
+    task->deadline += task->period;
+    if ((int32_t)(now - task->deadline) >= 0) {
+      uint32_t missed = (now - task->deadline)/task->period + 1;
+      task->deadline += missed*task->period;
+    }
+  }
+  return true;
+}
+
+uint32_t SCKScheduler::idleTime() {
+  // Time until the next deadline, 0 if something is already due
+  uint32_t now = millis();
+  uint32_t idle = 0xFFFFFFFF;
+  for (byte i = 0; i < numTasks; i++) {
+    if (!tasks[i].active) continue;
+    int32_t remaining = (int32_t)(tasks[i].deadline - now);
+    if (tasks[i].pending && ((int32_t)(tasks[i].triggered - now) < remaining)) remaining = tasks[i].triggered - now;
+    if (remaining <= 0) return 0;
+    if ((uint32_t)remaining < idle) idle = remaining;
+  }
+  return idle;
+}
+
+uint32_t SCKScheduler::duration(byte task) {
+  if (task >= numTasks) return 0;
+  return tasks[task].duration;
+}
+
+uint16_t SCKScheduler::overruns(byte task) {
+  if (task >= numTasks) return 0;
+  return tasks[task].overruns;
+}
@@ -0,0 +1,45 @@
+/*
+
+  SCKScheduler.h
+  Cooperative deadline scheduler for the sensor and network tasks.
+
+  - Every task has its own:
+
+    - period  : time between two runs (ms)
+    - warm-up : time from enable() until the first run (ms)
+    - budget  : expected run time (ms), longer runs are counted as overruns
+
+  Deadlines are kept in phase (next = next + period) so a slow task only
+  delays the others once, it never shifts their sampling cadence.
+
+  trigger() runs a task once outside its period, now or after a delay, e.g.
+  the next step of a sensor read that completes in the background.
+
+*/
+
+#ifndef __SCKSCHEDULER_H__
+#define __SCKSCHEDULER_H__
+
+#include <Arduino.h>
+
+#define MAX_TASKS    9
+#define NO_TASK      0xFF
+
+typedef void (*SCKTaskCallback)();
+
+class SCKScheduler {
+public:
+  void begin();
+  byte add(SCKTaskCallback callback, uint32_t period, uint32_t warmup, uint32_t budget);
+  void setPeriod(byte task, uint32_t period);
+  void enable(byte task, boolean active);
+  boolean enabled(byte task);
+  void trigger(byte task, uint32_t delay = 0);
+  boolean run();
+  uint32_t idleTime();
+  uint32_t duration(byte task);
+  uint16_t overruns(byte task);
+private:
+  byte next();
+};
+#endif
@@ -9,7 +9,10 @@
 #include "SCKServer.h"
 #include "SCKBase.h"
 #include "SCKAmbient.h"
-#include <Wire.h>
+#include "SCKStage.h"
+#include "SCKTrace.h"
+#include "SCKConfig.h"
+#include "SCKBackoff.h"
 #include <EEPROM.h>
 
 #define debugServer   false
@@ -19,8 +22,24 @@ SCKServer server__;
 SCKAmbient ambient__;
 
 #define TIME_BUFFER_SIZE 20 
+#define numbers_retry 5
+
+static_assert(true SENSOR_LIST(SENSOR_X_VALID), "Sensor readings are stored in 1 to 4 bytes, scales start at 1");
+static_assert(TIMESTAMP_BYTES >= TIME_BUFFER_SIZE, "The FIFO timestamp must hold the time buffer");
+static_assert(MAX_MEMORY >= POST_MAX, "The FIFO must hold at least one batch of readings");
+static_assert((BACKFILL_SLICE > 0) && (BACKFILL_SLICE <= POST_MAX), "A backfill slice is one post");
+static_assert(DEFAULT_ADDR_MEASURES + MAX_MEMORY*FIFO_RECORD_SIZE <= TRACE_EEPROM_ADDR, "The FIFO overlaps the trace log");
+
+uint16_t pendingUpdates = 0;  // Stored readings sent in this cycle
+uint32_t connectTime = 0;     // ms to join the network in this cycle
+uint32_t cycleTime = 0;       // ms of the last send()
+
+char    headerMac[18];                   // Request header fields, read once from the EEPROM
+char    headerApikey[buffer_length + 1];
+boolean headerCached = false;
 
 boolean SCKServer::time(char *time_) {
+  STAGE_BEGIN("time");
   boolean ok=false;
   uint8_t count = 0;
   byte retry=0;
@@ -29,7 +48,7 @@ boolean SCKServer::time(char *time_) {
    retry++;
    if (base__.enterCommandMode()) 
     {
-      if (base__.open(WEB[0], 80))
+      if (base__.open(WEB_HOST, 80))
        {
         for(byte i = 0; i<3; i++) Serial1.print(WEBTIME[i]); //Requests to the server time
         if (base__.findInResponse("UTC:", 2000)) 
@@ -77,10 +96,13 @@ boolean SCKServer::time(char *time_) {
   }
   if (!ok)
     {
+      TRACE(TRACE_TIME_FAIL, retry);
       time_[0] = '#';
       time_[1] = 0x00;
     }
+  else TRACE(TRACE_TIME, retry);
   base__.exitCommandMode();
+  STAGE_END("time");
   return ok;
 }
 
@@ -99,117 +121,494 @@ boolean SCKServer::RTCupdate(char *time_){
   return false;
 }
 
+/*
+
+  The answer to every post carries the time of the server in its Date header
+  ("Date: Sun, 05 Jun 2016 10:00:01 GMT"), the RTC is checked against it and
+  only set when it is more than TIME_DRIFT_MAX s off. /datetime is only asked
+  for when the RTC has no valid time.
+
+*/
+
+const char MONTHS[] PROGMEM = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+long daySeconds(const char *time_)
+{
+  // "YYYY-MM-DD hh:mm:ss"
+  return ((time_[11] - '0')*10L + (time_[12] - '0'))*3600 + ((time_[14] - '0')*10 + (time_[15] - '0'))*60 + (time_[17] - '0')*10 + (time_[18] - '0');
+}
+
+boolean SCKServer::responseTime(char *time_)
+{
+  if (!base__.findInResponse("Date: ", RESPONSE_TIMEOUT)) return false;
+  char date[30];  // "Sun, 05 Jun 2016 10:00:01 GMT"
+  byte length = 0;
+  unsigned long time = millis();
+  while (length < sizeof(date) - 1)
+  {
+    if (Serial1.available())
+    {
+      char newChar = Serial1.read();
+      if (newChar == '\r') break;
+      date[length++] = newChar;
+      time = millis();
+    }
+    else if ((millis() - time) > 1000) return false;
+  }
+  if ((length < 25) || (date[3] != ',') || (date[19] != ':') || (date[22] != ':')) return false;
+  byte month = 0;
+  while ((month < 12) && !((pgm_read_byte(MONTHS + month*3) == date[8]) && (pgm_read_byte(MONTHS + month*3 + 1) == date[9]) && (pgm_read_byte(MONTHS + month*3 + 2) == date[10]))) month++;
+  if (month == 12) return false;
+  month++;
+  memcpy(time_, date + 12, 4);          // Year
+  time_[4] = '-';
+  time_[5] = '0' + month/10;
+  time_[6] = '0' + month%10;
+  time_[7] = '-';
+  memcpy(time_ + 8, date + 5, 2);       // Day
+  time_[10] = ' ';
+  memcpy(time_ + 11, date + 17, 8);     // hh:mm:ss
+  time_[19] = 0x00;
+  return true;
+}
+
+boolean SCKServer::syncTime()
+{
+  // Returns true if the RTC had to be set
+  STAGE_BEGIN("sync");
+  boolean adjusted = false;
+  char server[TIME_BUFFER_SIZE];
+  char rtc[TIME_BUFFER_SIZE];
+  if (responseTime(server) && base__.checkRTC())
+  {
+    base__.RTCtime(rtc);
+    long drift = 86400;                     // Another day, more than any drift within the day
+    if (strncmp(server, rtc, 11) == 0) drift = labs(daySeconds(server) - daySeconds(rtc));
+    #if debugServer
+      Serial.print(F("Server time: "));
+      Serial.print(server);
+      Serial.print(F(" RTC: "));
+      Serial.println(rtc);
+    #endif
+    if (drift > TIME_DRIFT_MAX)
+    {
+      TRACE(TRACE_RTC_ADJUST, min(drift, 0xFFFFL));
+      byte retry = 0;
+      while (!base__.RTCadjust(server) && (retry<numbers_retry)) retry++;
+      adjusted = true;
+    }
+  }
+  STAGE_END("sync");
+  return adjusted;
+}
+
+/* 
+
+  JSON records are rendered in RAM and handed to the UART JSON_CHUNK bytes at a
+  time (the size of its TX buffer).
+
+*/
+
+const uint32_t jsonPowers[9] PROGMEM = {1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10};
+
+char     jsonChunk[JSON_CHUNK];
+byte     jsonUsed = 0;
+Print   *jsonOut = &Serial1;
+
+uint8_t jsonDigits(char *text, long value)
+{
+  // Base 10 without 32 bit divisions: every digit counts the subtractions of its power of ten
+  uint8_t length = 0;
+  uint32_t rest = value;
+  if (value < 0)
+  {
+    text[length++] = '-';
+    rest = 0UL - rest;
+  }
+  boolean leading = true;
+  for (byte i = 0; i < 9; i++)
+  {
+    uint32_t power = pgm_read_dword(&jsonPowers[i]);
+    char digit = '0';
+    while (rest >= power) { rest -= power; digit++; }
+    if (leading && (digit == '0')) continue;
+    leading = false;
+    text[length++] = digit;
+  }
+  text[length++] = '0' + rest;
+  return length;
+}
+
+void jsonFlush()
+{
+  if (jsonUsed == 0) return;
+  jsonOut->write((const uint8_t *)jsonChunk, jsonUsed);
+  #if debugServer
+    if (jsonOut == &Serial1) Serial.write((const uint8_t *)jsonChunk, jsonUsed);
+  #endif
+  jsonUsed = 0;
+}
+
+void jsonPut(const char *text, uint8_t length)
+{
+  for (uint8_t i = 0; i < length; i++)
+  {
+    if (jsonUsed == JSON_CHUNK) jsonFlush();
+    jsonChunk[jsonUsed++] = text[i];
+  }
+}
+
+void jsonPut(const char *text)
+{
+  jsonPut(text, strlen(text));
+}
+
+void jsonPut(const __FlashStringHelper *text)
+{
+  const char *flash = (const char *)text;
+  char c;
+  while ((c = pgm_read_byte(flash++)) != 0x00) jsonPut(&c, 1);
+}
+
+void jsonField(const char *separator, const char *key, const __FlashStringHelper *flashKey, long value)
+{
+  char digits[11];
+  jsonPut(separator);
+  if (key) jsonPut(key);
+  else jsonPut(flashKey);
+  jsonPut("\":\"", 3);
+  jsonPut(digits, jsonDigits(digits, value));
+}
+
+void SCKServer::jsonRecord(long *value, char *time, boolean live)
+{
+  for (byte i = 0; i<SENSORS; i++) jsonField((i == 0) ? "{\"" : "\",\"", SENSOR_KEY[i], 0, value[i]);
+  if (live) telemetry();
+  jsonPut(F("\",\"timestamp\":\""));
+  jsonPut(time);
+  jsonPut("\"}", 2);
+}
+
 void SCKServer::json_update(uint16_t updates, long *value, char *time, boolean isMultipart)
 {  
-      #if debugServer
-         Serial.print(F("["));
-      #endif
-      Serial1.print(F("["));  
+      STAGE_BEGIN("json");
+      jsonPut("[", 1);
       for (int i = 0; i< updates;i++)
         {
           readFIFO();
-          if ((i< (updates - 1)) || (isMultipart))
-            {
-              Serial1.print(F(","));
-              #if debugServer
-                Serial.print(F(","));
-              #endif
-            }
+          if ((i< (updates - 1)) || (isMultipart)) jsonPut(",", 1);
         }
  
  if (isMultipart)
    {
-      byte i;
-      for (i = 0; i<9; i++)
-        {
-          Serial1.print(SERVER[i]);
-          Serial1.print(value[i]); 
-        }  
-      Serial1.print(SERVER[i]);  
-      Serial1.print(time);
-      Serial1.print(SERVER[i+1]);
-      Serial1.println(F("]"));
-      Serial1.println();
-      
-      #if debugServer
-         for (i = 0; i<9; i++)
-         {
-         Serial.print(SERVER[i]);
-         Serial.print(value[i]);
-         }
-         Serial.print(SERVER[i]);
-         Serial.print(time);
-         Serial.print(SERVER[i+1]);
-      #endif
+      jsonRecord(value, time, true);
+      jsonPut("]\r\n\r\n", 5);
    }
-      Serial1.println(F("]"));
-      Serial1.println();
-      #if debugServer
-         Serial.println(F("]"));
-      #endif
+      jsonPut("]\r\n\r\n", 5);
+      jsonFlush();
+      STAGE_END("json");
 }  
 
-void SCKServer::addFIFO(long *value, char *time)
+void SCKServer::telemetry()
+{
+  // Health of the kit, only on the live reading
+  uint16_t fields = SCKConfig::telemetry();
+  if (fields & TELEMETRY_FIFO)    jsonField("\",\"", 0, F("fifo"), pendingUpdates);
+  if (fields & TELEMETRY_CONNECT) jsonField("\",\"", 0, F("connect_ms"), connectTime);
+  if (fields & TELEMETRY_RETRIES)
+  {
+    jsonField("\",\"", 0, F("cmd_retries"), base__.commandRetries());
+    jsonField("\",\"", 0, F("open_retries"), base__.openRetries());
+  }
+  if (fields & TELEMETRY_CYCLE)   jsonField("\",\"", 0, F("cycle_ms"), cycleTime);
+  if (fields & TELEMETRY_RESET)   jsonField("\",\"", 0, F("reset"), base__.resetCause());
+  if (fields & TELEMETRY_RAM)     jsonField("\",\"", 0, F("free_ram"), base__.freeRAM());
+  if (fields & TELEMETRY_NETS_AGE) jsonField("\",\"", 0, F("nets_age"), base__.netsAge());
+}
+
+#if benchEnabled
+  class SCKNullPrint : public Print {
+  public:
+    uint32_t count;                // Bytes written, to report the record length
+    size_t write(uint8_t) { count++; return 1; }
+    size_t write(const uint8_t *, size_t size) { count += size; return size; }
+  };
+
+  void SCKServer::benchmark(long *value, char *time)
   {
-    uint16_t updates = (base__.readData(EE_ADDR_NUMBER_WRITE_MEASURE, INTERNAL)-base__.readData(EE_ADDR_NUMBER_READ_MEASURE, INTERNAL))/((SENSORS)*4 + TIME_BUFFER_SIZE);
-    if (updates < MAX_MEMORY)
+    // "bench json": one record through the Print path the firmware used before and through the serializer
+    SCKNullPrint sink;
+    uint32_t start = micros();
+    for (byte n = 0; n < BENCH_RECORDS; n++)
     {
-      int eeaddress = base__.readData(EE_ADDR_NUMBER_WRITE_MEASURE, INTERNAL);
-      int i = 0;
-      for (i = 0; i<9; i++)
-        {
-          base__.writeData(eeaddress + i*4, value[i], EXTERNAL);
-        } 
-      base__.writeData(eeaddress + i*4, 0, time, EXTERNAL);
-      eeaddress = eeaddress + (SENSORS)*4 + TIME_BUFFER_SIZE;
-      base__.writeData(EE_ADDR_NUMBER_WRITE_MEASURE, eeaddress, INTERNAL);
+      for (byte i = 0; i<SENSORS; i++)
+      {
+        sink.print((i == 0) ? F("{\"") : F("\",\""));
+        sink.print(SENSOR_KEY[i]);
+        sink.print(F("\":\""));
+        sink.print(value[i]);
+      }
+      sink.print(F("\",\"timestamp\":\""));
+      sink.print(time);
+      sink.print(F("\"}"));
     }
-    else
+    uint32_t printTime = micros() - start;
+    jsonOut = &sink;
+    sink.count = 0;
+    start = micros();
+    for (byte n = 0; n < BENCH_RECORDS; n++)
     {
-      #if debugEnabled
-              if (!ambient__.debug_state()) Serial.println(F("Memory limit exceeded!!"));
-      #endif
+      jsonRecord(value, time, false);
+      jsonFlush();
     }
+    uint32_t jsonTime = micros() - start;
+    jsonOut = &Serial1;
+    Serial.print(F("Print: "));
+    Serial.print(printTime/BENCH_RECORDS);
+    Serial.print(F(" us, serializer: "));
+    Serial.print(jsonTime/BENCH_RECORDS);
+    Serial.print(F(" us, "));
+    Serial.print(sink.count/BENCH_RECORDS);
+    Serial.println(F(" bytes per record"));
+  }
+#endif
+
+/*
+
+  FIFO records are read and written whole, one sequential read and a page
+  write per 64 byte page. When the write pointer reaches the end of the FIFO
+  the stored readings are moved back to the start; if they fill more than
+  FIFO_COMPACT_LEVEL, neighbours are merged on the way until a quarter of
+  them is gone (mean, min or max per SENSOR_MERGE, at their mean time).
+  The weight of a record is the number of readings merged into it. The
+  lightest records are merged first, oldest first, so old readings lose
+  resolution evenly instead of new ones being dropped (round robin database).
+
+*/
+
+#define FIFO_TIME_OFFSET    (FIFO_RECORD_SIZE - FIFO_WEIGHT_BYTES - TIMESTAMP_BYTES)
+#define FIFO_WEIGHT_OFFSET  (FIFO_RECORD_SIZE - FIFO_WEIGHT_BYTES)
+
+const uint8_t MONTH_DAYS[12] PROGMEM = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+uint8_t monthDays(uint8_t month, uint8_t year)
+{
+  // month 0 to 11, year since 2000
+  return pgm_read_byte(MONTH_DAYS + month) + ((month == 1) && ((year & 3) == 0));
+}
+
+uint32_t stampSeconds(const char *time_)
+{
+  // "20YY-MM-DD hh:mm:ss" to s since 2000, 0 if it is not a time
+  static const uint8_t digits[14] = {0, 1, 2, 3, 5, 6, 8, 9, 11, 12, 14, 15, 17, 18};
+  for (uint8_t i = 0; i < 14; i++) if ((time_[digits[i]] < '0') || (time_[digits[i]] > '9')) return 0;
+  uint8_t year = (time_[2] - '0')*10 + (time_[3] - '0');
+  uint8_t month = (time_[5] - '0')*10 + (time_[6] - '0');
+  uint8_t day = (time_[8] - '0')*10 + (time_[9] - '0');
+  if ((time_[0] != '2') || (time_[1] != '0') || (month < 1) || (month > 12) || (day < 1) || (day > 31)) return 0;
+  uint16_t days = year*365 + (year + 3)/4 + day - 1;
+  for (uint8_t i = 0; i < month - 1; i++) days += monthDays(i, year);
+  return days*86400UL + daySeconds(time_);
+}
+
+void twoDigits(char *text, uint8_t number)
+{
+  text[0] = '0' + number/10;
+  text[1] = '0' + number%10;
+}
+
+void stampText(uint32_t seconds, char *time_)
+{
+  uint16_t days = seconds/86400;
+  seconds = seconds%86400;
+  uint8_t year = 0;
+  while (days >= 365 + ((year & 3) == 0)) days -= 365 + ((year++ & 3) == 0);
+  uint8_t month = 0;
+  while (days >= monthDays(month, year)) days -= monthDays(month++, year);
+  time_[0] = '2';
+  time_[1] = '0';
+  twoDigits(time_ + 2, year);
+  time_[4] = '-';
+  twoDigits(time_ + 5, month + 1);
+  time_[7] = '-';
+  twoDigits(time_ + 8, days + 1);
+  time_[10] = ' ';
+  twoDigits(time_ + 11, seconds/3600);
+  time_[13] = ':';
+  twoDigits(time_ + 14, (seconds/60)%60);
+  time_[16] = ':';
+  twoDigits(time_ + 17, seconds%60);
+  time_[19] = 0x00;
+}
+
+long fieldValue(const uint8_t *field, uint8_t bytes)
+{
+  // MSB first, sign extended
+  uint32_t value = 0;
+  for (uint8_t i = 0; i<bytes; i++) value = (value<<8) | field[i];
+  uint8_t shift = (4 - bytes)*8;
+  return ((long)(value<<shift))>>shift;
+}
+
+void setField(uint8_t *field, long value, uint8_t bytes)
+{
+  for (uint8_t i = 0; i<bytes; i++) field[bytes - 1 - i] = value>>(i*8);
+}
+
+void SCKServer::readRecord(uint16_t eeaddress, uint8_t *record)
+  {
+    base__.readEEPROM(eeaddress, record, FIFO_RECORD_SIZE);
+  }
+
+void SCKServer::writeRecord(uint16_t eeaddress, const uint8_t *record)
+  {
+    // Split at the 64 byte pages of the 24LC256
+    uint8_t done = 0;
+    while (done < FIFO_RECORD_SIZE)
+      {
+        uint8_t length = 64 - ((eeaddress + done) & 0x3F);
+        if (length > FIFO_RECORD_SIZE - done) length = FIFO_RECORD_SIZE - done;
+        base__.writeEEPROM(eeaddress + done, record + done, length);
+        done = done + length;
+      }
+  }
+
+void SCKServer::mergeRecords(uint8_t *older, const uint8_t *newer)
+  {
+    // The merged reading is left in older
+    uint16_t weightOlder = recordWeight(older);
+    uint16_t weightNewer = recordWeight(newer);
+    float share = (float)weightNewer/((uint32_t)weightOlder + weightNewer);
+    uint8_t offset = 0;
+    for (byte i = 0; i<SENSORS; i++)
+      {
+        long a = fieldValue(older + offset, SENSOR_BYTES[i]);
+        long b = fieldValue(newer + offset, SENSOR_BYTES[i]);
+        if (SENSOR_MERGE[i] == MERGE_MIN) a = min(a, b);
+        else if (SENSOR_MERGE[i] == MERGE_MAX) a = max(a, b);
+        else a = a + (long)((float)(b - a)*share);
+        setField(older + offset, a, SENSOR_BYTES[i]);
+        offset = offset + SENSOR_BYTES[i];
+      }
+    uint32_t timeOlder = stampSeconds((const char *)older + FIFO_TIME_OFFSET);
+    uint32_t timeNewer = stampSeconds((const char *)newer + FIFO_TIME_OFFSET);
+    if (timeOlder && timeNewer) stampText(timeOlder + (long)((float)(long)(timeNewer - timeOlder)*share), (char *)older + FIFO_TIME_OFFSET);
+    else memcpy(older + FIFO_TIME_OFFSET, newer + FIFO_TIME_OFFSET, TIMESTAMP_BYTES);
+    uint32_t weight = (uint32_t)weightOlder + weightNewer;
+    setField(older + FIFO_WEIGHT_OFFSET, (weight > 0xFFFF) ? 0xFFFF : weight, FIFO_WEIGHT_BYTES);
+  }
+
+uint16_t SCKServer::recordWeight(const uint8_t *record)
+  {
+    return fieldValue(record + FIFO_WEIGHT_OFFSET, FIFO_WEIGHT_BYTES);
+  }
+
+uint16_t SCKServer::compactPass(uint32_t limit, uint16_t pairs, boolean dry)
+  {
+    // Moves the FIFO to its start, merging up to pairs neighbours that weigh limit or less together.
+    // A dry pass only reads the weights and counts the pairs it would merge
+    uint16_t eeaddress = SCKConfig::readMeasure();
+    uint16_t end = SCKConfig::writeMeasure();
+    uint16_t target = DEFAULT_ADDR_MEASURES;
+    uint16_t merged = 0;
+    uint8_t skip = dry ? FIFO_WEIGHT_OFFSET : 0;
+    uint8_t record[FIFO_RECORD_SIZE];
+    uint8_t next[FIFO_RECORD_SIZE];
+    while (eeaddress < end)
+      {
+        base__.readEEPROM(eeaddress + skip, record + skip, FIFO_RECORD_SIZE - skip);
+        boolean merge = false;
+        if ((merged < pairs) && (eeaddress + FIFO_RECORD_SIZE < end))
+          {
+            base__.readEEPROM(eeaddress + FIFO_RECORD_SIZE + skip, next + skip, FIFO_RECORD_SIZE - skip);
+            merge = ((uint32_t)recordWeight(record) + recordWeight(next) <= limit);
+          }
+        if (merge)
+          {
+            if (!dry) mergeRecords(record, next);
+            merged++;
+          }
+        if (!dry && (merge || (target != eeaddress))) writeRecord(target, record);   // A merged record changed in place too
+        eeaddress = eeaddress + (merge ? 2*FIFO_RECORD_SIZE : FIFO_RECORD_SIZE);
+        target = target + FIFO_RECORD_SIZE;
+      }
+    if (!dry)
+      {
+        SCKConfig::setReadMeasure(DEFAULT_ADDR_MEASURES);
+        SCKConfig::setWriteMeasure(target);
+      }
+    return merged;
+  }
+
+void SCKServer::compactFIFO()
+  {
+    STAGE_BEGIN("compact");
+    uint16_t updates = (SCKConfig::writeMeasure() - SCKConfig::readMeasure())/FIFO_RECORD_SIZE;
+    uint16_t pairs = (updates > FIFO_COMPACT_LEVEL) ? updates/4 : 0;
+    // Single readings are paired first, then pairs, and so on: the limit doubles until enough neighbours fit in it.
+    // 0x20000 fits any two weights
+    uint32_t limit = 2;
+    while (pairs && (limit < 0x20000) && (compactPass(limit, pairs, true) < pairs)) limit = limit*2;
+    compactPass(limit, pairs, false);
+    TRACE(TRACE_COMPACT, (SCKConfig::writeMeasure() - DEFAULT_ADDR_MEASURES)/FIFO_RECORD_SIZE);
+    STAGE_END("compact");
+  }
+
+void SCKServer::addFIFO(long *value, char *time)
+  {
+    STAGE_BEGIN("addFIFO");
+    if (SCKConfig::writeMeasure() + FIFO_RECORD_SIZE > DEFAULT_ADDR_MEASURES + MAX_MEMORY*FIFO_RECORD_SIZE) compactFIFO();
+    uint8_t record[FIFO_RECORD_SIZE];
+    uint8_t offset = 0;
+    for (byte i = 0; i<SENSORS; i++)
+      {
+        setField(record + offset, value[i], SENSOR_BYTES[i]);
+        offset = offset + SENSOR_BYTES[i];
+      } 
+    memset(record + FIFO_TIME_OFFSET, 0, TIMESTAMP_BYTES);
+    strncpy((char *)record + FIFO_TIME_OFFSET, time, TIMESTAMP_BYTES - 1);
+    setField(record + FIFO_WEIGHT_OFFSET, 1, FIFO_WEIGHT_BYTES);
+    uint16_t eeaddress = SCKConfig::writeMeasure();
+    writeRecord(eeaddress, record);
+    eeaddress = eeaddress + FIFO_RECORD_SIZE;
+    SCKConfig::setWriteMeasure(eeaddress);
+    TRACE(TRACE_STORE, (eeaddress - SCKConfig::readMeasure())/FIFO_RECORD_SIZE);
+    STAGE_END("addFIFO");
   }
 
 void SCKServer::readFIFO()
   {   
-    int i = 0;
-    int eeaddress = base__.readData(EE_ADDR_NUMBER_READ_MEASURE, INTERNAL);
-    for (i = 0; i<9; i++)
+    STAGE_BEGIN("readFIFO");
+    uint16_t eeaddress = SCKConfig::readMeasure();
+    uint8_t record[FIFO_RECORD_SIZE];
+    readRecord(eeaddress, record);
+    long value[SENSORS];
+    uint8_t offset = 0;
+    for (byte i = 0; i<SENSORS; i++)
       {
-        Serial1.print(SERVER[i]);
-        Serial1.print(base__.readData(eeaddress + i*4, EXTERNAL)); //SENSORS
+        value[i] = fieldValue(record + offset, SENSOR_BYTES[i]);
+        offset = offset + SENSOR_BYTES[i];
       }  
-    Serial1.print(SERVER[i]);  
-    Serial1.print(base__.readData(eeaddress + i*4, 0, EXTERNAL)); //TIME
-    Serial1.print(SERVER[i+1]);
-    
-    #if debugServer
-      for (i = 0; i<9; i++)
-       {
-         Serial.print(SERVER[i]);
-         Serial.print(base__.readData(eeaddress + i*4, EXTERNAL)); //SENSORS
-       }
-      Serial.print(SERVER[i]);
-      Serial.print(base__.readData(eeaddress + i*4, 0, EXTERNAL)); //TIME
-      Serial.print(SERVER[i+1]);
-    #endif
+    char time[TIMESTAMP_BYTES + 1];
+    memcpy(time, record + FIFO_TIME_OFFSET, TIMESTAMP_BYTES);
+    time[TIMESTAMP_BYTES] = 0x00;
+    jsonRecord(value, time, false);
 
-    eeaddress = eeaddress + (SENSORS)*4 + TIME_BUFFER_SIZE;
-    if (eeaddress == base__.readData(EE_ADDR_NUMBER_WRITE_MEASURE, INTERNAL))
+    eeaddress = eeaddress + FIFO_RECORD_SIZE;
+    if (eeaddress == SCKConfig::writeMeasure())
       {
-        base__.writeData(EE_ADDR_NUMBER_WRITE_MEASURE, 0, INTERNAL);
-        base__.writeData(EE_ADDR_NUMBER_READ_MEASURE, 0, INTERNAL);
+        SCKConfig::setWriteMeasure(0);
+        SCKConfig::setReadMeasure(0);
       }
-    else base__.writeData(EE_ADDR_NUMBER_READ_MEASURE, eeaddress, INTERNAL);
+    else SCKConfig::setReadMeasure(eeaddress);
+    STAGE_END("readFIFO");
   }  
-  
-#define numbers_retry 5
+
 
 boolean SCKServer::update(long *value, char *time_)
 {
-  value[8] = base__.scan();  //Wifi Nets
+  value[SENSOR_NETS] = base__.nets();  //Wifi Nets, scanned again by connect() when the cache is old
+  if (base__.checkRTC() && base__.RTCisValid(time_)) return true;  //The answer to the post keeps it on time
   byte retry = 0;
   if (time(time_)) //Update server time
   {  
@@ -233,36 +632,62 @@ boolean SCKServer::update(long *value, char *time_)
   return true; 
 }
 
+void SCKServer::headerChanged()
+{
+  // New apikey: the header fields are read again on the next post
+  headerCached = false;
+}
+
 boolean SCKServer::connect()
 {
+  STAGE_BEGIN("open");
   int retry = 0;
   while (true){
-    if (base__.open(WEB[0], 80)) break;
+    if (base__.open(WEB_HOST, 80)) break;
     else 
     {
       retry++;
-      if (retry >= numbers_retry) return false;
+      if (retry >= numbers_retry)
+        {
+          STAGE_END("open");
+          return false;
+        }
     }
   }    
-  for (byte i = 1; i<5; i++) Serial1.print(WEB[i]);
-  Serial1.println(base__.readData(EE_ADDR_MAC, 0, INTERNAL)); //MAC ADDRESS
-  Serial1.print(WEB[5]);
-  Serial1.println(base__.readData(EE_ADDR_APIKEY, 0, INTERNAL)); //Apikey
-  Serial1.print(WEB[6]);
-  Serial1.println(FirmWare); //Firmware version
-  Serial1.print(WEB[7]);
+  if (!headerCached)
+  {
+    base__.readData(EE_ADDR_MAC, 0, headerMac, sizeof(headerMac), INTERNAL);
+    base__.readData(EE_ADDR_APIKEY, 0, headerApikey, sizeof(headerApikey), INTERNAL);
+    headerCached = true;
+  }
+  // Flash template and the cached fields, written in JSON_CHUNK blocks
+  jsonPut(F(WEB_HEADER));
+  jsonPut(headerMac);
+  jsonPut(F(WEB_APIKEY));
+  jsonPut(headerApikey);
+  jsonPut(F(WEB_VERSION));
+  jsonFlush();
+  STAGE_END("open");
   return true; 
 }
 
 
 void SCKServer::send(boolean sleep, boolean *wait_moment, long *value, char *time, boolean instant) {  
+  STAGE_BEGIN("send");
+  uint32_t start = millis();
+  base__.clearRetries();
   *wait_moment = true;
-  if (base__.checkRTC()) base__.RTCtime(time);
+  byte hour = BACKOFF_NO_HOUR;
+  if (base__.checkRTC())
+  {
+    base__.RTCtime(time);
+    hour = (time[11] - '0')*10 + (time[12] - '0');
+  }
   char tmpTime[19];
   strncpy(tmpTime, time, 20);
-  uint16_t updates = (base__.readData(EE_ADDR_NUMBER_WRITE_MEASURE, INTERNAL)-base__.readData(EE_ADDR_NUMBER_READ_MEASURE, INTERNAL))/((SENSORS)*4 + TIME_BUFFER_SIZE);
-  uint16_t NumUpdates = base__.readData(EE_ADDR_NUMBER_UPDATES, INTERNAL); // Number of readings before batch update
-  if (updates>=(NumUpdates - 1) || instant)
+  uint16_t updates = (SCKConfig::writeMeasure() - SCKConfig::readMeasure())/FIFO_RECORD_SIZE;
+  uint16_t NumUpdates = SCKConfig::numberUpdates(); // Number of readings before batch update
+  if ((updates>=(NumUpdates - 1) && SCKBackoff::due()) || instant)
     { 
       if (sleep)
         {
@@ -271,7 +696,13 @@ void SCKServer::send(boolean sleep, boolean *wait_moment, long *value, char *tim
           #endif
           digitalWrite(AWAKE, HIGH);
         }
-      if (base__.connect())  //Wifi connect
+      STAGE_BEGIN("join");
+      uint32_t joinStart = millis();
+      boolean joined = base__.connect();
+      connectTime = millis() - joinStart;
+      STAGE_END("join");
+      boolean posted = false;
+      if (joined)  //Wifi connect
         {
           #if debugEnabled
               if (!ambient__.debug_state()) Serial.println(F("SCK Connected to Wi-Fi!!"));
@@ -285,23 +716,38 @@ void SCKServer::send(boolean sleep, boolean *wait_moment, long *value, char *tim
                   Serial.println(updates + 1);
                 }
             #endif
+            pendingUpdates = updates;
             int num_post = updates;
-            int cycles = cycles = updates/POST_MAX;;
+            int backfill = 0;
+            posted = true;
             if (updates > POST_MAX) 
               {
-                for (int i=0; i<cycles; i++)
-                {
-                  connect();
-                  json_update(POST_MAX, value, tmpTime, false);
-                }
-                num_post = updates - cycles*POST_MAX;
+                #if liveFirst
+                  // Backlog: the live reading goes out on its own, then one slice of the stored ones (oldest first)
+                  num_post = 0;
+                  backfill = BACKFILL_SLICE;
+                #else
+                  // A batch is only read from the FIFO once the connection is open
+                  int cycles = updates/POST_MAX;
+                  for (int i=0; (i<cycles) && posted; i++)
+                  {
+                    posted = connect();
+                    if (posted) json_update(POST_MAX, value, tmpTime, false);
+                  }
+                  num_post = updates - cycles*POST_MAX;
+                #endif
               }
-            connect();
-            json_update(num_post, value, tmpTime, true);
-            #if debugEnabled
-                  if (!ambient__.debug_state()) Serial.println(F("Posted to Server!")); 
-            #endif
-            
+            if (posted && connect())
+            {
+              json_update(num_post, value, tmpTime, true);
+              syncTime();
+              if (backfill && connect()) json_update(backfill, value, tmpTime, false);
+              TRACE(TRACE_POST, updates + 1 - (SCKConfig::writeMeasure() - SCKConfig::readMeasure())/FIFO_RECORD_SIZE);
+              #if debugEnabled
+                    if (!ambient__.debug_state()) Serial.println(F("Posted to Server!")); 
+              #endif
+            }
+            else posted = false;
           }
           else 
           {
@@ -317,8 +763,10 @@ void SCKServer::send(boolean sleep, boolean *wait_moment, long *value, char *tim
           #endif
           base__.close();
         }
-      else //No connect
+      if (posted) SCKBackoff::success(hour);
+      else //No connect, the readings wait in the memory until the next attempt
         {
+          SCKBackoff::failure(hour);
           if (base__.checkRTC()) base__.RTCtime(time);
           else time = "#";
           addFIFO(value, time);
@@ -353,5 +801,7 @@ void SCKServer::send(boolean sleep, boolean *wait_moment, long *value, char *tim
         #endif
     }
   *wait_moment = false;
+  cycleTime = millis() - start;
+  STAGE_END("send");
 }
 
@@ -17,10 +17,22 @@ public:
    void send(boolean sleep, boolean *wait_moment, long *value, char *time, boolean instant);
    boolean update(long *value, char *time_);
    boolean connect();
+   void headerChanged();
    void addFIFO(long *value, char *time);
    void readFIFO();
    boolean RTCupdate(char *time);
+   boolean responseTime(char *time);
+   boolean syncTime();
+   void benchmark(long *value, char *time);
 private:
+   void jsonRecord(long *value, char *time, boolean live);
+   void readRecord(uint16_t eeaddress, uint8_t *record);
+   void writeRecord(uint16_t eeaddress, const uint8_t *record);
+   void mergeRecords(uint8_t *older, const uint8_t *newer);
+   uint16_t recordWeight(const uint8_t *record);
+   uint16_t compactPass(uint32_t limit, uint16_t pairs, boolean dry);
+   void compactFIFO();
+   void telemetry();
 
 };
 #endif
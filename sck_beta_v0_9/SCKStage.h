@@ -0,0 +1,25 @@
+/*
+
+  SCKStage.h
+  Stage markers for the host benchmark (utilities/SCK_simulator).
+
+  - STAGE_BEGIN / STAGE_END bracket one step of the measurement and posting
+    cycle. Stages can be nested, every stage counts its own time and bus bytes.
+  - On the kit they compile to nothing.
+
+*/
+
+#ifndef __SCKSTAGE_H__
+#define __SCKSTAGE_H__
+
+#ifdef SCK_HOST_SIM
+  void simStageBegin(const char *name);
+  void simStageEnd(const char *name);
+  #define STAGE_BEGIN(name) simStageBegin(name)
+  #define STAGE_END(name)   simStageEnd(name)
+#else
+  #define STAGE_BEGIN(name)
+  #define STAGE_END(name)
+#endif
+
+#endif
@@ -0,0 +1,127 @@
+/*
+
+  SCKTrace.cpp
+  Event log of the slow steps of the measurement and posting cycle.
+
+*/
+
+#include "Constants.h"
+#include "SCKTrace.h"
+#include "SCKBase.h"
+#include <stddef.h>
+
+SCKBase base___;
+
+SCKTraceEvent traceEvents[TRACE_EVENTS];
+byte     traceHead  = 0;   // Oldest event in the RAM ring
+byte     traceCount = 0;
+byte     traceSeq   = 0;
+uint16_t traceLost  = 0;
+byte     traceSlot  = 0;   // Next EEPROM slot to write
+
+boolean SCKTrace::read(uint8_t slot, SCKTraceEvent *event) {
+  uint16_t eeaddress = TRACE_EEPROM_ADDR + slot*sizeof(SCKTraceEvent);
+  uint8_t *data = (uint8_t *)event;
+  for (uint8_t i = 0; i < sizeof(SCKTraceEvent); i++) data[i] = base___.readEEPROM(eeaddress + i);
+  return (event->id != 0x00) && (event->id != 0xFF);  // Erased or never written
+}
+
+void SCKTrace::begin() {
+  traceHead = 0;
+  traceCount = 0;
+  traceLost = 0;
+  traceSlot = 0;
+  traceSeq = 0;
+  // Carry on after the newest event in the EEPROM, the one the sequence breaks after
+  SCKTraceEvent event;
+  SCKTraceEvent next;
+  boolean valid = read(0, &event);
+  for (uint8_t slot = 0; slot < TRACE_EEPROM_EVENTS; slot++)
+  {
+    uint8_t following = (slot + 1) % TRACE_EEPROM_EVENTS;
+    boolean nextValid = read(following, &next);
+    if (valid && (!nextValid || (next.seq != (uint8_t)(event.seq + 1))))
+    {
+      traceSlot = following;
+      traceSeq = event.seq + 1;
+      break;
+    }
+    event = next;
+    valid = nextValid;
+  }
+  add(TRACE_BOOT, base___.resetCause());
+}
+
+void SCKTrace::add(uint8_t id, uint16_t arg) {
+  uint8_t oldSREG = SREG;
+  cli();
+  if (traceCount == TRACE_EVENTS)   // Full, drop the oldest
+  {
+    traceHead = (traceHead + 1) % TRACE_EVENTS;
+    traceCount--;
+    traceLost++;
+  }
+  SCKTraceEvent *event = &traceEvents[(traceHead + traceCount) % TRACE_EVENTS];
+  event->time = millis();
+  event->arg = arg;
+  event->id = id;
+  traceCount++;
+  SREG = oldSREG;
+}
+
+boolean SCKTrace::pop(SCKTraceEvent *event) {
+  uint8_t oldSREG = SREG;
+  cli();
+  boolean ok = (traceCount > 0);
+  if (ok)
+  {
+    *event = traceEvents[traceHead];
+    traceHead = (traceHead + 1) % TRACE_EVENTS;
+    traceCount--;
+  }
+  SREG = oldSREG;
+  return ok;
+}
+
+void SCKTrace::flush() {
+  if (traceLost > 0)
+  {
+    uint16_t lost = traceLost;
+    traceLost = 0;
+    add(TRACE_LOST, lost);
+  }
+  // One page write per event, events never cross a 64 byte page.
+  // The sequence number is given here, so the EEPROM ring has no gaps where the RAM ring overflowed
+  SCKTraceEvent event;
+  while (pop(&event))
+  {
+    event.seq = traceSeq++;
+    base___.writeEEPROM(TRACE_EEPROM_ADDR + traceSlot*sizeof(SCKTraceEvent), (uint8_t *)&event, sizeof(SCKTraceEvent));
+    traceSlot = (traceSlot + 1) % TRACE_EEPROM_EVENTS;
+  }
+}
+
+void SCKTrace::print() {
+  flush();
+  SCKTraceEvent event;
+  for (uint8_t i = 0; i < TRACE_EEPROM_EVENTS; i++)
+  {
+    if (!read((traceSlot + i) % TRACE_EEPROM_EVENTS, &event)) continue;
+    Serial.print(F("TRACE,"));
+    Serial.print(event.seq);
+    Serial.print(F(","));
+    Serial.print(event.time);
+    Serial.print(F(","));
+    Serial.print(event.id);
+    Serial.print(F(","));
+    Serial.println(event.arg);
+  }
+}
+
+void SCKTrace::clear() {
+  for (uint8_t slot = 0; slot < TRACE_EEPROM_EVENTS; slot++)
+  {
+    base___.writeEEPROM(TRACE_EEPROM_ADDR + slot*sizeof(SCKTraceEvent) + offsetof(SCKTraceEvent, id), 0xFF);
+  }
+  traceSlot = 0;
+}
@@ -0,0 +1,64 @@
+/*
+
+  SCKTrace.h
+  Event log of the slow steps of the measurement and posting cycle.
+
+  - Every event is 8 bytes: millis(), event id, a 16 bit argument and a
+    sequence number.
+  - Events are kept in a RAM ring and flushed to the end of the external
+    EEPROM (after the readings FIFO) once per publishing cycle.
+  - "get trace" prints the log on the USB console, utilities/SCK_trace
+    turns it into a timeline.
+
+*/
+
+#ifndef __SCKTRACE_H__
+#define __SCKTRACE_H__
+
+#include <Arduino.h>
+
+// Event ids, keep utilities/SCK_trace/sck_trace in sync
+#define TRACE_BOOT          1   // arg: reset cause, MCUSR bits (SCKBase::resetCause())
+#define TRACE_CMD_RETRY     2   // arg: attempts until the WiFly entered command mode
+#define TRACE_CMD_FAIL      3   // arg: attempts
+#define TRACE_JOIN          4   // arg: ms until "Associated!"
+#define TRACE_JOIN_FAIL     5   // arg: ms waited
+#define TRACE_OPEN          6   // arg: ms until *OPEN*
+#define TRACE_OPEN_FAIL     7   // arg: ms waited
+#define TRACE_TIME          8   // arg: attempts until the server time was read
+#define TRACE_TIME_FAIL     9   // arg: attempts
+#define TRACE_RTC_FAIL      10  // RTC not answering on the I2C bus
+#define TRACE_DHT_RETRY     11  // arg: failed DHT22 reads in one climate update (5: no reading)
+#define TRACE_POST          12  // arg: readings posted
+#define TRACE_STORE         13  // arg: readings waiting in the FIFO
+#define TRACE_LOST          14  // arg: events dropped because the RAM ring was full
+#define TRACE_I2C_TIMEOUT   15  // arg: I2C address of the transaction, the bus was recovered
+#define TRACE_RTC_ADJUST    16  // arg: s the RTC was off from the Date of the server (0xFFFF: another day, or 65535 s and more)
+#define TRACE_BACKOFF       17  // arg: s until the next upload attempt
+#define TRACE_COMPACT       18  // arg: readings waiting in the FIFO after it was compacted
+
+#if traceEnabled
+  #define TRACE(id, arg) SCKTrace::add(id, arg)
+#else
+  #define TRACE(id, arg)
+#endif
+
+struct SCKTraceEvent {
+  uint32_t time;   // millis()
+  uint16_t arg;
+  uint8_t  id;
+  uint8_t  seq;    // Orders the events in the EEPROM ring, given when written there
+};
+
+class SCKTrace {
+public:
+  static void begin();
+  static void add(uint8_t id, uint16_t arg);
+  static void flush();
+  static void print();
+  static void clear();
+private:
+  static boolean pop(SCKTraceEvent *event);
+  static boolean read(uint8_t slot, SCKTraceEvent *event);
+};
+#endif
@@ -0,0 +1,203 @@
+/*
+
+  SCKTwi.cpp
+  Interrupt driven I2C (TWI) master with a queue of transactions.
+
+*/
+
+#include "Constants.h"
+#include "SCKTwi.h"
+#include "SCKTrace.h"
+
+#define debugTwi false
+
+// TWSR status codes (master)
+#define TW_START         0x08
+#define TW_REP_START     0x10
+#define TW_MT_SLA_ACK    0x18
+#define TW_MT_SLA_NACK   0x20
+#define TW_MT_DATA_ACK   0x28
+#define TW_MT_DATA_NACK  0x30
+#define TW_ARB_LOST      0x38
+#define TW_MR_SLA_ACK    0x40
+#define TW_MR_SLA_NACK   0x48
+#define TW_MR_DATA_ACK   0x50
+#define TW_MR_DATA_NACK  0x58
+
+#define TWCR_NEXT  (_BV(TWEN) | _BV(TWIE) | _BV(TWINT))
+
+SCKTwiTransaction *twiQueue[TWI_QUEUE];
+volatile byte twiHead  = 0;   // Transaction on the bus
+volatile byte twiCount = 0;
+volatile byte twiSent  = 0;   // Bytes of tx already written
+uint16_t twiTimeouts   = 0;
+
+void SCKTwi::begin(uint32_t frequency) {
+  twiHead = 0;
+  twiCount = 0;
+  TWSR = 0;                                   // Prescaler 1
+  TWBR = ((F_CPU / frequency) - 16) / 2;
+  TWCR = _BV(TWEN);
+}
+
+boolean SCKTwi::submit(SCKTwiTransaction *transaction) {
+  // Queues the transaction, false if the queue is full
+  uint8_t oldSREG = SREG;
+  cli();
+  if (twiCount >= TWI_QUEUE) {
+    SREG = oldSREG;
+    return false;
+  }
+  transaction->status = TWI_PENDING;
+  transaction->received = 0;
+  twiQueue[(twiHead + twiCount) % TWI_QUEUE] = transaction;
+  twiCount++;
+  if (twiCount == 1) start();
+  SREG = oldSREG;
+  return true;
+}
+
+uint8_t SCKTwi::transfer(uint8_t address, const uint8_t *tx, uint8_t txLength, uint8_t *rx, uint8_t rxLength, uint16_t timeout) {
+  SCKTwiTransaction transaction = {address, tx, txLength, rx, rxLength, timeout, 0, TWI_PENDING, 0, 0};
+  while (!submit(&transaction)) service();    // Queue full, wait for a slot
+  while (transaction.status == TWI_PENDING) service();
+  return transaction.status;
+}
+
+uint8_t SCKTwi::write(uint8_t address, const uint8_t *tx, uint8_t txLength) {
+  return transfer(address, tx, txLength, 0, 0);
+}
+
+uint8_t SCKTwi::read(uint8_t address, uint8_t reg, uint8_t *rx, uint8_t rxLength, uint16_t timeout) {
+  // Register read: write the register address, then read after a repeated start
+  uint8_t status = transfer(address, &reg, 1, rx, rxLength, timeout);
+  if (status != TWI_OK) memset(rx, 0, rxLength);
+  return status;
+}
+
+boolean SCKTwi::busy() {
+  return twiCount > 0;
+}
+
+void SCKTwi::service() {
+  // A transaction past its timeout: the bus is stuck or the slave gone
+  uint8_t oldSREG = SREG;
+  cli();
+  if (twiCount && ((millis() - twiQueue[twiHead]->started) > twiQueue[twiHead]->timeout)) {
+    uint8_t address = twiQueue[twiHead]->address;
+    TWCR = 0;
+    SREG = oldSREG;
+    recover();
+    twiTimeouts++;
+    TRACE(TRACE_I2C_TIMEOUT, address);
+    #if debugTwi
+      Serial.print(F("I2C timeout: 0x"));
+      Serial.println(address, HEX);
+    #endif
+    cli();
+    finish(TWI_TIMEOUT);
+  }
+  SREG = oldSREG;
+}
+
+void SCKTwi::recover() {
+  // A slave stopped in the middle of a byte holds SDA low: clock SCL until it lets go and
+  // send a STOP. The pins are open drain by hand: low as outputs, released as inputs.
+  TWCR = 0;
+  digitalWrite(TWI_SDA, LOW);
+  digitalWrite(TWI_SCL, LOW);
+  pinMode(TWI_SDA, INPUT);
+  pinMode(TWI_SCL, INPUT);
+  for (byte i = 0; (i < 9) && !digitalRead(TWI_SDA); i++) {
+    pinMode(TWI_SCL, OUTPUT);
+    delayMicroseconds(5);
+    pinMode(TWI_SCL, INPUT);
+    delayMicroseconds(5);
+  }
+  pinMode(TWI_SDA, OUTPUT);                   // STOP: SDA rises while SCL is high
+  delayMicroseconds(5);
+  pinMode(TWI_SDA, INPUT);
+  delayMicroseconds(5);
+  TWCR = _BV(TWEN);
+}
+
+uint16_t SCKTwi::timeouts() {
+  return twiTimeouts;
+}
+
+void SCKTwi::start() {
+  // Called with interrupts off
+  twiQueue[twiHead]->started = millis();
+  twiSent = 0;
+  TWCR = TWCR_NEXT | _BV(TWSTA);
+}
+
+void SCKTwi::finish(uint8_t status) {
+  // Called with interrupts off, the STOP (if any) was already sent
+  SCKTwiTransaction *transaction = twiQueue[twiHead];
+  twiHead = (twiHead + 1) % TWI_QUEUE;
+  twiCount--;
+  transaction->status = status;
+  if (transaction->done) transaction->done(transaction);
+  if (twiCount) {
+    for (byte i = 0; (i < 100) && (TWCR & _BV(TWSTO)); i++) delayMicroseconds(1);
+    start();
+  }
+}
+
+ISR(TWI_vect)
+{
+  SCKTwiTransaction *transaction = twiQueue[twiHead];
+  switch (TWSR & 0xF8) {
+    case TW_START:
+    case TW_REP_START:
+      // The write part first, if any
+      if ((twiSent < transaction->txLength) || !transaction->rxLength) TWDR = transaction->address << 1;
+      else TWDR = (transaction->address << 1) | 0x01;
+      TWCR = TWCR_NEXT;
+      break;
+    case TW_MT_SLA_ACK:
+    case TW_MT_DATA_ACK:
+      if (twiSent < transaction->txLength) {
+        TWDR = transaction->tx[twiSent++];
+        TWCR = TWCR_NEXT;
+      }
+      else if (transaction->rxLength) TWCR = TWCR_NEXT | _BV(TWSTA);
+      else {
+        TWCR = _BV(TWEN) | _BV(TWINT) | _BV(TWSTO);
+        SCKTwi::finish(TWI_OK);
+      }
+      break;
+    case TW_MR_SLA_ACK:
+      // ACK every byte but the last one
+      TWCR = TWCR_NEXT | ((transaction->rxLength > 1) ? _BV(TWEA) : 0);
+      break;
+    case TW_MR_DATA_ACK:
+      transaction->rx[transaction->received++] = TWDR;
+      TWCR = TWCR_NEXT | ((transaction->received + 1 < transaction->rxLength) ? _BV(TWEA) : 0);
+      break;
+    case TW_MR_DATA_NACK:
+      transaction->rx[transaction->received++] = TWDR;
+      TWCR = _BV(TWEN) | _BV(TWINT) | _BV(TWSTO);
+      SCKTwi::finish(TWI_OK);
+      break;
+    case TW_MT_SLA_NACK:
+    case TW_MR_SLA_NACK:
+      TWCR = _BV(TWEN) | _BV(TWINT) | _BV(TWSTO);
+      SCKTwi::finish(TWI_NACK_ADDR);
+      break;
+    case TW_MT_DATA_NACK:
+      TWCR = _BV(TWEN) | _BV(TWINT) | _BV(TWSTO);
+      SCKTwi::finish(TWI_NACK_DATA);
+      break;
+    case TW_ARB_LOST:
+      TWCR = _BV(TWEN) | _BV(TWINT);
+      SCKTwi::finish(TWI_ERROR);
+      break;
+    default:
+      // Bus error: release the lines
+      TWCR = _BV(TWEN) | _BV(TWINT) | _BV(TWSTO);
+      SCKTwi::finish(TWI_ERROR);
+      break;
+  }
+}
@@ -0,0 +1,62 @@
+/*
+
+  SCKTwi.h
+  Interrupt driven I2C (TWI) master with a queue of transactions.
+
+  - A transaction writes, reads, or writes and then reads after a repeated
+    start (register reads). Every one has its own timeout.
+  - Transactions wait in a queue (TWI_QUEUE) and run one after the other
+    from the TWI interrupt. The result is left in the transaction and
+    passed to its completion callback, if any (called from the ISR).
+  - A transaction that does not finish in time resets the TWI and recovers
+    the bus: SCL is clocked until the slave releases SDA, then a STOP is
+    sent. service() checks the timeouts, call it from the main loop.
+  - transfer() runs one transaction and waits for it.
+
+*/
+
+#ifndef __SCKTWI_H__
+#define __SCKTWI_H__
+
+#include <Arduino.h>
+
+// Transaction status, the same codes as Wire.endTransmission()
+#define TWI_OK          0
+#define TWI_NACK_ADDR   2     // Nobody (or a busy EEPROM) at that address
+#define TWI_NACK_DATA   3
+#define TWI_ERROR       4     // Bus error or lost arbitration
+#define TWI_TIMEOUT     5
+#define TWI_PENDING     0xFF  // Queued or running
+
+struct SCKTwiTransaction;
+typedef void (*SCKTwiCallback)(SCKTwiTransaction *transaction);
+
+struct SCKTwiTransaction {
+  uint8_t address;
+  const uint8_t *tx;
+  uint8_t txLength;
+  uint8_t *rx;
+  uint8_t rxLength;
+  uint16_t timeout;          // ms, from the start on the bus
+  SCKTwiCallback done;       // May be 0
+  volatile uint8_t status;
+  volatile uint8_t received; // Bytes read
+  uint32_t started;          // millis() at the start on the bus
+};
+
+class SCKTwi {
+public:
+  static void begin(uint32_t frequency);
+  static boolean submit(SCKTwiTransaction *transaction);
+  static uint8_t transfer(uint8_t address, const uint8_t *tx, uint8_t txLength, uint8_t *rx, uint8_t rxLength, uint16_t timeout = TWI_TIMEOUT_MS);
+  static uint8_t write(uint8_t address, const uint8_t *tx, uint8_t txLength);
+  static uint8_t read(uint8_t address, uint8_t reg, uint8_t *rx, uint8_t rxLength, uint16_t timeout = TWI_TIMEOUT_MS);
+  static boolean busy();
+  static void service();
+  static void recover();
+  static uint16_t timeouts();
+  // Used by the TWI interrupt
+  static void start();
+  static void finish(uint8_t status);
+};
+#endif
@@ -18,6 +18,11 @@
     SCKAmbient.h    - Supports the sensor reading and calibration functions.
     SCKBase.h       - Supports the data management functions (WiFi,  RTClock and EEPROM storage)
     SCKServer.h     - Supports data publishing to the SmartCitizen Platform over WiFi.
+    SCKScheduler.h  - Runs every sensor and network task on its own period.
+    SCKTrace.h      - Logs the slow network and sensor steps for field diagnostics.
+    SCKConfig.h     - Keeps the kit configuration in RAM, stored with a CRC in two EEPROM slots.
+    SCKBackoff.h    - Spaces out the upload attempts after failures, learns the hours they usually work.
+    SCKTwi.h        - Interrupt driven I2C bus with queued transactions and bus recovery.
 
     Constants.h             - Defines pins configuration and other static parameters.
     AccumulatorFilter.h     - Used for battery temperature decoupling in  Smart Citizen Kit v.1.0 
@@ -27,7 +32,6 @@
     
 */
 
-#include <Wire.h>
 #include <EEPROM.h>
 #include "SCKAmbient.h"
 
@@ -41,6 +45,7 @@ void setup() {
 
 void loop() {  
   ambient.execute(false);
+  ambient.powerSave();
 }
 
 
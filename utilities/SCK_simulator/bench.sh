@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Runs every scenario in scripts/ (goteo*.sck on the Goteo build) and compares
+# the report with bench/baseline.
+#
+#   ./bench.sh            Compare, exits 1 if something got worse
+#   ./bench.sh --update   Store the current results as the new baseline
+#
+# Worse means: more than THRESHOLD percent slower (wall and busy times), more
+# bus bytes, fewer readings at the server or a longer time without any.
+
+THRESHOLD=${THRESHOLD:-5}
+
+cd "$(dirname "$0")" || exit 1
+make -s sck_sim && make -s goteo || exit 1
+mkdir -p bench/results bench/baseline
+
+status=0
+for script in scripts/*.sck; do
+  name=$(basename "$script" .sck)
+  case $name in
+    goteo*) sim=./sck_sim_goteo ;;   # Scripts for the 16 MHz board
+    *)      sim=./sck_sim ;;
+  esac
+  $sim "$script" > "bench/results/$name.txt" || { echo "$name: simulator failed"; status=1; continue; }
+  if [ "$1" = "--update" ]; then
+    cp "bench/results/$name.txt" "bench/baseline/$name.txt"
+    echo "$name: baseline updated"
+    continue
+  fi
+  if [ ! -f "bench/baseline/$name.txt" ]; then
+    echo "$name: no baseline, run ./bench.sh --update"
+    continue
+  fi
+  echo "== $name"
+  awk -F= -v threshold="$THRESHOLD" '
+    FNR == NR { base[$1] = $2; next }
+    {
+      key = $1; new = $2
+      if (!(key in base)) { printf "  %-40s %12s   (new)\n", key, new; next }
+      old = base[key]
+      if (old == new) next
+      change = (old != 0) ? (new - old)*100/old : 100
+      worse = 0
+      if (key ~ /(_ms|busy_s|_bytes|i2c_transactions|_dropped|_fails)$/ && change > threshold) worse = 1
+      if (key ~ /^server_(posts|records)$/ && new < old) worse = 1
+      if (key == "server_gap_max_s" && new > old) worse = 1
+      if (key == "fifo_weight_lost" && new > old) worse = 1
+      printf "  %-40s %12s -> %-12s %+7.1f%%%s\n", key, old, new, change, worse ? "  WORSE" : ""
+      if (worse) regressions++
+    }
+    END { exit regressions ? 1 : 0 }
+  ' "bench/baseline/$name.txt" "bench/results/$name.txt" || status=1
+done
+exit $status
@@ -0,0 +1,221 @@
+/*
+
+  Arduino.h
+  Host replacement of the Arduino core for the SCK simulator.
+  Only what the firmware uses, with the ATmega32U4 registers as plain
+  variables (or hooks where the simulator needs to react to a write).
+
+*/
+
+#ifndef __SIM_ARDUINO_H__
+#define __SIM_ARDUINO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+
+#ifndef F_CPU
+#define F_CPU 8000000L
+#endif
+
+typedef bool    boolean;
+typedef uint8_t byte;
+
+#define HIGH          1
+#define LOW           0
+#define INPUT         0
+#define OUTPUT        1
+#define INPUT_PULLUP  2
+
+#define EXTERNAL      0
+#define DEFAULT       1
+#define INTERNAL      3
+
+// Leonardo / Lilypad USB pin numbers
+#define A0 18
+#define A1 19
+#define A2 20
+#define A3 21
+#define A4 22
+#define A5 23
+#define A7 25
+#define A8 26
+#define SCK  15
+#define MOSI 16
+#define MISO 14
+
+#define B00001100 12
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define pgm_read_ptr(addr) (*(void * const *)(addr))
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(PSTR(string_literal)))
+
+#define _BV(bit) (1 << (bit))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#endif
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+#define sq(x) ((x)*(x))
+#define PI 3.1415926535897932384626433832795
+
+inline unsigned int word(uint8_t h, uint8_t l) { return (h << 8) | l; }
+inline long map(long x, long in_min, long in_max, long out_min, long out_max) {
+  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogReference(uint8_t mode);
+void analogWrite(uint8_t pin, int val);
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+void sei();
+void cli();
+
+#define ISR(vector) extern "C" void vector(void)
+
+/* Registers */
+
+// SREG and the TWI registers react to writes, the rest are plain memory
+struct SimRegister {
+  volatile uint8_t value;
+  void (*onWrite)(uint8_t);
+  SimRegister(void (*hook)(uint8_t) = 0, uint8_t initial = 0) : value(initial), onWrite(hook) {}
+  operator uint8_t() const { return value; }
+  SimRegister& operator=(uint8_t v) { value = v; if (onWrite) onWrite(v); return *this; }
+  SimRegister& operator|=(uint8_t v) { return *this = (uint8_t)(value | v); }
+  SimRegister& operator&=(uint8_t v) { return *this = (uint8_t)(value & v); }
+};
+
+extern SimRegister SREG;
+extern volatile uint8_t MCUSR, WDTCSR;
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+extern volatile uint16_t ICR1;
+extern volatile uint8_t EICRA, EIMSK, EIFR;
+extern volatile uint8_t PCICR, PCIFR, PCMSK0;
+extern volatile uint8_t ADCSRA, USBSTA;
+extern volatile uint8_t PINB, DDRB, PORTB, PIND, DDRD, PORTD;
+extern SimRegister TWCR;
+extern volatile uint8_t TWBR, TWSR, TWDR, TWAR;
+
+// Bits
+#define CS10   0
+#define CS11   1
+#define CS12   2
+#define WGM13  4
+#define TOIE1  0
+#define ISC20  4
+#define ISC21  5
+#define INT2   2
+#define INTF2  2
+#define PCIE0  0
+#define PCIF0  0
+#define PCINT6 6
+#define PB6    6
+#define ADEN   7
+#define VBUS   0
+#define WDIF   7
+#define WDIE   6
+#define WDCE   4
+#define WDE    3
+#define WDRF   3
+#define PORF   0
+#define EXTRF  1
+#define BORF   2
+#define TWINT  7
+#define TWEA   6
+#define TWSTA  5
+#define TWSTO  4
+#define TWWC   3
+#define TWEN   2
+#define TWIE   0
+#define TWPS0  0
+#define TWPS1  1
+
+/* Print / Stream */
+
+#define DEC 10
+#define HEX 16
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+  size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+
+  size_t print(const __FlashStringHelper *s) { return write((const char *)s); }
+  size_t print(const char s[]) { return write(s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(int n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(long long n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned long long n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(double n, int digits = 2);
+
+  size_t println() { return write("\r\n"); }
+  template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+  template <typename T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); }
+private:
+  size_t printNumber(unsigned long n, uint8_t base);
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() {}
+};
+
+class HardwareSerial : public Stream {
+public:
+  HardwareSerial(int port) : port(port) {}
+  void begin(unsigned long baud);
+  void end() {}
+  int available();
+  int read();
+  int peek();
+  void flush();
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buffer, size_t size);
+  using Print::write;
+  operator bool() { return true; }
+  int port;
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+#endif
@@ -0,0 +1,25 @@
+/*
+
+  EEPROM.h
+  Host replacement of the Arduino EEPROM library (1 KB, ATmega32U4).
+
+*/
+
+#ifndef __SIM_EEPROM_H__
+#define __SIM_EEPROM_H__
+
+#include <Arduino.h>
+
+#define SIM_EEPROM_SIZE 1024
+
+class EEPROMClass {
+public:
+  uint8_t read(int address);
+  void write(int address, uint8_t value);
+  void update(int address, uint8_t value) { if (read(address) != value) write(address, value); }
+  uint16_t length() { return SIM_EEPROM_SIZE; }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
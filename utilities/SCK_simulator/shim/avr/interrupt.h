@@ -0,0 +1,4 @@
+#ifndef __SIM_AVR_INTERRUPT_H__
+#define __SIM_AVR_INTERRUPT_H__
+#include <Arduino.h>
+#endif
@@ -0,0 +1,4 @@
+#ifndef __SIM_AVR_PGMSPACE_H__
+#define __SIM_AVR_PGMSPACE_H__
+#include <Arduino.h>
+#endif
@@ -0,0 +1,691 @@
+/*
+
+  devices.cpp
+  TWI (I2C) registers on the simulated bus and the device models of the
+  Kickstarter board (SCK 1.1):
+
+    - DS1339 RTC          0x68
+    - 24LC256 EEPROM      0x50
+    - MCP4xxx pots        0x2D, 0x2E, 0x2F
+    - SHT21               0x40
+    - BH1730FVC           0x29
+    - ADXL345             0x53
+
+  and the analog front end (heaters, MICS dividers, battery, panel, noise).
+  The Goteo build (16 MHz) also gets the DHT22 on IO3.
+
+*/
+
+#include "sim.h"
+#include <map>
+#include <deque>
+#include <array>
+
+#define I2C_START_US    10      // Start, address and stop overhead
+#define SDA_PIN         2       // PD1
+#define SCL_PIN         3       // PD0
+#define HANG_CLOCKS     3       // SCL clocks a hung slave needs to finish its byte
+#define DHT_PIN         10      // IO3
+
+namespace sim {
+
+  Environment env = {
+    22.,      // temperature
+    45.,      // humidity
+    300.,     // lux
+    3900.,    // battery
+    0.,       // panel
+    120.,     // noise
+    150000.,  // coRs
+    20000.,   // no2Rs
+    0., 0., 1.,
+    0.
+  };
+
+  static std::map<uint8_t, I2CDevice *> bus;
+
+  I2CDevice *i2cDevice(uint8_t address) {
+    std::map<uint8_t, I2CDevice *>::iterator it = bus.find(address);
+    return (it == bus.end()) ? 0 : it->second;
+  }
+
+  static uint64_t i2cByteTime() {
+    // SCL = F_CPU/(16 + 2*TWBR), 9 clocks per byte (8 bits and ACK)
+    uint64_t scl = F_CPU/(16 + 2*(uint32_t)TWBR);
+    return (9000000ULL + scl - 1)/scl;
+  }
+
+  static uint8_t bcd(uint8_t value) { return ((value/10) << 4) | (value%10); }
+  static uint8_t unbcd(uint8_t value) { return (value >> 4)*10 + (value & 0x0F); }
+
+  /* Calendar, seconds since 2000-01-01 00:00:00 */
+
+  static const uint8_t monthDays[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+  static bool leap(uint16_t year) { return (year%4 == 0) && ((year%100 != 0) || (year%400 == 0)); }
+
+  uint64_t toEpoch(uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minutes, uint8_t seconds) {
+    uint64_t days = 0;
+    for (uint16_t y = 2000; y < year; y++) days += leap(y) ? 366 : 365;
+    for (uint8_t m = 1; m < month; m++) days += monthDays[m - 1] + (((m == 2) && leap(year)) ? 1 : 0);
+    days += day - 1;
+    return ((days*24 + hour)*60 + minutes)*60 + seconds;
+  }
+
+  void fromEpoch(uint64_t epoch, uint16_t &year, uint8_t &month, uint8_t &day, uint8_t &hour, uint8_t &minutes, uint8_t &seconds) {
+    seconds = epoch%60; epoch /= 60;
+    minutes = epoch%60; epoch /= 60;
+    hour = epoch%24; epoch /= 24;
+    year = 2000;
+    while (epoch >= (uint64_t)(leap(year) ? 366 : 365)) {
+      epoch -= leap(year) ? 366 : 365;
+      year++;
+    }
+    month = 1;
+    while (true) {
+      uint8_t days = monthDays[month - 1] + (((month == 2) && leap(year)) ? 1 : 0);
+      if (epoch < days) break;
+      epoch -= days;
+      month++;
+    }
+    day = epoch + 1;
+  }
+
+  /* DS1339, runs on real time (also while the MCU is powered down) */
+
+  struct RTC : I2CDevice {
+    uint8_t pointer;
+    bool first;
+    uint64_t epoch, setAt;
+    double drift;           // ppm
+    uint8_t regs[16];
+    uint8_t pending[7];
+    bool timeWritten;
+    RTC() : pointer(0), first(true), epoch(0), setAt(0), drift(0), timeWritten(false) { address = 0x68; memset(regs, 0, sizeof(regs)); }
+    uint64_t current() { return epoch + (uint64_t)((now - setAt)*(1 + drift*1e-6))/1000000; }
+    void start() { first = true; timeWritten = false; memcpy(pending, latch(), 7); }
+    const uint8_t *latch() {
+      static uint8_t time[7];
+      uint16_t year; uint8_t month, day, hour, minutes, seconds;
+      fromEpoch(current(), year, month, day, hour, minutes, seconds);
+      time[0] = bcd(seconds); time[1] = bcd(minutes); time[2] = bcd(hour);
+      time[3] = 1; time[4] = bcd(day); time[5] = bcd(month); time[6] = bcd(year%100);
+      return time;
+    }
+    bool write(uint8_t data) {
+      if (first) { pointer = data & 0x0F; first = false; return true; }
+      if (pointer < 7) { pending[pointer] = data; timeWritten = true; }
+      else regs[pointer] = data;
+      pointer = (pointer + 1) & 0x0F;
+      return true;
+    }
+    bool read(uint8_t &data) {
+      if (pointer < 7) data = pending[pointer];
+      else data = regs[pointer];
+      pointer = (pointer + 1) & 0x0F;
+      return true;
+    }
+    void stop() {
+      if (!timeWritten) return;
+      epoch = toEpoch(2000 + unbcd(pending[6]), unbcd(pending[5] & 0x1F), unbcd(pending[4] & 0x3F),
+                      unbcd(pending[2] & 0x3F), unbcd(pending[1] & 0x7F), unbcd(pending[0] & 0x7F));
+      setAt = now - (now % 1000000);
+      timeWritten = false;
+    }
+  };
+
+  static RTC rtc;
+
+  void rtcSetEpoch(uint64_t epoch) {
+    rtc.epoch = epoch;
+    rtc.setAt = now;
+  }
+
+  void rtcSetDrift(double ppm) {
+    rtc.epoch = rtc.current();
+    rtc.setAt = now;
+    rtc.drift = ppm;
+  }
+
+  /* 24LC256, 32 KB, 64 byte pages, 5 ms write cycle (NACK while busy) */
+
+  struct Eeprom24 : I2CDevice {
+    uint8_t memory[32768];
+    uint16_t pointer;
+    uint8_t received;
+    uint8_t page[64];
+    uint8_t pageLength;
+    uint16_t pageStart;
+    uint64_t busyUntil;
+    Eeprom24() : pointer(0), received(0), pageLength(0), pageStart(0), busyUntil(0) { address = 0x50; memset(memory, 0xFF, sizeof(memory)); }
+    void start() { received = 0; pageLength = 0; }
+    bool busy() { return now < busyUntil; }
+    bool acknowledge() { return !busy(); }     // No ACK during the write cycle
+    bool write(uint8_t data) {
+      if (busy()) return false;
+      if (received == 0) pointer = (data & 0x7F) << 8;
+      else if (received == 1) { pointer |= data; pageStart = pointer; }
+      else if (pageLength < 64) page[pageLength++] = data;
+      received++;
+      return true;
+    }
+    bool read(uint8_t &data) {
+      if (busy()) return false;
+      data = memory[pointer];
+      pointer = (pointer + 1) & 0x7FFF;
+      return true;
+    }
+    void stop() {
+      if (!pageLength) return;
+      for (uint8_t i = 0; i < pageLength; i++) {
+        // The address wraps inside the page
+        uint16_t at = (pageStart & ~0x3F) | ((pageStart + i) & 0x3F);
+        memory[at] = page[i];
+      }
+      pointer = (pageStart & ~0x3F) | ((pageStart + pageLength) & 0x3F);
+      pageLength = 0;
+      busyUntil = now + 5000;
+    }
+  };
+
+  static Eeprom24 eeprom24;
+
+  uint8_t eeprom24Byte(uint16_t address) { return eeprom24.memory[address & 0x7FFF]; }
+
+  /* MCP4xxx digital pots, 9 bit wipers (0..256) */
+
+  struct Pot : I2CDevice {
+    uint16_t wiper[16];
+    uint8_t command;
+    uint8_t received;
+    uint8_t readByte;
+    Pot(uint8_t a) : command(0), received(0), readByte(0) { address = a; for (int i = 0; i < 16; i++) wiper[i] = 128; }
+    void start() { received = 0; readByte = 0; }
+    bool write(uint8_t data) {
+      if (received == 0) {
+        command = data;
+        readByte = 0;
+      } else if (received == 1) {
+        uint8_t reg = command >> 4;
+        if (((command >> 2) & 0x03) == 0) wiper[reg] = ((command & 0x01) << 8) | data;
+      }
+      received++;
+      return true;
+    }
+    bool read(uint8_t &data) {
+      uint16_t value = wiper[command >> 4];
+      data = (readByte++ % 2) ? lowByte(value) : (highByte(value) & 0x01);
+      return true;
+    }
+  };
+
+  static Pot mcp1(0x2E), mcp2(0x2F), mcp3(0x2D);
+
+  uint16_t potWiper(uint8_t address, uint8_t wiper) {
+    Pot *pot = (Pot *)i2cDevice(address);
+    if (!pot) return 0;
+    return pot->wiper[wiper & 0x0F];
+  }
+
+  /* SHT21, hold master (0xE3, 0xE5) and no hold master (0xF3, 0xF5) */
+
+  static uint8_t shtCrc(const uint8_t *data, uint8_t length) {
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < length; i++) {
+      crc ^= data[i];
+      for (uint8_t bit = 0; bit < 8; bit++) crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : (crc << 1);
+    }
+    return crc;
+  }
+
+  struct SHT21 : I2CDevice {
+    uint8_t command;
+    uint8_t out[3];
+    uint8_t outIndex;
+    uint64_t readyAt;
+    bool hold;
+    bool first;
+    uint8_t userRegister;
+    SHT21() : command(0), outIndex(3), readyAt(0), hold(false), first(true), userRegister(0x02) { address = 0x40; }
+    void convert(bool humidity) {
+      uint16_t raw;
+      if (humidity) raw = (uint16_t)((env.humidity + 6.)/125.*65536.) & ~0x0003;
+      else raw = (uint16_t)((env.temperature + 46.85)/175.72*65536.) & ~0x0003;
+      raw |= humidity ? 0x02 : 0x00;   // Status bits
+      out[0] = highByte(raw);
+      out[1] = lowByte(raw);
+      out[2] = shtCrc(out, 2);
+      outIndex = 0;
+      readyAt = now + (humidity ? 29000 : 85000);  // 12 bit RH, 14 bit T
+    }
+    void start() { first = true; }
+    bool write(uint8_t data) {
+      if (!first) {
+        if (command == 0xE6) userRegister = data;
+        return true;
+      }
+      first = false;
+      command = data;
+      if ((data == 0xE3) || (data == 0xF3)) { convert(false); hold = (data == 0xE3); }
+      else if ((data == 0xE5) || (data == 0xF5)) { convert(true); hold = (data == 0xE5); }
+      else if (data == 0xE7) { out[0] = userRegister; outIndex = 0; readyAt = now; }
+      else if (data == 0xFE) { userRegister = 0x02; readyAt = now + 15000; outIndex = 3; }
+      return true;
+    }
+    uint64_t stretch() { return (hold && (now < readyAt)) ? readyAt - now : 0; }   // Hold master: SCL low until done
+    bool acknowledge() { return hold || (now >= readyAt); }                         // No hold: NACK until done
+    bool read(uint8_t &data) {
+      if (outIndex >= 3) { data = 0xFF; return true; }
+      data = out[outIndex++];
+      return true;
+    }
+  };
+
+  static SHT21 sht21;
+
+  /* BH1730FVC */
+
+  struct BH1730 : I2CDevice {
+    uint8_t regs[0x20];
+    uint8_t pointer;
+    bool first;
+    uint64_t started;
+    BH1730() : pointer(0), first(true), started(0) { address = 0x29; memset(regs, 0, sizeof(regs)); regs[1] = 0xDA; regs[0x12] = 0x71; }
+    uint64_t conversionTime() {
+      return (uint64_t)((256 - regs[1])*2.7*1000) + 2000;   // ITIME*2.7 ms plus the fixed part
+    }
+    void update() {
+      if (!(regs[0] & 0x02)) return;   // ADC disabled
+      if (now < started + conversionTime()) return;
+      static const uint8_t gains[] = {1, 2, 64, 128};
+      double gain = gains[regs[7] & 0x03];
+      double itime = (256 - regs[1])*2.7;
+      double data0 = env.lux*gain*(itime/102.6)/(1.290 - 0.2733);   // DATA1 = DATA0/10 (comp < 0.26 band)
+      if (data0 > 65535) data0 = 65535;
+      uint16_t d0 = (uint16_t)data0;
+      uint16_t d1 = d0/10;
+      regs[0x14] = lowByte(d0); regs[0x15] = highByte(d0);
+      regs[0x16] = lowByte(d1); regs[0x17] = highByte(d1);
+      regs[0] |= 0x10;   // ADC_VALID
+      if (regs[0] & 0x08) regs[0] &= ~0x02;   // One time mode, the ADC stops
+      else started += conversionTime()*((now - started)/conversionTime());
+    }
+    void start() { first = true; update(); }
+    bool write(uint8_t data) {
+      if (first) {
+        first = false;
+        if ((data & 0xE0) == 0xE0) {   // Special commands
+          if ((data & 0x1F) == 0x04) { memset(regs, 0, sizeof(regs)); regs[1] = 0xDA; regs[0x12] = 0x71; }
+          return true;
+        }
+        pointer = data & 0x1F;
+        return true;
+      }
+      if (pointer == 0) {
+        bool start = (data & 0x02) && !(regs[0] & 0x02);
+        regs[0] = (data & 0x0F) | (regs[0] & 0x10);
+        if (start || (data & 0x08)) { started = now; regs[0] &= ~0x10; }
+      } else if (pointer < 0x14) regs[pointer] = data;
+      pointer = (pointer + 1) & 0x1F;
+      return true;
+    }
+    bool read(uint8_t &data) {
+      data = regs[pointer];
+      pointer = (pointer + 1) & 0x1F;
+      return true;
+    }
+  };
+
+  static BH1730 bh1730;
+
+  /* ADXL345, samples at its own output data rate into a 32 entry FIFO (bypass, FIFO and stream modes)
+     with ac-coupled activity detection latched in INT_SOURCE */
+
+  #define ADXL_KNOCK_US   40000   // Length of a scripted knock
+
+  struct ADXL345 : I2CDevice {
+    uint8_t regs[64];
+    uint8_t pointer;
+    bool first;
+    std::deque<std::array<int16_t, 3> > fifo;
+    uint64_t sampled;             // Time of the last sample
+    bool measuring;
+    bool referenced;
+    int16_t reference[3];         // Activity reference (ac-coupled)
+    uint64_t knockAt;
+    double knockG;
+    ADXL345() : pointer(0), first(true), sampled(0), measuring(false), referenced(false), knockAt(UINT64_MAX), knockG(0) {
+      address = 0x53; memset(regs, 0, sizeof(regs)); regs[0] = 0xE5; regs[0x2C] = 0x0A;
+    }
+    double lsb() {
+      static const double ranges[] = {2., 4., 8., 16.};
+      return (regs[0x31] & 0x08) ? 256. : 512./ranges[regs[0x31] & 0x03];   // Full resolution keeps 3.9 mg/LSB
+    }
+    int16_t sample(double g) {
+      static const double ranges[] = {2., 4., 8., 16.};
+      double range = ranges[regs[0x31] & 0x03];
+      double noise = (env.vibration > 0) ? (uniform() - 0.5)*2.*env.vibration : 0.;
+      long value = (long)((g + noise)*lsb());
+      long limit = (regs[0x31] & 0x08) ? (long)(range*256.) : 511;
+      return (int16_t)constrain(value, -limit - 1, limit);
+    }
+    void activity(const std::array<int16_t, 3> &xyz) {
+      if (!(regs[0x2E] & 0x10)) return;
+      if (!referenced) { for (int i = 0; i < 3; i++) reference[i] = xyz[i]; referenced = true; return; }
+      double threshold = regs[0x24]*0.0625*lsb();
+      bool ac = regs[0x27] & 0x80;
+      for (int i = 0; i < 3; i++) {
+        if (!(regs[0x27] & (0x40 >> i))) continue;
+        double value = ac ? xyz[i] - reference[i] : xyz[i];
+        if (fabs(value) > threshold) {
+          regs[0x30] |= 0x10;
+          for (int j = 0; j < 3; j++) reference[j] = xyz[j];   // Detection starts again from here
+          return;
+        }
+      }
+    }
+    void advance() {
+      // Every sample due since the last access, at the BW_RATE output data rate
+      if (!(regs[0x2D] & 0x08)) { measuring = false; return; }
+      uint64_t period = (uint64_t)(1e6/(3200./(1 << (15 - (regs[0x2C] & 0x0F)))));
+      if (!measuring) { measuring = true; sampled = now; referenced = false; }
+      uint8_t mode = regs[0x38] >> 6;
+      // Long gaps: only the samples the FIFO can still hold matter, plus a possible knock
+      if ((now - sampled) > 64*period) {
+        uint64_t skip = (now - sampled)/period - 64;
+        if ((knockAt != UINT64_MAX) && (knockAt + ADXL_KNOCK_US > sampled) && (knockAt < sampled + skip*period)) skip = (knockAt - sampled)/period;
+        sampled += skip*period;
+      }
+      while (sampled + period <= now) {
+        sampled += period;
+        double spike = ((sampled >= knockAt) && (sampled < knockAt + ADXL_KNOCK_US)) ? knockG : 0.;
+        std::array<int16_t, 3> xyz = {{sample(env.accelX + spike), sample(env.accelY), sample(env.accelZ)}};
+        activity(xyz);
+        if (mode == 0) fifo.clear();
+        else if (fifo.size() == 32) {
+          regs[0x30] |= 0x01;                                   // Overrun
+          if (mode == 1) continue;                              // FIFO mode stops when full
+          fifo.pop_front();
+        }
+        fifo.push_back(xyz);
+        if (mode == 0) fifo.pop_back(), setData(xyz);
+      }
+      if ((knockAt != UINT64_MAX) && (sampled >= knockAt + ADXL_KNOCK_US)) knockAt = UINT64_MAX;
+      regs[0x39] = fifo.size();
+      if (mode == 0) regs[0x30] |= 0x80;                        // DATA_READY
+      else if (!fifo.empty()) regs[0x30] |= 0x80;
+      if (fifo.size() > (size_t)(regs[0x38] & 0x1F)) regs[0x30] |= 0x02;   // Watermark
+      else regs[0x30] &= ~0x02;
+    }
+    void setData(const std::array<int16_t, 3> &xyz) {
+      for (int i = 0; i < 3; i++) { regs[0x32 + 2*i] = lowByte(xyz[i]); regs[0x33 + 2*i] = highByte(xyz[i]); }
+    }
+    void latch() {
+      // Reading the data registers pops the oldest FIFO entry
+      if (((regs[0x38] >> 6) != 0) && !fifo.empty()) {
+        setData(fifo.front());
+        fifo.pop_front();
+        regs[0x39] = fifo.size();
+      }
+    }
+    void start() { first = true; advance(); }
+    bool write(uint8_t data) {
+      if (first) { pointer = data & 0x3F; first = false; if (pointer == 0x32) latch(); return true; }
+      if ((pointer >= 0x1D) && (pointer != 0x30) && (pointer != 0x39) && (pointer < 0x32)) regs[pointer] = data;
+      else if (pointer == 0x38) { regs[pointer] = data; fifo.clear(); regs[0x39] = 0; }
+      pointer = (pointer + 1) & 0x3F;
+      return true;
+    }
+    bool read(uint8_t &data) {
+      data = regs[pointer];
+      if (pointer == 0x30) regs[0x30] &= ~0x10;                 // Reading INT_SOURCE clears activity
+      if (pointer == 0x37) regs[0x30] &= ~0x80;
+      pointer = (pointer + 1) & 0x3F;
+      return true;
+    }
+  };
+
+  static ADXL345 adxl345;
+
+  void adxlKnock(double g) {
+    adxl345.knockAt = now;
+    adxl345.knockG = g;
+  }
+
+  static void twiControl(uint8_t value);
+
+  void i2cSetup() {
+    TWCR.onWrite = twiControl;
+    TWBR = ((F_CPU / 100000L) - 16) / 2;
+    pins[SDA_PIN] = HIGH;
+    pins[SCL_PIN] = HIGH;
+    bus.clear();
+    bus[rtc.address] = &rtc;
+    bus[eeprom24.address] = &eeprom24;
+    bus[mcp1.address] = &mcp1;
+    bus[mcp2.address] = &mcp2;
+    bus[mcp3.address] = &mcp3;
+    bus[sht21.address] = &sht21;
+    bus[bh1730.address] = &bh1730;
+    bus[adxl345.address] = &adxl345;
+  }
+
+  /* Analog front end */
+
+  #define POT_KR    390.625   // Ohm per step, 100K/256
+  #define VH_K      0.03072   // Voltage regulator constant, RES*R1/100/1000
+
+  struct Heater {
+    uint8_t pin;              // Enable
+    uint8_t wiper;            // VH wiper on MCP1
+    double rc;                // Current sense resistor (Ohm)
+    double cold, hot;         // Heater resistance (Ohm)
+    uint64_t since;           // Switched on
+    bool on;
+  };
+
+  static Heater heaters[2] = {
+    {5,  0, 10., 60., 74., 0, false},    // MICS5525
+    {13, 1, 39., 55., 68., 0, false}     // MICS2714
+  };
+
+  static double heaterCurrent(Heater &h) {
+    bool on = pins[h.pin] && pins[10];   // Enable and MICS power line (IO3)
+    if (on && !h.on) h.since = now;
+    h.on = on;
+    if (!on) return 0;
+    double vh = (potWiper(0x2E, h.wiper)/VH_K + 1000)*0.41;
+    double warm = 1. - exp(-(double)(now - h.since)/20e6);   // 20 s thermal time constant
+    double rh = h.cold + (h.hot - h.cold)*warm;
+    return vh/(rh + h.rc);   // mA
+  }
+
+  static double divider(double vmics, double rs, uint8_t wiper) {
+    double rl = potWiper(0x2E, wiper)*POT_KR;
+    if (rl <= 0) return 0;
+    return vmics*rl/(rs + rl);
+  }
+
+  void updateAnalog() {
+    double i0 = heaterCurrent(heaters[0]);
+    double i1 = heaterCurrent(heaters[1]);
+    analogMv[A2] = i0*heaters[0].rc;
+    analogMv[A3] = i1*heaters[1].rc;
+    analogMv[A4] = pins[10] ? divider(2734., env.coRs, 6) : 0;
+    analogMv[A5] = pins[10] ? divider(2734., env.no2Rs, 7) : 0;
+    analogMv[A7] = env.battery*180./280.;
+    analogMv[A8] = (env.panel > 120.) ? (env.panel - 120.)/11. : 0;
+    analogMv[A0] = env.noise*(1. + (uniform() - 0.5)*0.2);
+    analogMv[A1] = std::min(env.lux, 1000.)*vcc/1000.;
+  }
+
+  /* DHT22 on IO3 (PB6), Goteo board only: a start signal of at least 1 ms, then on release
+     80 us low, 80 us high and 40 bits, each 50 us low and 27 us (0) or 70 us (1) high */
+
+  static std::deque<std::pair<uint64_t, uint8_t> > dhtEdges;   // Levels the sensor drives and when
+  static uint64_t dhtStart = 0;                                // The MCU pulled the line low
+  static uint64_t dhtAnswers = 0;
+
+  static void dhtLevel(uint64_t at, uint8_t level) {
+    dhtEdges.push_back(std::make_pair(at, level));
+  }
+
+  void dhtPin(uint8_t pin, uint8_t mode) {
+    if ((F_CPU == 8000000) || (pin != DHT_PIN)) return;
+    if (mode == OUTPUT) {
+      dhtStart = now;
+      return;
+    }
+    PINB |= _BV(PB6);   // Released, the pull-up takes the line high
+    if (!dhtStart) return;
+    uint64_t held = now - dhtStart;
+    dhtStart = 0;
+    if (held < 1000) return;
+    uint16_t humidity = (uint16_t)lround(env.humidity*10.);
+    long temperature = lround(env.temperature*10.);
+    uint16_t raw = (temperature < 0) ? (0x8000 | -temperature) : temperature;
+    uint8_t data[5] = {(uint8_t)(humidity >> 8), (uint8_t)humidity, (uint8_t)(raw >> 8), (uint8_t)raw, 0};
+    data[4] = data[0] + data[1] + data[2] + data[3];
+    uint64_t at = now + 30;
+    dhtLevel(at, LOW);
+    dhtLevel(at += 80, HIGH);
+    at += 80;
+    for (uint8_t bit = 0; bit < 40; bit++) {
+      dhtLevel(at, LOW);
+      dhtLevel(at += 50, HIGH);
+      at += (data[bit >> 3] & (0x80 >> (bit & 7))) ? 70 : 27;
+    }
+    dhtLevel(at, LOW);
+    dhtLevel(at + 50, HIGH);
+    dhtAnswers++;
+  }
+
+  bool dhtEdge() {
+    if (dhtEdges.empty() || (dhtEdges.front().first > now)) return false;
+    if (dhtEdges.front().second) PINB |= _BV(PB6);
+    else PINB &= ~_BV(PB6);
+    dhtEdges.pop_front();
+    return true;
+  }
+
+  uint64_t dhtNextEvent() {
+    return dhtEdges.empty() ? UINT64_MAX : dhtEdges.front().first;
+  }
+
+  void dhtReport(FILE *out) {
+    if (F_CPU != 8000000) fprintf(out, "dht_answers=%llu\n", (unsigned long long)dhtAnswers);
+  }
+
+  /* TWI, the AVR two wire interface as SCKTwi.cpp drives it: writing TWCR with TWINT set
+     starts the next step, TWINT and the TWI interrupt come back when the bus is done */
+
+  static struct {
+    I2CDevice *device;     // Addressed slave
+    bool started;          // Between START and STOP
+    bool reading;
+    bool readByte;         // Fetch the byte from the device at due
+    uint64_t due;          // Next TWINT, 0 if none
+    uint8_t status;        // TWSR at due
+    uint8_t hangAddress;   // "i2c hang": the next transactions to this slave stall
+    uint32_t hangs;
+    bool sdaHeld;          // A hung slave holds SDA low until SCL is clocked
+    uint8_t clocks;
+  } twi = {};
+
+  static void twiSchedule(uint8_t status, uint64_t us) {
+    twi.status = status;
+    twi.due = now + us;
+  }
+
+  static void twiReset() {
+    if (twi.device) twi.device->stop();
+    twi.device = 0;
+    twi.started = false;
+    twi.readByte = false;
+    twi.due = 0;
+    TWSR = 0xF8;
+  }
+
+  static void twiControl(uint8_t value) {
+    if (!(value & _BV(TWEN))) { twiReset(); return; }
+    if (!(value & _BV(TWINT))) return;
+    TWCR.value &= ~_BV(TWINT);                   // Writing a one clears the flag and starts the step
+    if (twi.sdaHeld) return;                     // Nothing moves on a stuck bus
+    if (value & _BV(TWSTO)) {
+      twiReset();
+      TWCR.value &= ~_BV(TWSTO);
+      if (!(value & _BV(TWSTA))) return;
+    }
+    if (value & _BV(TWSTA)) {
+      counters.i2cTransactions++;
+      twiSchedule(twi.started ? 0x10 : 0x08, I2C_START_US);
+      twi.started = true;
+      return;
+    }
+    uint8_t last = TWSR & 0xF8;
+    counters.i2cBytes++;
+    if ((last == 0x08) || (last == 0x10)) {
+      // Address
+      twi.reading = TWDR & 0x01;
+      twi.device = i2cDevice(TWDR >> 1);
+      if (twi.device && twi.hangs && (twi.device->address == twi.hangAddress)) {
+        twi.hangs--;
+        twi.sdaHeld = true;
+        twi.clocks = 0;
+        pins[SDA_PIN] = LOW;
+        return;
+      }
+      bool ack = twi.device && twi.device->acknowledge();
+      if (ack) twi.device->start();
+      else twi.device = 0;
+      if (twi.reading) twiSchedule(ack ? 0x40 : 0x48, i2cByteTime());
+      else twiSchedule(ack ? 0x18 : 0x20, i2cByteTime());
+    } else if (!twi.reading) {
+      bool ack = twi.device && twi.device->write(TWDR);
+      twiSchedule(ack ? 0x28 : 0x30, i2cByteTime());
+    } else {
+      // The slave may stretch SCL before the byte (SHT21 hold master)
+      twi.readByte = true;
+      twiSchedule((value & _BV(TWEA)) ? 0x50 : 0x58, i2cByteTime() + (twi.device ? twi.device->stretch() : 0));
+    }
+  }
+
+  void twiService() {
+    if (!twi.due || (twi.due > now)) return;
+    twi.due = 0;
+    if (twi.readByte) {
+      uint8_t data = 0xFF;
+      if (!twi.device || !twi.device->read(data)) data = 0xFF;
+      TWDR = data;
+      twi.readByte = false;
+    }
+    TWSR = (TWSR & 0x07) | twi.status;
+    TWCR.value |= _BV(TWINT);
+  }
+
+  bool twiInterrupt() {
+    return (TWCR.value & _BV(TWINT)) && (TWCR.value & _BV(TWIE)) && (TWCR.value & _BV(TWEN));
+  }
+
+  uint64_t twiNextEvent() {
+    return twi.due ? twi.due : UINT64_MAX;
+  }
+
+  void twiPinMode(uint8_t pin, uint8_t mode) {
+    // Bus recovery drives the lines by hand: low as outputs, pulled up as inputs
+    if ((pin != SDA_PIN) && (pin != SCL_PIN)) return;
+    if ((pin == SCL_PIN) && (mode == OUTPUT) && twi.sdaHeld && (++twi.clocks >= HANG_CLOCKS)) twi.sdaHeld = false;
+    if (mode == OUTPUT) pins[pin] = LOW;
+    else pins[pin] = ((pin == SDA_PIN) && twi.sdaHeld) ? LOW : HIGH;
+  }
+
+  bool i2cDirective(const std::vector<std::string> &args) {
+    // i2c hang <address> [count]
+    if ((args.size() < 3) || (args[1] != "hang")) return false;
+    twi.hangAddress = strtoul(args[2].c_str(), 0, 0);
+    twi.hangs = (args.size() > 3) ? atoi(args[3].c_str()) : 1;
+    return true;
+  }
+
+}
+
@@ -0,0 +1,51 @@
+/*
+
+  fifo.cpp
+  Checks the compaction of the readings FIFO in the external EEPROM: the
+  weights of the stored records (readings merged into each) add up to the
+  same before and after every "compact" stage of the firmware.
+
+  The record layout and the FIFO pointers come from the firmware headers,
+  both builds (Kickstarter, Goteo) check their own layout.
+
+*/
+
+#include "sim.h"
+
+// Constants.h defines the registry tables the simulator does not use
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#include <Constants.h>
+#include <SCKConfig.h>
+#pragma GCC diagnostic pop
+
+namespace sim {
+
+  static uint64_t compactions = 0;
+  static uint64_t weightLost = 0;       // Readings missing after a compaction
+  static uint64_t weightBefore = 0;
+
+  static uint64_t fifoWeight() {
+    // Sum of the weights between the read and the write pointers, big endian like setField()
+    uint64_t weight = 0;
+    for (uint32_t address = SCKConfig::readMeasure(); address + FIFO_RECORD_SIZE <= SCKConfig::writeMeasure(); address += FIFO_RECORD_SIZE) {
+      uint16_t at = address + FIFO_RECORD_SIZE - FIFO_WEIGHT_BYTES;
+      weight += (eeprom24Byte(at) << 8) | eeprom24Byte(at + 1);
+    }
+    return weight;
+  }
+
+  void fifoStage(const char *name, bool begin) {
+    if (strcmp(name, "compact")) return;
+    if (begin) { weightBefore = fifoWeight(); return; }
+    uint64_t after = fifoWeight();
+    compactions++;
+    if (after < weightBefore) weightLost += weightBefore - after;
+  }
+
+  void fifoReport(FILE *out) {
+    fprintf(out, "fifo_compactions=%llu\n", (unsigned long long)compactions);
+    fprintf(out, "fifo_weight_lost=%llu\n", (unsigned long long)weightLost);
+  }
+
+}
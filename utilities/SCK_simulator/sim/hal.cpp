@@ -0,0 +1,458 @@
+/*
+
+  hal.cpp
+  Arduino core on virtual time: clock, pins, ADC, UARTs, internal EEPROM,
+  sleep modes and interrupt dispatch.
+
+*/
+
+#include "sim.h"
+#include <EEPROM.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+
+/* Registers */
+
+static void sregWrite(uint8_t value);
+SimRegister SREG(sregWrite, 0x80);   // Setting the I bit runs the pending interrupts
+volatile uint8_t MCUSR = 0, WDTCSR;   // The Caterina bootloader clears MCUSR before the sketch starts
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t ICR1;
+volatile uint8_t EICRA, EIMSK, EIFR;
+volatile uint8_t PCICR, PCIFR, PCMSK0;
+volatile uint8_t ADCSRA = _BV(ADEN), USBSTA;
+volatile uint8_t PINB, DDRB, PORTB, PIND, DDRD, PORTD;
+SimRegister TWCR;
+volatile uint8_t TWBR, TWSR = 0xF8, TWDR, TWAR;
+
+volatile unsigned long timer0_millis = 0;  // Offset the firmware adds after a power-down
+
+/* End of the heap, SCKBase::freeRAM() measures the stack against it (set by main()) */
+
+int __heap_start;
+int *__brkval = 0;
+
+/* Interrupt vectors, defined by the firmware when used */
+
+extern "C" void TIMER1_OVF_vect(void) __attribute__((weak));
+extern "C" void WDT_vect(void) __attribute__((weak));
+extern "C" void INT2_vect(void) __attribute__((weak));
+extern "C" void TWI_vect(void) __attribute__((weak));
+extern "C" void PCINT0_vect(void) __attribute__((weak));
+
+#define CPU_CALL_US     2      // Cost of a call into the core
+#define ADC_US          104    // One conversion, prescaler 64 at 8 MHz (128 at 16 MHz)
+#define EEPROM_WRITE_US 3400   // Internal EEPROM write
+
+namespace sim {
+
+  uint64_t now = 0;
+  uint64_t idle = 0;
+  uint64_t stopped = 0;
+  Counters counters = {0, 0, 0, 0};
+
+  uint8_t pins[32];
+  double  analogMv[32];
+#if F_CPU == 8000000
+  double  vcc = 3300.;
+#else
+  double  vcc = 5000.;
+#endif
+  bool    usb = false;
+  bool    echoConsole = false;
+
+  Port uart1 = {};
+  static std::deque<uint8_t> console;
+  static uint8_t adcReference = DEFAULT;
+  static uint8_t eeprom[SIM_EEPROM_SIZE];
+  static bool eepromReady = false;
+  static uint64_t timer1Next = 0;
+  static int sleepMode = SLEEP_MODE_IDLE;
+  static bool consoleLineStart = true;
+
+  static void eepromInit() {
+    if (eepromReady) return;
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    eepromReady = true;
+  }
+
+  static uint64_t byteTime(uint32_t baud) {
+    return baud ? 10000000ULL/baud : 1000;
+  }
+
+  static bool interruptsEnabled() {
+    return SREG & 0x80;
+  }
+
+  static uint64_t timer1Period() {
+    // Phase and frequency correct PWM, TOP = ICR1, overflow at BOTTOM
+    static const uint16_t prescale[] = {0, 1, 8, 64, 256, 1024, 0, 0};
+    uint16_t p = prescale[TCCR1B & 0x07];
+    if (!p || !(TIMSK1 & _BV(TOIE1))) return 0;
+    uint64_t period = (2ULL*ICR1*p*1000000ULL)/F_CPU;
+    return period ? period : 1;
+  }
+
+  static void isr(void (*vector)(void)) {
+    // The I bit is cleared on entry (an ISR may sei() to let others in) and set again by reti
+    if (!vector) return;
+    SREG &= (uint8_t)~0x80;
+    vector();
+    SREG |= 0x80;
+  }
+
+  void service() {
+    if (now >= duration) finish();
+    runScriptEvents();
+    // UART1, MCU to module
+    while (!uart1.toDevice.empty() && (uart1.toDevice.front().first <= now)) {
+      uint8_t c = uart1.toDevice.front().second;
+      uint64_t at = uart1.toDevice.front().first;
+      uart1.toDevice.pop_front();
+      if (uart1.baud == 9600) wiflyReceive(c, at);   // The module only talks at 9600
+    }
+    wiflyService();
+    // TWI
+    twiService();
+    if (twiInterrupt() && interruptsEnabled()) isr(TWI_vect);
+    // UART1, module to MCU
+    while (!uart1.fromDevice.empty() && (uart1.fromDevice.front().first <= now)) {
+      if (uart1.baud == 9600) {
+        if (uart1.rx.size() < 64) uart1.rx.push_back(uart1.fromDevice.front().second);
+        else uart1.rxDropped++;
+      }
+      uart1.fromDevice.pop_front();
+    }
+    // DHT22 edges on PB6, the pin change interrupt times them
+    while (dhtEdge())
+      if ((PCICR & _BV(PCIE0)) && (PCMSK0 & _BV(PCINT6)) && interruptsEnabled()) isr(PCINT0_vect);
+    // Timer1 (console requests)
+    uint64_t period = timer1Period();
+    if (!period) timer1Next = 0;
+    else if (!timer1Next) timer1Next = now + period;
+    else if ((timer1Next <= now) && interruptsEnabled()) {
+      timer1Next = now + period;
+      isr(TIMER1_OVF_vect);
+    }
+  }
+
+  static uint64_t nextEvent(uint64_t limit) {
+    uint64_t next = limit;
+    if (!uart1.toDevice.empty()) next = std::min(next, uart1.toDevice.front().first);
+    if (!uart1.fromDevice.empty()) next = std::min(next, uart1.fromDevice.front().first);
+    if (timer1Next) next = std::min(next, timer1Next);
+    next = std::min(next, twiNextEvent());
+    next = std::min(next, dhtNextEvent());
+    next = std::min(next, wiflyNextEvent());
+    next = std::min(next, nextScriptEvent());
+    return next < now ? now : next;
+  }
+
+  void advance(uint64_t us) {
+    // A DHT22 edge interrupts the CPU on time, even in the middle of a long call
+    uint64_t target = now + us;
+    while (dhtNextEvent() < target) {
+      now = std::max(now, dhtNextEvent());
+      service();
+    }
+    now = target;
+    service();
+  }
+
+  void wait(uint64_t us) {
+    uint64_t target = now + us;
+    while (now < target) {
+      uint64_t next = nextEvent(target);
+      if (next == now) next = now + 1;
+      idle += next - now;
+      now = next;
+      service();
+    }
+  }
+
+  void eepromLoad(int address, uint8_t value) {
+    eepromInit();
+    if ((address >= 0) && (address < SIM_EEPROM_SIZE)) eeprom[address] = value;
+  }
+
+  void toFirmware(const std::string &text, uint64_t at) {
+    for (size_t i = 0; i < text.size(); i++) {
+      uint64_t t = std::max(at, uart1.rxFree) + byteTime(9600);
+      uart1.rxFree = t;
+      uart1.fromDevice.push_back(std::make_pair(t, (uint8_t)text[i]));
+    }
+  }
+
+  void consoleInput(const std::string &text) {
+    for (size_t i = 0; i < text.size(); i++) console.push_back(text[i]);
+  }
+
+  static void consoleOutput(uint8_t c) {
+    if (!echoConsole) return;
+    if (consoleLineStart) fprintf(stderr, "[%10.3f] ", now/1e6);
+    consoleLineStart = (c == '\n');
+    fputc(c, stderr);
+  }
+
+}
+
+using namespace sim;
+
+/* Time */
+
+unsigned long millis() {
+  advance(CPU_CALL_US);
+  return (now - stopped)/1000 + timer0_millis;
+}
+
+unsigned long micros() {
+  advance(CPU_CALL_US);
+  return (now - stopped) + timer0_millis*1000;
+}
+
+void delay(unsigned long ms) {
+  wait((uint64_t)ms*1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  advance(us);
+}
+
+static void sregWrite(uint8_t value) {
+  if ((value & 0x80) && twiInterrupt()) isr(TWI_vect);
+}
+
+void sei() { SREG |= 0x80; }
+void cli() { SREG &= (uint8_t)~0x80; }
+
+/* Pins */
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  advance(CPU_CALL_US);
+  if ((pin < 32) && (mode == INPUT_PULLUP)) pins[pin] = HIGH;
+  twiPinMode(pin, mode);
+  dhtPin(pin, mode);
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  advance(CPU_CALL_US);
+  if (pin >= 32) return;
+  pins[pin] = val ? HIGH : LOW;
+  wiflyPin(pin, pins[pin]);
+}
+
+int digitalRead(uint8_t pin) {
+  advance(CPU_CALL_US);
+  if (pin >= 32) return LOW;
+  return pins[pin];
+}
+
+void analogReference(uint8_t mode) {
+  adcReference = mode;
+}
+
+void analogWrite(uint8_t pin, int val) {
+  digitalWrite(pin, val > 127 ? HIGH : LOW);
+}
+
+int analogRead(uint8_t pin) {
+  advance(ADC_US);
+  updateAnalog();
+  double reference = (adcReference == INTERNAL) ? 2560. : vcc;
+  double mv = (pin < 32) ? analogMv[pin] : 0;
+  long value = (long)(mv*1023./reference + (uniform() - 0.5)*2.);  // +-1 LSB of noise
+  if (value < 0) value = 0;
+  if (value > 1023) value = 1023;
+  return (int)value;
+}
+
+/* Random numbers, the avr-libc generator (Park-Miller), apart from the simulation's own */
+
+static unsigned long randomState = 1;
+
+long random(long howbig) {
+  if (howbig == 0) return 0;
+  long x = randomState ? randomState : 123459876L;
+  long hi = x/127773L, lo = x%127773L;
+  x = 16807L*lo - 2836L*hi;
+  if (x < 0) x += 0x7fffffffL;
+  randomState = x;
+  return (x % 0x80000000UL) % howbig;
+}
+
+long random(long howsmall, long howbig) {
+  if (howsmall >= howbig) return howsmall;
+  return random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long seed) {
+  if (seed != 0) randomState = seed;
+}
+
+/* Sleep and watchdog */
+
+void set_sleep_mode(int mode) { sleepMode = mode; }
+void sleep_enable() {}
+void sleep_disable() {}
+void wdt_reset() {}
+void wdt_disable() { WDTCSR = 0; }
+void wdt_enable(int) {}
+
+void sleep_cpu() {
+  if (sleepMode != SLEEP_MODE_PWR_DOWN) {
+    // Idle, the next timer0 tick (1.024 ms) wakes the CPU up
+    wait(1024 - (now % 1024));
+    return;
+  }
+  // Power-down, only the watchdog and a low level on INT2 (Serial1 RX) wake the CPU up
+  uint64_t wake = UINT64_MAX;
+  bool watchdog = false;
+  if (WDTCSR & _BV(WDIE)) {
+    uint8_t index = (WDTCSR & 0x07) | ((WDTCSR >> 2) & 0x08);
+    wake = now + (16000ULL << index);
+    watchdog = true;
+  }
+  bool serial = false;
+  if ((EIMSK & _BV(INT2)) && !uart1.fromDevice.empty() && (uart1.fromDevice.front().first < wake)) {
+    wake = uart1.fromDevice.front().first;
+    uart1.fromDevice.pop_front();   // The UART is off, the start bit only wakes the CPU up
+    serial = true;
+  }
+  if (wake == UINT64_MAX) wake = now + 3600000000ULL;  // Nothing can wake it up, give up after an hour
+  uint64_t slept = wake - now;
+  stopped += slept;
+  // Nothing else runs while the clocks are stopped, but the module and the script go on
+  uint64_t target = now + slept;
+  while (now < target) {
+    uint64_t next = std::min(target, std::min(wiflyNextEvent(), nextScriptEvent()));
+    if (next <= now) next = now + 1;
+    idle += next - now;
+    now = next;
+    if (now >= duration) finish();
+    runScriptEvents();
+    while (!uart1.toDevice.empty() && (uart1.toDevice.front().first <= now)) uart1.toDevice.pop_front();
+    wiflyService();
+  }
+  if (serial) isr(INT2_vect);
+  else if (watchdog) isr(WDT_vect);
+}
+
+void sleep_mode() {
+  sleep_cpu();
+}
+
+/* HardwareSerial */
+
+HardwareSerial Serial(0);
+HardwareSerial Serial1(1);
+
+void HardwareSerial::begin(unsigned long baud) {
+  if (port == 1) uart1.baud = baud;
+}
+
+int HardwareSerial::available() {
+  advance(CPU_CALL_US);
+  if (port == 0) return console.size();
+  return uart1.rx.size();
+}
+
+int HardwareSerial::read() {
+  advance(CPU_CALL_US);
+  std::deque<uint8_t> &queue = (port == 0) ? console : uart1.rx;
+  if (queue.empty()) return -1;
+  uint8_t c = queue.front();
+  queue.pop_front();
+  if (port == 1) counters.uartRx++;
+  return c;
+}
+
+int HardwareSerial::peek() {
+  std::deque<uint8_t> &queue = (port == 0) ? console : uart1.rx;
+  if (queue.empty()) return -1;
+  return queue.front();
+}
+
+void HardwareSerial::flush() {
+  if (port == 0) return;
+  while (!uart1.toDevice.empty()) advance(uart1.toDevice.front().first - now + 1);
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  advance(CPU_CALL_US);
+  if (port == 0) {
+    consoleOutput(c);
+    return 1;
+  }
+  // 64 byte TX buffer, the CPU spins while it is full
+  while (uart1.toDevice.size() >= 64) advance(uart1.toDevice.front().first - now + 1);
+  uint64_t t = std::max(now, uart1.txFree) + byteTime(uart1.baud);
+  uart1.txFree = t;
+  uart1.toDevice.push_back(std::make_pair(t, c));
+  counters.uartTx++;
+  return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+  for (size_t i = 0; i < size; i++) write(buffer[i]);
+  return size;
+}
+
+/* Print */
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t n = 0;
+  while (size--) n += write(*buffer++);
+  return n;
+}
+
+size_t Print::printNumber(unsigned long n, uint8_t base) {
+  char buf[8 * sizeof(long) + 1];
+  char *str = &buf[sizeof(buf) - 1];
+  *str = '\0';
+  if (base < 2) base = 10;
+  do {
+    unsigned long m = n;
+    n /= base;
+    char c = m - base * n;
+    *--str = c < 10 ? c + '0' : c + 'A' - 10;
+  } while (n);
+  return write(str);
+}
+
+size_t Print::print(long n, int base) {
+  if ((base == 10) && (n < 0)) {
+    size_t t = print('-');
+    return printNumber(-n, 10) + t;
+  }
+  return printNumber(n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  return printNumber(n, base);
+}
+
+size_t Print::print(double number, int digits) {
+  char buf[40];
+  if (isnan(number)) return print("nan");
+  if (isinf(number)) return print("inf");
+  snprintf(buf, sizeof(buf), "%.*f", digits, number);
+  return write(buf);
+}
+
+/* Internal EEPROM */
+
+EEPROMClass EEPROM;
+
+uint8_t EEPROMClass::read(int address) {
+  eepromInit();
+  advance(CPU_CALL_US);
+  if ((address < 0) || (address >= SIM_EEPROM_SIZE)) return 0xFF;
+  return eeprom[address];
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+  eepromInit();
+  advance(EEPROM_WRITE_US);
+  if ((address < 0) || (address >= SIM_EEPROM_SIZE)) return;
+  eeprom[address] = value;
+}
@@ -0,0 +1,80 @@
+/*
+
+  main.cpp
+  Runs the firmware (setup() once, then loop()) on virtual time until the
+  script duration is over and prints a key=value report on stdout.
+
+    sck_sim [script] [-d seconds] [-v]
+
+      -d  Overrides the script duration
+      -v  Copies the USB console to stderr
+
+*/
+
+#include "sim.h"
+
+void setup();
+void loop();
+
+extern int *__brkval;
+
+#define FREE_RAM 1024   // Free RAM the firmware sees at the stack depth of main() (bytes)
+
+namespace sim {
+
+  static uint64_t loops = 0;
+
+  void report(FILE *out) {
+    fprintf(out, "sim_s=%.3f\n", now/1e6);
+    fprintf(out, "busy_s=%.3f\n", (now - idle)/1e6);
+    fprintf(out, "idle_s=%.3f\n", idle/1e6);
+    fprintf(out, "powerdown_s=%.3f\n", stopped/1e6);
+    fprintf(out, "loops=%llu\n", (unsigned long long)loops);
+    fprintf(out, "uart_tx_bytes=%llu\n", (unsigned long long)counters.uartTx);
+    fprintf(out, "uart_rx_bytes=%llu\n", (unsigned long long)counters.uartRx);
+    fprintf(out, "uart_rx_dropped=%llu\n", (unsigned long long)uart1.rxDropped);
+    fprintf(out, "i2c_transactions=%llu\n", (unsigned long long)counters.i2cTransactions);
+    fprintf(out, "i2c_bytes=%llu\n", (unsigned long long)counters.i2cBytes);
+    dhtReport(out);
+    wiflyReport(out);
+    fifoReport(out);
+    stageReport(out);
+  }
+
+  void finish() {
+    report(stdout);
+    fflush(stdout);
+    exit(0);
+  }
+
+}
+
+using namespace sim;
+
+int main(int argc, char **argv) {
+  int top;
+  __brkval = (int *)((char *)&top - FREE_RAM);
+  serverEpoch = toEpoch(2016, 6, 1, 10, 0, 0);
+  pins[12] = HIGH;   // CONTROL, the AP mode button is not pressed
+  const char *script = 0;
+  double seconds = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-d") && (i + 1 < argc)) seconds = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-v")) echoConsole = true;
+    else if (argv[i][0] != '-') script = argv[i];
+    else {
+      fprintf(stderr, "usage: %s [script] [-d seconds] [-v]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (script && !loadScript(script)) return 1;
+  if (seconds > 0) duration = (uint64_t)(seconds*1e6);
+  i2cSetup();
+  provision();
+  wiflySetup();
+  setup();
+  while (true) {
+    loop();
+    loops++;
+  }
+}
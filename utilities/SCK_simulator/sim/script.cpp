@@ -0,0 +1,194 @@
+/*
+
+  script.cpp
+  Scenario scripts: one directive per line, '#' starts a comment.
+
+    duration <s>                 Simulated time
+    seed <n>                     Random generator seed (noise, loss, err)
+    usb 0|1                      USB attached (no power-down while attached)
+    echo 0|1                     Copy the USB console to stderr
+    kit <key> <value>            Kit configuration in the internal EEPROM
+                                 (interval, updates, mode, telemetry, apikey, auth, antenna)
+    rtc reset|<Y-M-D h:m:s>      RTC at power up
+    rtc drift <ppm>              RTC running fast (or slow, negative)
+    server time <Y-M-D h:m:s>    Server clock at power up
+    env <name> <value>           Environment the sensors measure
+    knock <g>                    Knocks the kit (40 ms spike on the accelerometer)
+    i2c hang <address> [n]       The next n transactions to that slave stall with SDA held low
+    console <text>               Typed on the USB console, '\r' added
+    wifly|ap|server ...          Module and network behaviour (see wifly.cpp)
+    at <s> <directive>           Runs the directive at that time
+
+*/
+
+#include "sim.h"
+#include <fstream>
+#include <sstream>
+#include <random>
+
+namespace sim {
+
+  uint64_t duration = 3600ULL*1000000ULL;
+  uint64_t serverEpoch = 0;
+
+  static std::mt19937 generator;
+  static std::vector<std::pair<uint64_t, std::vector<std::string> > > timed;
+
+  static struct {
+    uint32_t interval, updates, mode, telemetry;
+    std::string apikey, auth, antenna;
+    bool rtcValid;
+    uint64_t rtcEpoch;
+  } kit = {60, 1, 2, 0, "8b1a9953c4611296a827abf8", "4", "0", false, 0};
+
+  double uniform() {
+    return generator()/4294967296.;
+  }
+
+  static bool parseTime(const std::vector<std::string> &args, size_t first, uint64_t &epoch) {
+    if (args.size() < first + 2) return false;
+    int year, month, day, hour, minutes, seconds;
+    std::string text = args[first] + " " + args[first + 1];
+    if (sscanf(text.c_str(), "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minutes, &seconds) != 6) return false;
+    epoch = toEpoch(year, month, day, hour, minutes, seconds);
+    return true;
+  }
+
+  static bool setEnvironment(const std::string &name, double value) {
+    if (name == "temperature") env.temperature = value;
+    else if (name == "humidity") env.humidity = value;
+    else if (name == "lux") env.lux = value;
+    else if (name == "battery") env.battery = value;
+    else if (name == "panel") env.panel = value;
+    else if (name == "noise") env.noise = value;
+    else if (name == "co") env.coRs = value;
+    else if (name == "no2") env.no2Rs = value;
+    else if (name == "vibration") env.vibration = value;
+    else if (name == "accelx") env.accelX = value;
+    else if (name == "accely") env.accelY = value;
+    else if (name == "accelz") env.accelZ = value;
+    else return false;
+    return true;
+  }
+
+  bool directive(const std::vector<std::string> &args) {
+    if (args.empty()) return true;
+    const std::string &key = args[0];
+    std::string value = (args.size() > 1) ? args[1] : "";
+    if (key == "duration") duration = (uint64_t)(atof(value.c_str())*1e6);
+    else if (key == "seed") generator.seed(atol(value.c_str()));
+    else if (key == "usb") { usb = atoi(value.c_str()); if (usb) USBSTA |= _BV(VBUS); else USBSTA &= ~_BV(VBUS); }
+    else if (key == "echo") echoConsole = atoi(value.c_str());
+    else if ((key == "kit") && (args.size() > 2)) {
+      if (value == "interval") kit.interval = atol(args[2].c_str());
+      else if (value == "updates") kit.updates = atol(args[2].c_str());
+      else if (value == "mode") kit.mode = atol(args[2].c_str());
+      else if (value == "telemetry") kit.telemetry = strtol(args[2].c_str(), 0, 0);
+      else if (value == "apikey") kit.apikey = args[2];
+      else if (value == "auth") kit.auth = args[2];
+      else if (value == "antenna") kit.antenna = args[2];
+      else return false;
+    }
+    else if (key == "rtc") {
+      if ((value == "drift") && (args.size() > 2)) { rtcSetDrift(atof(args[2].c_str())); return true; }
+      if (value == "reset") kit.rtcValid = false;
+      else if (parseTime(args, 1, kit.rtcEpoch)) kit.rtcValid = true;
+      else return false;
+      if (now > 0) rtcSetEpoch(kit.rtcValid ? kit.rtcEpoch : 0);
+    }
+    else if ((key == "server") && (value == "time")) {
+      uint64_t epoch;
+      if (!parseTime(args, 2, epoch)) return false;
+      serverEpoch = epoch - now/1000000;
+    }
+    else if ((key == "env") && (args.size() > 2)) return setEnvironment(value, atof(args[2].c_str()));
+    else if (key == "knock") adxlKnock(atof(value.c_str()));
+    else if (key == "i2c") return i2cDirective(args);
+    else if (key == "console") {
+      std::string text;
+      for (size_t i = 1; i < args.size(); i++) text += (i > 1 ? " " : "") + args[i];
+      consoleInput(text + "\r");
+    }
+    else return wiflyDirective(args);
+    return true;
+  }
+
+  bool loadScript(const char *file) {
+    std::ifstream in(file);
+    if (!in) {
+      fprintf(stderr, "Can't open %s\n", file);
+      return false;
+    }
+    std::string line;
+    int number = 0;
+    while (std::getline(in, line)) {
+      number++;
+      size_t comment = line.find('#');
+      if (comment != std::string::npos) line.erase(comment);
+      std::istringstream words(line);
+      std::vector<std::string> args;
+      std::string word;
+      while (words >> word) args.push_back(word);
+      if (args.empty()) continue;
+      bool ok;
+      if ((args[0] == "at") && (args.size() > 2)) {
+        uint64_t when = (uint64_t)(atof(args[1].c_str())*1e6);
+        timed.push_back(std::make_pair(when, std::vector<std::string>(args.begin() + 2, args.end())));
+        ok = true;
+      } else ok = directive(args);
+      if (!ok) {
+        fprintf(stderr, "%s:%d: unknown directive\n", file, number);
+        return false;
+      }
+    }
+    std::stable_sort(timed.begin(), timed.end(),
+      [](const std::pair<uint64_t, std::vector<std::string> > &a, const std::pair<uint64_t, std::vector<std::string> > &b) { return a.first < b.first; });
+    return true;
+  }
+
+  uint64_t nextScriptEvent() {
+    return timed.empty() ? UINT64_MAX : timed.front().first;
+  }
+
+  void runScriptEvents() {
+    while (!timed.empty() && (timed.front().first <= now)) {
+      std::vector<std::string> args = timed.front().second;
+      timed.erase(timed.begin());
+      if (!directive(args)) fprintf(stderr, "at %.3f: unknown directive %s\n", now/1e6, args[0].c_str());
+    }
+  }
+
+  static void loadLong(int address, uint32_t value) {
+    // Same layout as SCKBase::writeData(), MSB first
+    for (int i = 0; i < 4; i++) eepromLoad(address + i, value >> ((3 - i)*8));
+  }
+
+  static void loadText(int address, const std::string &text) {
+    // Same layout as SCKBase::writeData(), 32 bytes per slot, spaces stored as '$'
+    for (int i = 0; i < 32; i++) {
+      char c = (i < (int)text.size()) ? text[i] : 0x00;
+      if ((address >= 150) && (c == ' ')) c = '$';
+      eepromLoad(address + i, c);
+    }
+  }
+
+  void provision() {
+    // A kit that was set up before: the stored MAC matches the module, so eepromCheck() keeps the settings
+    for (int i = 0; i < 790; i++) eepromLoad(i, 0x00);
+    loadLong(32, kit.interval);      // EE_ADDR_TIME_UPDATE
+    loadLong(36, kit.mode);          // EE_ADDR_SENSOR_MODE
+    loadLong(40, kit.updates);       // EE_ADDR_NUMBER_UPDATES
+    loadLong(44, 0);                 // EE_ADDR_NUMBER_READ_MEASURE
+    loadLong(48, 0);                 // EE_ADDR_NUMBER_WRITE_MEASURE
+    loadLong(52, 1);                 // EE_ADDR_NUMBER_NETS
+    loadText(56, kit.apikey);        // EE_ADDR_APIKEY
+    loadLong(88, kit.telemetry);     // EE_ADDR_TELEMETRY
+    loadText(100, wiflyMac);         // EE_ADDR_MAC
+    loadText(150, wiflyApSsid());    // DEFAULT_ADDR_SSID
+    loadText(310, wiflyApPass());    // DEFAULT_ADDR_PASS
+    loadText(470, kit.auth);         // DEFAULT_ADDR_AUTH
+    loadText(630, kit.antenna);      // DEFAULT_ADDR_ANTENNA
+    rtcSetEpoch(kit.rtcValid ? kit.rtcEpoch : 0);
+  }
+
+}
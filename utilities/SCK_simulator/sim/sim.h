@@ -0,0 +1,148 @@
+/*
+
+  sim.h
+  Shared state of the SCK host simulator.
+
+  - Virtual time in microseconds. Every call into the core costs a little
+    CPU time, delay() and sleep are counted as idle time.
+  - Serial1 is wired to the RN131 (WiFly) model at 9600 baud, byte timing included.
+  - The TWI registers drive the I2C device models (RTC, EEPROM, pots, SHT21, BH1730, ADXL345).
+  - The Goteo build drives PB6 from its DHT22 model and runs the pin change interrupt.
+
+*/
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+// The Arduino min/max macros clash with the standard library, the simulator uses std::min/max
+#include <Arduino.h>
+#undef min
+#undef max
+
+namespace sim {
+
+  /* Time */
+  extern uint64_t now;             // Virtual time (us)
+  extern uint64_t idle;            // Time spent in delay() or asleep (us)
+  extern uint64_t stopped;         // Time spent in power-down, timer0 stopped (us)
+  void advance(uint64_t us);       // CPU busy
+  void wait(uint64_t us);          // CPU idle (delay, sleep)
+  void service();                  // Deliver bytes, fire interrupts and scripted events
+  void finish();                   // Prints the report and exits, at the end of the script
+
+  /* Counters, per run and per stage */
+  struct Counters {
+    uint64_t i2cBytes;
+    uint64_t uartTx;
+    uint64_t uartRx;
+    uint64_t i2cTransactions;
+  };
+  extern Counters counters;
+
+  /* Pins and analog inputs */
+  extern uint8_t pins[32];
+  extern double  analogMv[32];     // Voltage seen by every analog pin (mV), updated by the models
+  extern double  vcc;              // mV
+  extern bool    usb;              // USB attached (VBUS)
+  void eepromLoad(int address, uint8_t value);   // Internal EEPROM, no time spent
+
+  /* Environment the sensors measure */
+  struct Environment {
+    double temperature;            // C
+    double humidity;               // %
+    double lux;
+    double battery;                // mV
+    double panel;                  // mV
+    double noise;                  // mV
+    double coRs;                   // Ohm
+    double no2Rs;                  // Ohm
+    double accelX, accelY, accelZ; // g
+    double vibration;              // g RMS added on top
+  };
+  extern Environment env;
+  void updateAnalog();
+
+  /* I2C devices */
+  struct I2CDevice {
+    uint8_t address;
+    virtual ~I2CDevice() {}
+    virtual void start() {}
+    virtual bool write(uint8_t data) = 0;      // false = NACK
+    virtual bool read(uint8_t &data) = 0;      // false = NACK (device busy)
+    virtual void stop() {}
+    virtual bool acknowledge() { return true; }   // false = address NACK
+    virtual uint64_t stretch() { return 0; }      // SCL held low before the next read byte (us)
+  };
+  I2CDevice *i2cDevice(uint8_t address);
+  void i2cSetup();
+  void twiService();               // Completes the TWI step that is due
+  bool twiInterrupt();             // TWINT with the interrupt enabled
+  uint64_t twiNextEvent();
+  void twiPinMode(uint8_t pin, uint8_t mode);
+  bool i2cDirective(const std::vector<std::string> &args);
+  uint16_t potWiper(uint8_t address, uint8_t wiper);
+  void rtcSetEpoch(uint64_t epoch);
+  void rtcSetDrift(double ppm);
+  void adxlKnock(double g);         // A knock of g on the x axis, now
+  uint8_t eeprom24Byte(uint16_t address);   // 24LC256 memory, no bus traffic
+  extern uint64_t serverEpoch;     // Seconds since 2000-01-01, real time at now == 0
+  uint64_t toEpoch(uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minutes, uint8_t seconds);
+  void fromEpoch(uint64_t epoch, uint16_t &year, uint8_t &month, uint8_t &day, uint8_t &hour, uint8_t &minutes, uint8_t &seconds);
+
+  /* DHT22 (Goteo), edges on PB6 for the pin change interrupt */
+  void dhtPin(uint8_t pin, uint8_t mode);   // Start signal and release by the MCU
+  bool dhtEdge();                           // Drives the next due edge, true if there was one
+  uint64_t dhtNextEvent();
+  void dhtReport(FILE *out);
+
+  /* Serial ports */
+  struct Port {
+    std::deque<std::pair<uint64_t, uint8_t> > toDevice;   // Bytes on the wire to the module
+    std::deque<std::pair<uint64_t, uint8_t> > fromDevice; // Bytes on the wire to the MCU
+    std::deque<uint8_t> rx;                               // HardwareSerial RX buffer (64 bytes)
+    uint64_t txFree;                                      // When the UART shifter is free
+    uint64_t rxFree;
+    uint32_t baud;
+    uint64_t rxDropped;
+  };
+  extern Port uart1;
+  void toFirmware(const std::string &text, uint64_t at);  // WiFly output
+  void consoleInput(const std::string &text);             // USB console input
+  extern bool echoConsole;
+
+  /* WiFly RN131 model */
+  void wiflySetup();
+  void wiflyReceive(uint8_t c, uint64_t at);
+  void wiflyService();
+  uint64_t wiflyNextEvent();
+  void wiflyPin(uint8_t pin, uint8_t value);
+  bool wiflyDirective(const std::vector<std::string> &args);
+  void wiflyReport(FILE *out);
+  std::string wiflyApSsid();
+  std::string wiflyApPass();
+  extern std::string wiflyMac;
+
+  /* Firmware stages (SCKStage.h) */
+  void stageReport(FILE *out);
+  void fifoStage(const char *name, bool begin);   // Weight check around "compact"
+  void fifoReport(FILE *out);
+
+  /* Scripts */
+  bool loadScript(const char *file);
+  bool directive(const std::vector<std::string> &args);
+  uint64_t nextScriptEvent();
+  void runScriptEvents();
+  extern uint64_t duration;        // us
+  double uniform();                // 0..1, seeded with "seed"
+  void provision();
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+/*
+
+  stages.cpp
+  Per-stage accounting for the STAGE_BEGIN / STAGE_END markers of the
+  firmware (SCKStage.h): calls, wall time, CPU busy time and bus bytes.
+  Nested stages are inclusive, a stage counts everything its callees do.
+
+*/
+
+#include "sim.h"
+#include <map>
+
+namespace sim {
+
+  struct Stage {
+    uint64_t count;
+    uint64_t wall, wallMax, busy;
+    uint64_t i2cBytes, uartTx, uartRx;
+  };
+
+  struct OpenStage {
+    std::string name;
+    uint64_t start, idle;
+    Counters counters;
+  };
+
+  static std::map<std::string, Stage> stages;
+  static std::vector<OpenStage> open;
+
+  void stageReport(FILE *out) {
+    for (std::map<std::string, Stage>::iterator it = stages.begin(); it != stages.end(); ++it) {
+      const char *name = it->first.c_str();
+      const Stage &stage = it->second;
+      double count = stage.count ? stage.count : 1;
+      fprintf(out, "stage_%s_count=%llu\n", name, (unsigned long long)stage.count);
+      fprintf(out, "stage_%s_wall_ms=%.3f\n", name, stage.wall/count/1e3);
+      fprintf(out, "stage_%s_wall_max_ms=%.3f\n", name, stage.wallMax/1e3);
+      fprintf(out, "stage_%s_busy_ms=%.3f\n", name, stage.busy/count/1e3);
+      fprintf(out, "stage_%s_i2c_bytes=%.1f\n", name, stage.i2cBytes/count);
+      fprintf(out, "stage_%s_uart_tx_bytes=%.1f\n", name, stage.uartTx/count);
+      fprintf(out, "stage_%s_uart_rx_bytes=%.1f\n", name, stage.uartRx/count);
+    }
+  }
+
+}
+
+using namespace sim;
+
+void simStageBegin(const char *name) {
+  OpenStage stage = {name, now, idle, counters};
+  open.push_back(stage);
+  fifoStage(name, true);
+}
+
+void simStageEnd(const char *name) {
+  fifoStage(name, false);
+  // Close the innermost stage with that name, a missing END only loses that stage
+  for (size_t i = open.size(); i > 0; i--) {
+    if (open[i - 1].name != name) continue;
+    const OpenStage &begin = open[i - 1];
+    Stage &stage = stages[name];
+    uint64_t wall = now - begin.start;
+    stage.count++;
+    stage.wall += wall;
+    stage.wallMax = std::max(stage.wallMax, wall);
+    stage.busy += wall - (idle - begin.idle);
+    stage.i2cBytes += counters.i2cBytes - begin.counters.i2cBytes;
+    stage.uartTx += counters.uartTx - begin.counters.uartTx;
+    stage.uartRx += counters.uartRx - begin.counters.uartRx;
+    open.erase(open.begin() + (i - 1), open.end());
+    return;
+  }
+}
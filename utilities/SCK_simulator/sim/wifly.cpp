@@ -0,0 +1,505 @@
+/*
+
+  wifly.cpp
+  RN131 (WiFly) command interpreter and a stand-in for data.smartcitizen.me.
+
+  - Data mode, "$$$" with a guard time enters command mode ("CMD").
+  - Command mode echoes every character, answers on '\r' and ends every
+    answer with the "<4.75> " prompt, like firmware 4.75 does.
+  - open connects to the HTTP stand-in, the connection is in data mode
+    until the server closes it (*CLOS*).
+  - Scriptable: response latency, lost responses, ERR injection, module
+    reboots, access point and server outages.
+
+*/
+
+#include "sim.h"
+#include <functional>
+#include <set>
+
+#define WIFLY_PROMPT      "\r\n<4.75> "
+#define WIFLY_VERSION     "wifly-GSX Ver 4.75 Build r1764, Mar  5 2014 11:27:35 on RN-131"
+#define GUARD_TIME_US     200000    // Silence after "$$$"
+#define COMMAND_US        5000      // Time to answer a command
+#define JOIN_US           1500000   // Scan, authenticate and DHCP
+#define BOOT_US           1000000   // Reboot until *READY*
+#define WAKE_US           150000    // Wake up from sleep until *READY*
+#define SCAN_US           2500000
+#define OPEN_US           300000    // TCP connect
+#define SAVE_US           200000    // Storing in config
+#define HTTP_US           150000    // Server processing
+#define HTTP_TIMEOUT_US   10000000  // The server drops a connection without a complete request
+
+namespace sim {
+
+  std::string wiflyMac = "00:06:66:50:3a:1c";
+
+  enum Mode { DATA, CMD, CONN };
+
+  struct Event {
+    uint64_t at;
+    std::function<void()> action;
+  };
+
+  static struct Module {
+    bool awake = true;
+    Mode mode = DATA;
+    bool associated = false;
+    uint64_t lastByte = 0;
+    uint8_t dollars = 0;
+    std::string line;
+    std::string request;
+    uint32_t connection = 0;                // Id of the open connection, 0 if none
+    // Stored configuration, the kit was set up before
+    std::string ssid = "SmartCitizen";
+    std::string phrase = "citizen2016";
+    std::string key, auth = "4";
+    int join = 1;
+    // Scripted behaviour
+    uint64_t latency = 0;                   // Added to every answer (us)
+    double loss = 0;                        // Probability an answer is lost
+    double err = 0;                         // Probability a command fails with ERR
+    bool apUp = true;
+    std::string apSsid = "SmartCitizen";
+    std::string apPass = "citizen2016";
+    uint32_t apNets = 4;                    // Networks in a scan
+    bool serverUp = true;
+    uint64_t serverLatency = 0;
+    double serverLoss = 0;
+    // Accounting
+    uint64_t awakeSince = 0, awakeTime = 0;
+  } m;
+
+  static struct {
+    uint64_t commandModes, commands, errors, lost, joins, joinFails, reboots, sleeps, scans;
+    uint64_t opens, openFails, timeRequests, posts, records, postBytes, dropped;
+    double ageSum, ageMax;
+    uint64_t newest, liveUpdates;  // Newest timestamp at the server, posts that moved it
+    double liveAgeSum, liveAgeMax;
+  } stats;
+
+  static std::set<uint64_t> stamps;  // Every timestamp that reached the server, for the gaps
+
+  static std::vector<Event> events;
+
+  // Health telemetry the firmware adds to the live reading: posts that carried it, sum and max
+  static const char *telemetryFields[] = {"fifo", "connect_ms", "cmd_retries", "open_retries", "cycle_ms", "reset", "free_ram", "nets_age"};
+  static struct { uint64_t count; double sum, max; } telemetry[sizeof(telemetryFields)/sizeof(telemetryFields[0])];
+
+  static void at(uint64_t when, std::function<void()> action) {
+    Event event = {when, action};
+    events.push_back(event);
+  }
+
+  static void reply(const std::string &text, uint64_t delay = COMMAND_US) {
+    if (uniform() < m.loss) {
+      stats.lost++;
+      return;
+    }
+    toFirmware(text, now + delay + m.latency);
+  }
+
+  static void prompt(const std::string &text, uint64_t delay = COMMAND_US) {
+    reply("\r\n" + text + WIFLY_PROMPT, delay);
+  }
+
+  static bool canJoin() {
+    if (!m.apUp || (m.ssid != m.apSsid)) return false;
+    if (m.apPass.empty()) return true;
+    if ((m.auth == "1") || (m.auth == "8")) return m.key == m.apPass;   // WEP-128, WEP-64: only the key
+    return m.phrase == m.apPass;
+  }
+
+  static void autoJoin(uint64_t delay) {
+    // "set wlan join 1", the module joins the stored network on its own after a boot
+    if ((m.join != 1) || !canJoin()) return;
+    at(now + delay, []() { if (m.awake && canJoin()) m.associated = true; });
+  }
+
+  static void wake() {
+    m.awake = true;
+    m.awakeSince = now;
+    m.mode = DATA;
+    m.dollars = 0;
+  }
+
+  static void fallAsleep() {
+    if (!m.awake) return;
+    m.awake = false;
+    m.awakeTime += now - m.awakeSince;
+    m.associated = false;
+    m.connection = 0;
+    m.mode = DATA;
+    stats.sleeps++;
+  }
+
+  static void reboot(uint64_t delay) {
+    stats.reboots++;
+    m.associated = false;
+    m.connection = 0;
+    m.mode = DATA;
+    m.line.clear();
+    toFirmware("*Reboot*", now + COMMAND_US);
+    toFirmware("*READY*\r\n", now + delay);
+    autoJoin(delay + JOIN_US);
+  }
+
+  /* HTTP stand-in */
+
+  static const char *weekdays[] = {"Sat", "Sun", "Mon", "Tue", "Wed", "Thu", "Fri"};
+  static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+  static uint64_t serverTime() {
+    return serverEpoch + now/1000000;
+  }
+
+  static std::string httpDate(uint64_t epoch) {
+    uint16_t year; uint8_t month, day, hour, minutes, seconds;
+    fromEpoch(epoch, year, month, day, hour, minutes, seconds);
+    char text[64];
+    snprintf(text, sizeof(text), "Date: %s, %02d %s %d %02d:%02d:%02d GMT\r\n", weekdays[(epoch/86400)%7], day, months[month - 1], year, hour, minutes, seconds);
+    return text;
+  }
+
+  static void closeConnection(uint32_t id, uint64_t when) {
+    at(when, [id]() {
+      if (m.connection != id) return;
+      m.connection = 0;
+      if (m.mode == CONN) m.mode = DATA;
+      toFirmware("*CLOS*", now);
+    });
+  }
+
+  static void countRecords(const std::string &data) {
+    // Every reading is one JSON object with its own timestamp
+    // The dashboard shows the newest one: when a post moves it, its age is the live age
+    size_t position = 0;
+    uint64_t newest = 0;
+    while ((position = data.find("\"timestamp\":\"", position)) != std::string::npos) {
+      position += 13;
+      stats.records++;
+      int year, month, day, hour, minutes, seconds;
+      if (sscanf(data.c_str() + position, "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minutes, &seconds) == 6) {
+        uint64_t epoch = toEpoch(year, month, day, hour, minutes, seconds);
+        double age = (double)serverTime() - (double)epoch;
+        stats.ageSum += age;
+        stats.ageMax = std::max(stats.ageMax, age);
+        newest = std::max(newest, epoch);
+        stamps.insert(epoch);
+      }
+    }
+    if (newest > stats.newest) {
+      double age = (double)serverTime() - (double)newest;
+      stats.newest = newest;
+      stats.liveUpdates++;
+      stats.liveAgeSum += age;
+      stats.liveAgeMax = std::max(stats.liveAgeMax, age);
+    }
+  }
+
+  static void countTelemetry(const std::string &data) {
+    for (size_t i = 0; i < sizeof(telemetryFields)/sizeof(telemetryFields[0]); i++) {
+      std::string key = std::string("\"") + telemetryFields[i] + "\":\"";
+      size_t position = data.find(key);
+      if (position == std::string::npos) continue;
+      double value = atof(data.c_str() + position + key.size());
+      telemetry[i].count++;
+      telemetry[i].sum += value;
+      telemetry[i].max = std::max(telemetry[i].max, value);
+    }
+  }
+
+  static void httpRequest() {
+    std::string request = m.request;
+    m.request.clear();
+    uint32_t id = m.connection;
+    if (uniform() < m.serverLoss) {
+      stats.dropped++;
+      closeConnection(id, now + HTTP_TIMEOUT_US);
+      return;
+    }
+    uint64_t delay = HTTP_US + m.serverLatency;
+    std::string response = "HTTP/1.1 200 OK\r\n" + httpDate(serverTime() + delay/1000000);
+    if (request.compare(0, 13, "GET /datetime") == 0) {
+      stats.timeRequests++;
+      uint16_t year; uint8_t month, day, hour, minutes, seconds;
+      fromEpoch(serverTime() + delay/1000000, year, month, day, hour, minutes, seconds);
+      char body[40];
+      snprintf(body, sizeof(body), "UTC:%d,%d,%d,%d,%d,%d#", year, month, day, hour, minutes, seconds);
+      response += "\r\n";
+      response += body;
+    } else if (request.compare(0, 8, "PUT /add") == 0) {
+      stats.posts++;
+      stats.postBytes += request.size();
+      countRecords(request);
+      countTelemetry(request);
+      response += "\r\n";
+    } else {
+      response = "HTTP/1.1 404 Not Found\r\n\r\n";
+    }
+    toFirmware(response, now + delay);
+    closeConnection(id, now + delay + response.size()*1042 + 1000);
+  }
+
+  static void httpReceive(uint8_t c) {
+    m.request += (char)c;
+    size_t length = m.request.size();
+    // The request ends with an empty line, the firmware uses both "\n" and "\r\n"
+    if ((length >= 2) && (m.request[length - 1] == '\n') &&
+        ((m.request[length - 2] == '\n') || ((length >= 3) && (m.request.compare(length - 3, 3, "\n\r\n") == 0)))) {
+      httpRequest();
+    }
+  }
+
+  /* Command interpreter */
+
+  static std::string spaces(std::string text) {
+    // The firmware stores and sends spaces as '$', the RN131 reads them back as spaces
+    std::replace(text.begin(), text.end(), '$', ' ');
+    return text;
+  }
+
+  static bool startsWith(const std::string &text, const char *prefix) {
+    return text.compare(0, strlen(prefix), prefix) == 0;
+  }
+
+  static void command(const std::string &line) {
+    stats.commands++;
+    if (line.empty()) {
+      reply(WIFLY_PROMPT);
+      return;
+    }
+    if (uniform() < m.err) {
+      stats.errors++;
+      prompt("ERR: Bad Args");
+      return;
+    }
+    if (startsWith(line, "set ")) {
+      std::string args = line.substr(4);
+      size_t space = args.rfind(' ');
+      std::string value = (space == std::string::npos) ? "" : args.substr(space + 1);
+      if (startsWith(args, "wlan ssid ")) m.ssid = spaces(args.substr(10));
+      else if (startsWith(args, "wlan phrase ")) m.phrase = spaces(args.substr(12));
+      else if (startsWith(args, "wlan key ")) m.key = spaces(args.substr(9));
+      else if (startsWith(args, "wlan auth ")) m.auth = value;
+      else if (startsWith(args, "wlan join ")) m.join = atoi(value.c_str());
+      prompt("AOK");
+    } else if (line == "save") {
+      prompt("Storing in config", SAVE_US);
+    } else if (line == "reboot") {
+      reboot(BOOT_US);
+    } else if (line == "factory R") {
+      m.ssid.clear(); m.phrase.clear(); m.key.clear();
+      m.join = 1;
+      prompt("Set Factory Defaults", SAVE_US);
+    } else if (startsWith(line, "join")) {
+      stats.joins++;
+      std::string ssid = (line.size() > 5) ? line.substr(5) : m.ssid;
+      if (!ssid.empty()) m.ssid = ssid;
+      if (canJoin()) {
+        m.associated = false;
+        reply("\r\nAuto-Assoc " + m.ssid + " chan=1 mode=WPA2 SCAN OK\r\nJoining " + m.ssid + " now..\r\n", COMMAND_US);
+        reply("Associated!\r\nDHCP: Start\r\nDHCP in 50ms, lease=86400s\r\nIF=UP\r\nDHCP=ON\r\nIP=192.168.1.50:2000\r\n"
+              "NetMask=255.255.255.0\r\nGateway=192.168.1.1\r\nListen on 2000" WIFLY_PROMPT, JOIN_US);
+        at(now + JOIN_US + m.latency, []() { m.associated = canJoin(); });
+      } else {
+        stats.joinFails++;
+        m.associated = false;
+        reply("\r\nAuto-Assoc " + m.ssid + " chan=0 mode=NONE FAILED" WIFLY_PROMPT, JOIN_US);
+      }
+    } else if (line == "exit") {
+      reply("\r\nEXIT\r\n");
+      m.mode = m.connection ? CONN : DATA;
+    } else if (line == "get mac") {
+      prompt("Mac Addr=" + wiflyMac);
+    } else if (line == "ver") {
+      prompt(WIFLY_VERSION);
+    } else if (line == "scan") {
+      stats.scans++;
+      std::string result = "\r\nSCAN:Found " + std::to_string(m.apUp ? m.apNets : 0) + "\r\n";
+      for (uint32_t i = 0; m.apUp && (i < m.apNets); i++) {
+        char net[80];
+        snprintf(net, sizeof(net), "%02u,01,-%02u,04,3104,28,c0,00:1d:7e:4c:%02x:%02x,%s\r\n", i + 1, 45 + i*7, i, i*3, i ? "neighbour" : m.apSsid.c_str());
+        result += net;
+      }
+      reply(result + "END:" WIFLY_PROMPT, SCAN_US);
+    } else if (startsWith(line, "open ")) {
+      stats.opens++;
+      if (m.associated && m.serverUp) {
+        static uint32_t connections = 0;
+        uint32_t id = ++connections;
+        at(now + OPEN_US + m.latency, [id]() {
+          m.connection = id;
+          m.mode = CONN;
+          m.request.clear();
+          toFirmware("*OPEN*", now);
+          closeConnection(id, now + HTTP_TIMEOUT_US);
+        });
+      } else {
+        stats.openFails++;
+        prompt("Connect FAILED", OPEN_US);
+      }
+    } else if (line == "close") {
+      if (m.connection) {
+        m.connection = 0;
+        reply("*CLOS*" WIFLY_PROMPT);
+      } else prompt("ERR:No Conn?");
+    } else if (line == "sleep") {
+      // Goes to sleep right away, no answer
+      at(now + COMMAND_US, []() { fallAsleep(); });
+    } else if (startsWith(line, "ftp update")) {
+      prompt("FTP OK.", 30000000);
+    } else if (startsWith(line, "get ")) {
+      prompt("AOK");
+    } else {
+      stats.errors++;
+      prompt("ERR: ?-Cmd");
+    }
+  }
+
+  void wiflyReceive(uint8_t c, uint64_t time) {
+    if (!m.awake) return;
+    uint64_t gap = time - m.lastByte;
+    m.lastByte = time;
+    if (m.mode == CMD) {
+      if (c == '\n') return;
+      reply(std::string(1, (char)c), 0);   // Echo
+      if (c == '\r') {
+        std::string line = m.line;
+        m.line.clear();
+        command(line);
+      } else if (m.line.size() < 128) m.line += (char)c;
+      return;
+    }
+    if (m.mode == CONN) httpReceive(c);
+    // "$$$" and silence for the guard time enters command mode
+    if (c != '$') {
+      m.dollars = 0;
+      return;
+    }
+    if ((m.dollars > 0) && (gap > GUARD_TIME_US)) m.dollars = 0;
+    if (++m.dollars < 3) return;
+    m.dollars = 0;
+    uint64_t third = time;
+    at(time + GUARD_TIME_US, [third]() {
+      if (!m.awake || (m.lastByte != third) || (m.mode == CMD)) return;
+      stats.commandModes++;
+      m.mode = CMD;
+      m.line.clear();
+      toFirmware("CMD\r\n", now + m.latency);
+    });
+  }
+
+  void wiflyPin(uint8_t pin, uint8_t value) {
+    static uint8_t awakePin = LOW;
+    if (pin != 4) return;   // AWAKE
+    if (value && !awakePin && !m.awake) {
+      wake();
+      toFirmware("*READY*\r\n", now + WAKE_US);
+      autoJoin(WAKE_US + JOIN_US);
+    }
+    awakePin = value;
+  }
+
+  void wiflyService() {
+    // Run every due event, an event may schedule new ones
+    bool again = true;
+    while (again) {
+      again = false;
+      for (size_t i = 0; i < events.size(); i++) {
+        if (events[i].at > now) continue;
+        std::function<void()> action = events[i].action;
+        events.erase(events.begin() + i);
+        action();
+        again = true;
+        break;
+      }
+    }
+  }
+
+  uint64_t wiflyNextEvent() {
+    uint64_t next = UINT64_MAX;
+    for (size_t i = 0; i < events.size(); i++) next = std::min(next, events[i].at);
+    return next;
+  }
+
+  void wiflySetup() {
+    // Powered up with the kit, it boots and joins the stored network
+    m.ssid = m.apSsid;
+    m.phrase = m.apPass;
+    toFirmware("*READY*\r\n", now + BOOT_US);
+    autoJoin(BOOT_US + JOIN_US);
+  }
+
+  std::string wiflyApSsid() { return m.apSsid; }
+  std::string wiflyApPass() { return m.apPass; }
+
+  bool wiflyDirective(const std::vector<std::string> &args) {
+    if (args.size() < 2) return false;
+    const std::string &key = args[0];
+    const std::string &value = args[1];
+    if (key == "wifly") {
+      if ((value == "latency") && (args.size() > 2)) m.latency = atol(args[2].c_str())*1000ULL;
+      else if ((value == "loss") && (args.size() > 2)) m.loss = atof(args[2].c_str());
+      else if ((value == "err") && (args.size() > 2)) m.err = atof(args[2].c_str());
+      else if (value == "reboot") { if (m.awake) reboot(BOOT_US); }
+      else if ((value == "mac") && (args.size() > 2)) wiflyMac = args[2];
+      else if (value == "factory") { m.ssid.clear(); m.phrase.clear(); m.key.clear(); }
+      else return false;
+      return true;
+    }
+    if (key == "ap") {
+      if (value == "up") { m.apUp = true; if (m.awake && !m.associated) autoJoin(JOIN_US); }
+      else if (value == "down") { m.apUp = false; m.associated = false; }
+      else if ((value == "ssid") && (args.size() > 2)) m.apSsid = args[2];
+      else if ((value == "pass") && (args.size() > 2)) m.apPass = args[2];
+      else if ((value == "nets") && (args.size() > 2)) m.apNets = atol(args[2].c_str());
+      else return false;
+      return true;
+    }
+    if (key == "server") {
+      if (value == "up") m.serverUp = true;
+      else if (value == "down") m.serverUp = false;
+      else if ((value == "latency") && (args.size() > 2)) m.serverLatency = atol(args[2].c_str())*1000ULL;
+      else if ((value == "loss") && (args.size() > 2)) m.serverLoss = atof(args[2].c_str());
+      else return false;
+      return true;
+    }
+    return false;
+  }
+
+  void wiflyReport(FILE *out) {
+    uint64_t awake = m.awakeTime + (m.awake ? now - m.awakeSince : 0);
+    fprintf(out, "wifly_awake_s=%.3f\n", awake/1e6);
+    fprintf(out, "wifly_command_modes=%llu\n", (unsigned long long)stats.commandModes);
+    fprintf(out, "wifly_commands=%llu\n", (unsigned long long)stats.commands);
+    fprintf(out, "wifly_errors=%llu\n", (unsigned long long)stats.errors);
+    fprintf(out, "wifly_lost=%llu\n", (unsigned long long)stats.lost);
+    fprintf(out, "wifly_joins=%llu\n", (unsigned long long)stats.joins);
+    fprintf(out, "wifly_join_fails=%llu\n", (unsigned long long)stats.joinFails);
+    fprintf(out, "wifly_reboots=%llu\n", (unsigned long long)stats.reboots);
+    fprintf(out, "wifly_sleeps=%llu\n", (unsigned long long)stats.sleeps);
+    fprintf(out, "wifly_scans=%llu\n", (unsigned long long)stats.scans);
+    fprintf(out, "wifly_opens=%llu\n", (unsigned long long)stats.opens);
+    fprintf(out, "wifly_open_fails=%llu\n", (unsigned long long)stats.openFails);
+    fprintf(out, "server_time_requests=%llu\n", (unsigned long long)stats.timeRequests);
+    fprintf(out, "server_posts=%llu\n", (unsigned long long)stats.posts);
+    fprintf(out, "server_records=%llu\n", (unsigned long long)stats.records);
+    fprintf(out, "server_post_bytes=%llu\n", (unsigned long long)stats.postBytes);
+    fprintf(out, "server_dropped=%llu\n", (unsigned long long)stats.dropped);
+    fprintf(out, "server_record_age_avg_s=%.1f\n", stats.records ? stats.ageSum/stats.records : 0.);
+    fprintf(out, "server_record_age_max_s=%.1f\n", stats.ageMax);
+    fprintf(out, "server_live_age_avg_s=%.1f\n", stats.liveUpdates ? stats.liveAgeSum/stats.liveUpdates : 0.);
+    fprintf(out, "server_live_age_max_s=%.1f\n", stats.liveAgeMax);
+    uint64_t gap = 0;
+    for (std::set<uint64_t>::iterator i = stamps.begin(); i != stamps.end(); ++i)
+      if (i != stamps.begin()) gap = std::max(gap, *i - *std::prev(i));
+    fprintf(out, "server_gap_max_s=%llu\n", (unsigned long long)gap);
+    for (size_t i = 0; i < sizeof(telemetryFields)/sizeof(telemetryFields[0]); i++) {
+      if (!telemetry[i].count) continue;
+      fprintf(out, "server_%s_avg=%.1f\n", telemetryFields[i], telemetry[i].sum/telemetry[i].count);
+      fprintf(out, "server_%s_max=%.0f\n", telemetryFields[i], telemetry[i].max);
+    }
+  }
+
+}